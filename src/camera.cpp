@@ -1,7 +1,135 @@
 #include "camera.h"
 
+#include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
+
+#include "metrics.h"
+#include "scheduler.h"
+#include "trace.h"
+
 using namespace paper;
 
+/*******************************************/
+// Weighted sum of the four corners of a tetrahedron, written to a BGR8u pixel
+static inline void blendCorners(unsigned char* pPixel, const float* pC0, const float* pC1, const float* pC2, const float* pC3,
+                                float pW0, float pW1, float pW2, float pW3)
+{
+#if CV_SSE2
+    // The three channels of each corner in one register, without reading
+    // past the end of the LUT
+    __m128 lC0 = _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)pC0), _mm_load_ss(pC0+2));
+    __m128 lC1 = _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)pC1), _mm_load_ss(pC1+2));
+    __m128 lC2 = _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)pC2), _mm_load_ss(pC2+2));
+    __m128 lC3 = _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)pC3), _mm_load_ss(pC3+2));
+
+    __m128 lSum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lC0, _mm_set1_ps(pW0)), _mm_mul_ps(lC1, _mm_set1_ps(pW1))),
+                             _mm_add_ps(_mm_mul_ps(lC2, _mm_set1_ps(pW2)), _mm_mul_ps(lC3, _mm_set1_ps(pW3))));
+
+    // Rounded and saturated as saturate_cast
+    __m128i lValues = _mm_cvtps_epi32(lSum);
+    lValues = _mm_packs_epi32(lValues, lValues);
+    lValues = _mm_packus_epi16(lValues, lValues);
+    int lBGR = _mm_cvtsi128_si32(lValues);
+    pPixel[0] = (unsigned char)lBGR;
+    pPixel[1] = (unsigned char)(lBGR >> 8);
+    pPixel[2] = (unsigned char)(lBGR >> 16);
+#else
+    for(int c=0; c<3; c++)
+        pPixel[c] = saturate_cast<unsigned char>(pW0*pC0[c] + pW1*pC1[c] + pW2*pC2[c] + pW3*pC3[c]);
+#endif
+}
+
+/*******************************************/
+// Applies a 3D LUT to blocks of rows of a BGR8u frame,
+// with tetrahedral interpolation. The tetrahedron is selected per pixel,
+// its corners being blended with SSE2 when available
+class iccLutTransform : public ParallelLoopBody
+{
+public:
+    iccLutTransform(Mat& pFrame, const std::vector<float>& pLut, unsigned int pSize)
+        : mFrame(pFrame), mLut(pLut), mSize(pSize)
+    {
+        // Node index and position between nodes, for each 8 bits value
+        for(int i=0; i<256; i++)
+        {
+            float lPosition = (float)i*(float)(mSize-1)/255.f;
+            mIndex[i] = min((int)lPosition, (int)mSize-2);
+            mFraction[i] = lPosition-(float)mIndex[i];
+        }
+    }
+
+    void operator()(const Range& pRange) const
+    {
+        const int lStrideB = mSize*mSize*3;
+        const int lStrideG = mSize*3;
+        const int lStrideR = 3;
+
+        for(int y=pRange.start; y<pRange.end; y++)
+        {
+            unsigned char* lPixel = mFrame.ptr<unsigned char>(y);
+            for(int x=0; x<mFrame.cols; x++, lPixel+=3)
+            {
+                float lFb = mFraction[lPixel[0]];
+                float lFg = mFraction[lPixel[1]];
+                float lFr = mFraction[lPixel[2]];
+                const float* lC000 = &mLut[mIndex[lPixel[0]]*lStrideB + mIndex[lPixel[1]]*lStrideG + mIndex[lPixel[2]]*lStrideR];
+                const float* lC111 = lC000 + lStrideB + lStrideG + lStrideR;
+
+                // Select the tetrahedron containing the point, and the
+                // two corners between c000 and c111 along its edges
+                const float *lC1, *lC2;
+                float lW0, lW1, lW2, lW3;
+                if(lFb >= lFg)
+                {
+                    if(lFg >= lFr)
+                    {
+                        lC1 = lC000 + lStrideB; lC2 = lC1 + lStrideG;
+                        lW1 = lFb-lFg; lW2 = lFg-lFr; lW3 = lFr;
+                    }
+                    else if(lFb >= lFr)
+                    {
+                        lC1 = lC000 + lStrideB; lC2 = lC1 + lStrideR;
+                        lW1 = lFb-lFr; lW2 = lFr-lFg; lW3 = lFg;
+                    }
+                    else
+                    {
+                        lC1 = lC000 + lStrideR; lC2 = lC1 + lStrideB;
+                        lW1 = lFr-lFb; lW2 = lFb-lFg; lW3 = lFg;
+                    }
+                }
+                else
+                {
+                    if(lFr >= lFg)
+                    {
+                        lC1 = lC000 + lStrideR; lC2 = lC1 + lStrideG;
+                        lW1 = lFr-lFg; lW2 = lFg-lFb; lW3 = lFb;
+                    }
+                    else if(lFr >= lFb)
+                    {
+                        lC1 = lC000 + lStrideG; lC2 = lC1 + lStrideR;
+                        lW1 = lFg-lFr; lW2 = lFr-lFb; lW3 = lFb;
+                    }
+                    else
+                    {
+                        lC1 = lC000 + lStrideG; lC2 = lC1 + lStrideB;
+                        lW1 = lFg-lFb; lW2 = lFb-lFr; lW3 = lFr;
+                    }
+                }
+                lW0 = 1.f-lW1-lW2-lW3;
+
+                blendCorners(lPixel, lC000, lC1, lC2, lC111, lW0, lW1, lW2, lW3);
+            }
+        }
+    }
+
+private:
+    Mat& mFrame;
+    const std::vector<float>& mLut;
+    unsigned int mSize;
+    int mIndex[256];
+    float mFraction[256];
+};
+
 /*******************************************/
 camera::camera()
 {
@@ -11,14 +139,45 @@ camera::camera()
     mGain = 0.f;
     mDefaultISO = 100.f;
     mFOV = 50.f;
+    mWidth = 0;
+    mHeight = 0;
+
+    mCapturing = false;
+    mCaptureUndistort = true;
+    mRawMode = false;
+    mBayerPattern = eBayerRGGB;
+
+    mQueueDepth = 4;
+    mSequence = 0;
+    mChangeSequence = 0;
+    mSettingsId = 0;
+    exposureChanged();
+    mCurrentExposure = mNextExposure;
+
+    mReplayFrameRate = 7.5f;
+    mReplayRealTime = true;
+    mReplayLatency = 0;
+    mReplayCount = 0;
+    mReplayIndex = -1;
+    mReplayShutter = mReplayNextShutter = mShutter;
+    mReplayGain = mReplayNextGain = mGain;
+    mReplayNextCount = 0;
+    mReplayNextTime = 0.0;
 
     mICCTransform = NULL;
     mIsLabD65 = false;
+    mUseICCLut = true;
+    mICCHash = 0;
+    mCalibrationHash = 0;
+    mSnapshot = NULL;
+    mICCLutSize = 33;
 }
 
 /*******************************************/
 camera::~camera()
 {
+    stopCapture();
+
     if(mICCTransform != NULL)
         cmsDeleteTransform(mICCTransform);
 }
@@ -44,6 +203,30 @@ bool camera::open(cameraType pCamera)
             // Get some informations
             mWidth = mCamera.get(CV_CAP_PROP_FRAME_WIDTH);
             mHeight = mCamera.get(CV_CAP_PROP_FRAME_HEIGHT);
+            if(mRawMode)
+                mCamera.set(CV_CAP_PROP_CONVERT_RGB, 0);
+            return true;
+        }
+        break;
+    case replay:
+        if(mReplayFrames.size() == 0)
+        {
+            mCameraType = none;
+            return false;
+        }
+        else
+        {
+            mCameraType = pCamera;
+            mReplayCount = 0;
+            mReplayIndex = -1;
+            mReplayNextTime = 0.0;
+            setShutter(mShutter);
+            setGain(mGain);
+            mReplayShutter = mReplayNextShutter;
+            mReplayGain = mReplayNextGain;
+
+            mWidth = mReplayFrames[0].cols;
+            mHeight = mReplayFrames[0].rows;
             return true;
         }
         break;
@@ -52,22 +235,112 @@ bool camera::open(cameraType pCamera)
     }
 }
 
+/*******************************************/
+bool camera::setReplaySource(const char* pFile, bool pRealTime)
+{
+    FileStorage lFile;
+    lFile.open(pFile, FileStorage::READ);
+    if(!lFile.isOpened())
+    {
+        std::cerr << "Error while opening replay description file." << std::endl;
+        return false;
+    }
+
+    std::string lSource;
+    lFile["source"] >> lSource;
+    if(!lFile["frameRate"].empty())
+        lFile["frameRate"] >> mReplayFrameRate;
+    if(!lFile["latency"].empty())
+        mReplayLatency = (int)lFile["latency"];
+
+    // Raw frames are stored as grayscale images
+    bool lBayer = false;
+    if(!lFile["bayer"].empty())
+    {
+        std::string lPattern;
+        lFile["bayer"] >> lPattern;
+        lBayer = bayerPatternFromString(lPattern, mBayerPattern);
+        if(!lBayer)
+            std::cerr << "Unknown Bayer pattern " << lPattern << std::endl;
+    }
+
+    FileNode lFrames = lFile["frames"];
+    std::vector<float> lShutters, lGains;
+    for(unsigned int i=0; i<lFrames.size(); i++)
+    {
+        lShutters.push_back((float)lFrames[i]["shutter"]);
+        lGains.push_back((float)lFrames[i]["gain"]);
+    }
+    lFile.release();
+
+    // The source is relative to the description file
+    boost::filesystem::path lPath(lSource);
+    if(lPath.is_relative())
+        lPath = boost::filesystem::path(pFile).parent_path() / lPath;
+
+    // All the frames are loaded in memory, to be delivered at any rate
+    VideoCapture lCapture;
+    if(!lCapture.open(lPath.string()))
+    {
+        std::cerr << "Error while opening replay source " << lPath.string() << std::endl;
+        return false;
+    }
+
+    mReplayFrames.clear();
+    for(unsigned int i=0; i<lShutters.size(); i++)
+    {
+        Mat lFrame;
+        if(!lCapture.read(lFrame) || lFrame.rows == 0)
+            break;
+        if(lBayer && lFrame.channels() != 1)
+        {
+            Mat lRaw;
+            extractChannel(lFrame, lRaw, 0);
+            mReplayFrames.push_back(lRaw);
+        }
+        else
+        {
+            mReplayFrames.push_back(lFrame.clone());
+        }
+    }
+
+    if(mReplayFrames.size() == 0)
+    {
+        std::cerr << "No frame in replay source " << lPath.string() << std::endl;
+        return false;
+    }
+
+    lShutters.resize(mReplayFrames.size());
+    lGains.resize(mReplayFrames.size());
+    mReplayShutters = lShutters;
+    mReplayGains = lGains;
+    mReplayRealTime = pRealTime;
+
+    return true;
+}
+
 /*******************************************/
 void camera::close()
 {
-    if(mCameraType != none)
+    stopCapture();
+
+    if(mCameraType == sony)
         mCamera.release();
+    mCameraType = none;
 }
 
 /*******************************************/
 bool camera::setAperture(float pAperture)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
 
     switch(mCameraType)
     {
     case sony:
+    case replay:
         mAperture = max(pAperture, 0.f);
+        exposureChanged();
         break;
     default:
         lResult = false;
@@ -79,6 +352,7 @@ bool camera::setAperture(float pAperture)
 /*******************************************/
 bool camera::setShutter(float pShutter)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
     float lValue;
 
@@ -112,6 +386,13 @@ bool camera::setShutter(float pShutter)
         }
 
         lResult &= mCamera.set(CV_CAP_PROP_EXPOSURE, lValue);
+        exposureChanged();
+        break;
+    case replay:
+        // The nearest recorded shutter is used
+        mShutter = nearestReplayValue(mReplayShutters, pShutter, true);
+        setReplayExposure();
+        exposureChanged();
         break;
     default:
         lResult = false;
@@ -123,6 +404,7 @@ bool camera::setShutter(float pShutter)
 /*******************************************/
 bool camera::setGain(float pGain)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
     float lValue;
 
@@ -132,6 +414,12 @@ bool camera::setGain(float pGain)
         mGain = max(min(pGain, 18.f), 0.f);
         lValue = 2048 + mGain*10.f;
         lResult &= mCamera.set(CV_CAP_PROP_GAIN, lValue);
+        exposureChanged();
+        break;
+    case replay:
+        mGain = nearestReplayValue(mReplayGains, pGain, false);
+        setReplayExposure();
+        exposureChanged();
         break;
     default:
         lResult = false;
@@ -143,12 +431,15 @@ bool camera::setGain(float pGain)
 /*******************************************/
 void camera::setDefaultISO(float pISO)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     mDefaultISO = max(pISO, 0.f);
+    exposureChanged();
 }
 
 /*******************************************/
 bool camera::setFrameRate(float pRate)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
 
     switch(mCameraType)
@@ -156,6 +447,12 @@ bool camera::setFrameRate(float pRate)
     case sony:
         lResult &= mCamera.set(CV_CAP_PROP_FPS, pRate);
         break;
+    case replay:
+        if(pRate > 0.f)
+            mReplayFrameRate = pRate;
+        else
+            lResult = false;
+        break;
     default:
         lResult = false;
     }
@@ -166,6 +463,7 @@ bool camera::setFrameRate(float pRate)
 /*******************************************/
 bool camera::setBrightness(float pBrightness)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
     float lValue = max(min(pBrightness, 1.0f), 0.0f);
 
@@ -185,6 +483,7 @@ bool camera::setBrightness(float pBrightness)
 /*******************************************/
 bool camera::setGamma(float pGamma)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
 
     switch(mCameraType)
@@ -207,6 +506,7 @@ bool camera::setGamma(float pGamma)
 /*******************************************/
 bool camera::setColorBalance(float pRed, float pBlue)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     bool lResult = true;
 
     switch(mCameraType)
@@ -225,6 +525,7 @@ bool camera::setColorBalance(float pRed, float pBlue)
 /*******************************************/
 bool camera::setICCProfiles(const char *pInProfile, const char *pOutProfile)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
     cmsHPROFILE lInProfile, lOutProfile;
     cmsUInt32Number lOutType;
 
@@ -307,6 +608,7 @@ bool camera::setICCProfiles(const char *pInProfile, const char *pOutProfile)
             cmsDeleteTransform(mICCTransform);
             mICCTransform = NULL;
         }
+        mICCLut.clear();
 
         cmsCloseProfile(lInProfile);
         cmsCloseProfile(lOutProfile);
@@ -315,8 +617,24 @@ bool camera::setICCProfiles(const char *pInProfile, const char *pOutProfile)
     }
 
     // Creating the transform
+    if(mICCTransform != NULL)
+        cmsDeleteTransform(mICCTransform);
     mICCTransform = cmsCreateTransform(lInProfile, TYPE_BGR_8, lOutProfile, lOutType, INTENT_ABSOLUTE_COLORIMETRIC, 0);
 
+    // And the LUT, baked from the same profiles, unless the snapshot has it
+    mICCHash = snapshot::hashFile(pInProfile);
+    mICCHash = snapshot::hash(pOutProfile, strlen(pOutProfile), mICCHash);
+    mICCHash = snapshot::hashFile(pOutProfile, mICCHash);
+    mICCHash = snapshot::hash(&mICCLutSize, sizeof(mICCLutSize), mICCHash);
+
+    Mat lLut;
+    if(mSnapshot != NULL)
+        lLut = mSnapshot->getMat("camera.iccLut", mICCHash);
+    if(lLut.type() == CV_32F && lLut.total() == mICCLutSize*mICCLutSize*mICCLutSize*3)
+        mICCLut.assign(lLut.ptr<float>(0), lLut.ptr<float>(0) + lLut.total());
+    else
+        createICCLut(lInProfile, lOutProfile, lOutType);
+
     // Closing the profiles
     cmsCloseProfile(lInProfile);
     cmsCloseProfile(lOutProfile);
@@ -324,6 +642,12 @@ bool camera::setICCProfiles(const char *pInProfile, const char *pOutProfile)
     return true;
 }
 
+/*******************************************/
+void camera::setICCLut(bool pActive)
+{
+    mUseICCLut = pActive;
+}
+
 /*******************************************/
 bool camera::setCalibration(const char *pCalibFile)
 {
@@ -335,29 +659,89 @@ bool camera::setCalibration(const char *pCalibFile)
         return false;
     }
 
-    lFile["Camera_Matrix"] >> mCameraMat;
-    lFile["Distortion_Coefficients"] >> mDistortionMat;
+    Mat lCameraMat, lDistortionMat;
+    lFile["Camera_Matrix"] >> lCameraMat;
+    lFile["Distortion_Coefficients"] >> lDistortionMat;
 
     lFile.release();
+    uint64_t lHash = snapshot::hashFile(pCalibFile);
+
+    // The maps are built before taking the lock, not to stall the capture.
+    // Without a known frame size, they will be built with the next frame
+    Mat lMap1, lMap2, lMap;
+    Size lSize(mWidth, mHeight);
+    if(lSize.area() > 0 && lCameraMat.rows != 0)
+        createRectifyMaps(lSize, lCameraMat, lDistortionMat, lHash, lMap1, lMap2, lMap);
+
+    // The frames being undistorted keep the previous maps
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    mCameraMat = lCameraMat;
+    mDistortionMat = lDistortionMat;
+    mCalibrationHash = lHash;
+    mRectifyMap1 = lMap1;
+    mRectifyMap2 = lMap2;
+    mRectifyMap = lMap;
+    if(mRectifyMap.rows != 0)
+        mFOV = 2*atan(((float)lSize.width/2.f)/(mCameraMat.at<double>(0,0)));
 
     return true;
 }
 
+/*******************************************/
+bool camera::setRawMode(bool pRaw)
+{
+    if(mCapturing)
+        return false;
+
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    mRawMode = pRaw;
+    mPool.clear();
+
+    bool lResult = true;
+    if(mCameraType == sony)
+        lResult = mCamera.set(CV_CAP_PROP_CONVERT_RGB, pRaw ? 0 : 1);
+
+    return lResult;
+}
+
+/*******************************************/
+bool camera::getRawMode()
+{
+    return mRawMode;
+}
+
+/*******************************************/
+void camera::setBayerPattern(bayerPattern pPattern)
+{
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    mBayerPattern = pPattern;
+}
+
 /*******************************************/
 bool camera::setWidth(unsigned int pWidth)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    if(mCameraType == replay)
+        return false;
+
     bool lReturn;
     lReturn =  mCamera.set(CV_CAP_PROP_FRAME_WIDTH, pWidth);
     mWidth = mCamera.get(CV_CAP_PROP_FRAME_WIDTH);
+    mPool.trim();
     return lReturn;
 }
 
 /*******************************************/
 bool camera::setHeight(unsigned int pHeight)
 {
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    if(mCameraType == replay)
+        return false;
+
     bool lReturn;
     lReturn = mCamera.set(CV_CAP_PROP_FRAME_HEIGHT, pHeight);
     mHeight = mCamera.get(CV_CAP_PROP_FRAME_HEIGHT);
+    mPool.trim();
     return lReturn;
 }
 
@@ -401,51 +785,530 @@ float camera::getFOV()
 /*******************************************/
 Mat camera::getImage()
 {
+    Mat lFrame = mPool.getBuffer(Size(mWidth, mHeight), mRawMode ? CV_8UC1 : CV_8UC3);
+    captureFrame(lFrame, true);
+
+    if(mRawMode)
+    {
+        Mat lImage;
+        developFrame(lFrame, lImage, true, true);
+        return lImage;
+    }
+
+    return lFrame;
+}
+
+/*******************************************/
+Mat camera::getRawImage()
+{
+    Mat lFrame = mPool.getBuffer(Size(mWidth, mHeight), mRawMode ? CV_8UC1 : CV_8UC3);
+    captureFrame(lFrame, false);
+
+    if(mRawMode)
+    {
+        Mat lImage;
+        developFrame(lFrame, lImage, true, false);
+        return lImage;
+    }
+
+    return lFrame;
+}
+
+/*******************************************/
+bool camera::startCapture(unsigned int pRingSize, bool pUndistort)
+{
+    if(mCameraType == none || mCapturing)
+        return false;
+
+    mRing.init(pRingSize, Size(mWidth, mHeight), mRawMode ? CV_8UC1 : CV_8UC3);
+    mCaptureUndistort = pUndistort;
+    mCapturing = true;
+    mCaptureThread = boost::thread(&camera::captureLoop, this);
+
+    return true;
+}
+
+/*******************************************/
+void camera::stopCapture()
+{
+    if(!mCapturing)
+        return;
+
+    mCapturing = false;
+    mCaptureThread.join();
+}
+
+/*******************************************/
+void camera::setQueueDepth(unsigned int pDepth)
+{
+    mQueueDepth = pDepth;
+}
+
+/*******************************************/
+unsigned int camera::getSettingsId()
+{
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    return mSettingsId;
+}
+
+/*******************************************/
+bool camera::getFrame(capturedFrame& pFrame)
+{
+    return mRing.getLatest(pFrame);
+}
+
+/*******************************************/
+bool camera::waitFrame(capturedFrame& pFrame, unsigned int pSettings, unsigned long long pSequence, double pTimeout)
+{
+    traceScope lTrace("wait frame");
+    return mRing.waitFirst(pFrame, pSequence, pSettings, pTimeout);
+}
+
+/*******************************************/
+bool camera::waitLatestFrame(capturedFrame& pFrame, unsigned long long pSequence, double pTimeout)
+{
+    traceScope lTrace("wait frame");
+    return mRing.waitLatest(pFrame, pSequence, pTimeout);
+}
+
+/*******************************************/
+bool camera::waitSettledFrame(capturedFrame& pFrame, const capturedFrame& pReference, double pTimeout)
+{
+    traceScope lTrace("wait settled frame");
+    frameInfo lExposure;
+    unsigned long long lSequence;
+    {
+        boost::mutex::scoped_lock lLock(mCameraMutex);
+        lExposure = mNextExposure;
+        lSequence = mChangeSequence;
+    }
+
+    mSettle.setReference(pReference.image, pReference.info.EV);
+
+    boost::chrono::steady_clock::time_point lDeadline = boost::chrono::steady_clock::now()
+        + boost::chrono::microseconds((long long)(pTimeout*1e6));
+
+    for(;;)
+    {
+        double lRemaining = boost::chrono::duration<double>(lDeadline - boost::chrono::steady_clock::now()).count();
+        capturedFrame lFrame;
+        if(lRemaining <= 0.0 || !mRing.waitFirst(lFrame, lSequence, 0, lRemaining))
+            break;
+        lSequence = lFrame.info.sequence+1;
+
+        settleDetector::result lResult = mSettle.check(lFrame.image, lExposure.EV);
+        if(lResult == settleDetector::eSettled)
+        {
+            // The frame is tagged with the settings it has been detected with
+            pFrame.image = lFrame.image;
+            pFrame.info = lExposure;
+            pFrame.info.sequence = lFrame.info.sequence;
+            pFrame.info.timestamp = lFrame.info.timestamp;
+            return true;
+        }
+        else if(lResult == settleDetector::eUndecided)
+        {
+            break;
+        }
+    }
+
+    // Within the same deadline, the settle detection having used part of it
+    double lRemaining = boost::chrono::duration<double>(lDeadline - boost::chrono::steady_clock::now()).count();
+    return mRing.waitFirst(pFrame, 0, lExposure.settings, max(lRemaining, 0.0));
+}
+
+/*******************************************/
+void camera::developFrame(const Mat& pRaw, Mat& pImage, bool pFinal, bool pUndistort)
+{
+    if(pRaw.type() != CV_8UC1)
+    {
+        pImage = pRaw;
+        return;
+    }
+
+    bool lUndistort = pUndistort && mCameraMat.rows != 0;
+
+    Mat lImage = mPool.getBuffer(pRaw.size(), CV_8UC3);
+    demosaic(pRaw, lImage, mBayerPattern, pFinal ? eDemosaicEdgeAware : eDemosaicBilinear);
+
+    if(lUndistort)
+        pImage = mPool.getBuffer(pRaw.size(), CV_8UC3);
+    correctFrame(lImage, pImage, lUndistort);
+}
+
+/*******************************************/
+void camera::setSnapshot(snapshot* pSnapshot)
+{
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    mSnapshot = pSnapshot;
+}
+
+/*******************************************/
+void camera::saveSnapshot(snapshot& pSnapshot)
+{
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+
+    if(mRectifyMap1.rows != 0 && mRectifyMap2.rows != 0 && mRectifyMap.rows != 0)
+    {
+        uint64_t lHash = getRectifyHash(mCalibrationHash, mRectifyMap.size());
+        pSnapshot.addMat("camera.rectifyMap1", mRectifyMap1, lHash);
+        pSnapshot.addMat("camera.rectifyMap2", mRectifyMap2, lHash);
+        pSnapshot.addMat("camera.rectifyMap", mRectifyMap, lHash);
+    }
+
+    if(mICCLut.size() != 0)
+        pSnapshot.addMat("camera.iccLut", Mat(1, mICCLut.size(), CV_32F, &mICCLut[0]).clone(), mICCHash);
+}
+
+/*******************************************/
+Mat camera::getRectifyMap()
+{
+    boost::mutex::scoped_lock lLock(mCameraMutex);
+    return mRectifyMap;
+}
+
+/*******************************************/
+void camera::createICCLut(cmsHPROFILE pInProfile, cmsHPROFILE pOutProfile, cmsUInt32Number pOutType)
+{
+    bool lIsLab = (pOutType == TYPE_Lab_8);
+    cmsHTRANSFORM lTransform = cmsCreateTransform(pInProfile, TYPE_BGR_FLT, pOutProfile, lIsLab ? TYPE_Lab_FLT : TYPE_BGR_FLT,
+                                                  INTENT_ABSOLUTE_COLORIMETRIC, 0);
+    if(lTransform == NULL)
+    {
+        mICCLut.clear();
+        return;
+    }
+
+    // Input values of the nodes, and their transformation, one row for each (b, g) pair
+    unsigned int lSize = mICCLutSize;
+    Mat lNodes(lSize*lSize, lSize, CV_32FC3);
+    for(unsigned int b=0; b<lSize; b++)
+    {
+        for(unsigned int g=0; g<lSize; g++)
+        {
+            Vec3f* lRow = lNodes.ptr<Vec3f>(b*lSize+g);
+            for(unsigned int r=0; r<lSize; r++)
+                lRow[r] = Vec3f((float)b, (float)g, (float)r)*(1.f/(float)(lSize-1));
+        }
+    }
+
+    Mat lOutput(lNodes.size(), CV_32FC3);
+    cmsDoTransform(lTransform, lNodes.data, lOutput.data, lNodes.rows*lNodes.cols);
+    cmsDeleteTransform(lTransform);
+
+    if(mIsLabD65)
+    {
+        // Same as the 8 bits path, converted to BGR
+        cvtColor(lOutput, lOutput, CV_Lab2BGR);
+        lOutput *= 255.f;
+    }
+    else if(lIsLab)
+    {
+        // Same encoding as TYPE_Lab_8
+        std::vector<Mat> lChannels;
+        split(lOutput, lChannels);
+        lChannels[0] *= 255.f/100.f;
+        lChannels[1] += Mat(lChannels[1].size(), CV_32F, Scalar(128.f));
+        lChannels[2] += Mat(lChannels[2].size(), CV_32F, Scalar(128.f));
+        merge(lChannels, lOutput);
+    }
+    else
+    {
+        lOutput *= 255.f;
+    }
+
+    mICCLut.assign((float*)lOutput.data, (float*)lOutput.data + lOutput.total()*3);
+}
+
+/*******************************************/
+void camera::applyICCLut(Mat& pFrame)
+{
+    iccLutTransform lTransform(pFrame, mICCLut, mICCLutSize);
+    scheduler::parallelFor(Range(0, pFrame.rows), lTransform);
+}
+
+/*******************************************/
+void camera::createRectifyMaps(Size pSize, const Mat& pCameraMat, const Mat& pDistortionMat, uint64_t pCalibrationHash,
+                               Mat& pMap1, Mat& pMap2, Mat& pMap)
+{
+    // The maps of the snapshot are used as is, from the mapped file
+    Mat lMap1, lMap2, lMap;
+    if(mSnapshot != NULL)
+    {
+        uint64_t lHash = getRectifyHash(pCalibrationHash, pSize);
+        lMap1 = mSnapshot->getMat("camera.rectifyMap1", lHash);
+        lMap2 = mSnapshot->getMat("camera.rectifyMap2", lHash);
+        lMap = mSnapshot->getMat("camera.rectifyMap", lHash);
+    }
+
+    if(lMap1.size() == pSize && lMap2.size() == pSize && lMap.size() == pSize)
+    {
+        pMap1 = lMap1;
+        pMap2 = lMap2;
+        pMap = lMap;
+    }
+    else
+    {
+        initUndistortRectifyMap(pCameraMat, pDistortionMat, Mat(), pCameraMat, pSize, CV_16SC2, pMap1, pMap2);
+
+        // The float version is used to compose the undistortion with other maps
+        Mat lUnused;
+        convertMaps(pMap1, pMap2, pMap, lUnused, CV_32FC2);
+    }
+}
+
+/*******************************************/
+uint64_t camera::getRectifyHash(uint64_t pCalibrationHash, Size pSize)
+{
+    uint64_t lHash = pCalibrationHash;
+    lHash = snapshot::hash(&pSize.width, sizeof(pSize.width), lHash);
+    lHash = snapshot::hash(&pSize.height, sizeof(pSize.height), lHash);
+    return lHash;
+}
+
+/*******************************************/
+frameInfo camera::captureFrame(Mat& pFrame, bool pUndistort)
+{
+    frameInfo lInfo;
+    bool lRaw = mRawMode;
+    bool lUndistort = !lRaw && pUndistort && mCameraMat.rows != 0;
+    int lType = lRaw ? CV_8UC1 : CV_8UC3;
+
+    // Without undistortion, the frame is captured directly in pFrame
     Mat lFrame;
+    if(lUndistort)
+        lFrame = mPool.getBuffer(pFrame.size(), lType);
+    else
+        lFrame = pFrame;
+
+    if(mCameraType == replay)
+        waitReplayFrame();
+
+    {
+        boost::mutex::scoped_lock lLock(mCameraMutex);
 
-    // Capturing the frame
-    mCamera >> lFrame;
+        // Capturing the frame
+        {
+            scopedTimer lTimer(eMetricGrab, lFrame.total()*lFrame.elemSize());
+            grabFrame(lFrame);
+        }
+
+        // Tag it with the exposure in effect
+        if(mSequence >= mNextExposure.sequence)
+            mCurrentExposure = mNextExposure;
+        lInfo = mCurrentExposure;
+        lInfo.sequence = mSequence++;
+        lInfo.timestamp = boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
     // If the frame is empty (error while capturing), we create a black frame
     if(lFrame.rows == 0 || lFrame.cols == 0)
-        lFrame = Mat::zeros(mHeight, mWidth, CV_8UC3);
+    {
+        lFrame = lUndistort ? mPool.getBuffer(pFrame.size(), lType) : pFrame;
+        lFrame.setTo(Scalar(0, 0, 0));
+    }
 
-    // If specified so, correct the colorimetry
-    if(mICCTransform != NULL)
+    // Raw frames are corrected when developed
+    if(lRaw)
+        pFrame = lFrame;
+    else
+        correctFrame(lFrame, pFrame, lUndistort);
+
+    return lInfo;
+}
+
+/*******************************************/
+void camera::correctFrame(Mat& pFrame, Mat& pOutput, bool pUndistort)
+{
+    Mat lMap1, lMap2;
     {
-        for(int i=0; i<lFrame.rows; i++)
+        boost::mutex::scoped_lock lLock(mCameraMutex);
+
+        // If specified so, correct the colorimetry
+        if(mICCTransform != NULL)
         {
-            Mat lRow = lFrame.row(i);
-            cmsDoTransform(mICCTransform, lRow.data, lRow.data, lRow.step/lRow.channels());
+            scopedTimer lTimer(eMetricICC, pFrame.total()*pFrame.elemSize());
+            if(mUseICCLut && mICCLut.size() != 0)
+            {
+                applyICCLut(pFrame);
+            }
+            else
+            {
+                for(int i=0; i<pFrame.rows; i++)
+                {
+                    Mat lRow = pFrame.row(i);
+                    cmsDoTransform(mICCTransform, lRow.data, lRow.data, lRow.step/lRow.channels());
+                }
+
+                if(mIsLabD65)
+                {
+                    cvtColor(pFrame, pFrame, CV_Lab2BGR);
+                }
+            }
         }
 
-        if(mIsLabD65)
+        // Check if the mapping matrices have already been calculated
+        if(mCameraMat.rows != 0 && (mRectifyMap1.rows == 0 || mRectifyMap2.rows == 0))
         {
-            cvtColor(lFrame, lFrame, CV_Lab2BGR);
+            Size lSize(pFrame.cols, pFrame.rows);
+            createRectifyMaps(lSize, mCameraMat, mDistortionMat, mCalibrationHash, mRectifyMap1, mRectifyMap2, mRectifyMap);
+            mFOV = 2*atan(((float)lSize.width/2.f)/(mCameraMat.at<double>(0,0)));
         }
+
+        // The maps may be replaced by setCalibration during the remap
+        lMap1 = mRectifyMap1;
+        lMap2 = mRectifyMap2;
     }
 
-    // Same for the distortion
-    if(mCameraMat.rows != 0)
+    // Correct the distortion
+    if(pUndistort && lMap1.rows != 0 && lMap2.rows != 0)
     {
-        // Check if the mapping matrices have already been calculated
-        if(mRectifyMap1.rows == 0 || mRectifyMap2.rows == 0)
-        {
-            Mat lTempMat;
-            Size lImageSize(lFrame.cols, lFrame.rows);
-            initUndistortRectifyMap(mCameraMat, mDistortionMat, Mat(), mCameraMat, lImageSize, CV_16SC2, mRectifyMap1, mRectifyMap2);
+        scopedTimer lTimer(eMetricUndistort, pFrame.total()*pFrame.elemSize());
+        remap(pFrame, pOutput, lMap1, lMap2, INTER_LINEAR, BORDER_CONSTANT, Scalar(0,0,0));
+    }
+    else
+        pOutput = pFrame;
+}
+
+/*******************************************/
+void camera::captureLoop()
+{
+    trace::setThreadName("capture");
+
+    while(mCapturing)
+    {
+        traceScope lTrace("capture frame");
+        int lIndex;
+        Mat lBuffer = mRing.getWriteBuffer(lIndex);
+
+        // If the consumers hold all the buffers, the frame is grabbed
+        // anyway to keep up with the camera, but dropped
+        Mat lFrame = lIndex >= 0 ? lBuffer : mPool.getBuffer(Size(mWidth, mHeight), CV_8UC3);
+        frameInfo lInfo = captureFrame(lFrame, mCaptureUndistort);
+
+        // Frames which did not fit in the buffer are dropped too
+        if(lIndex >= 0 && lFrame.data == lBuffer.data)
+            mRing.publish(lIndex, lInfo);
+    }
+}
+
+/*******************************************/
+void camera::exposureChanged()
+{
+    mSettingsId++;
+
+    // The frames already queued by the driver have the previous settings
+    mNextExposure.settings = mSettingsId;
+    mNextExposure.sequence = mSequence + mQueueDepth;
+    mChangeSequence = mSequence;
+    mNextExposure.aperture = mAperture;
+    mNextExposure.shutter = mShutter;
+    mNextExposure.gain = mGain;
+    mNextExposure.EV = getEV();
+}
+
+/*******************************************/
+void camera::grabFrame(Mat& pFrame)
+{
+    if(mCameraType != replay && !mRawMode)
+    {
+        mCamera >> pFrame;
+        return;
+    }
+    else if(mCameraType != replay)
+    {
+        // Depending on the driver, raw frames may come replicated on 3 channels
+        Mat lGrabbed;
+        mCamera >> lGrabbed;
+        if(lGrabbed.channels() == 1)
+            lGrabbed.copyTo(pFrame);
+        else if(lGrabbed.rows != 0)
+            extractChannel(lGrabbed, pFrame, 0);
+        else
+            pFrame = Mat();
+        return;
+    }
+
+    // The new exposure is visible after the emulated latency
+    if(mReplayCount >= mReplayNextCount)
+    {
+        mReplayShutter = mReplayNextShutter;
+        mReplayGain = mReplayNextGain;
+    }
 
-            mFOV = 2*atan(((float)lImageSize.width/2.f)/(mCameraMat.at<double>(0,0)));
+    // Next recorded frame with this exposure
+    int lNbr = mReplayFrames.size();
+    int lIndex = -1;
+    for(int i=1; i<=lNbr; i++)
+    {
+        int lCandidate = (mReplayIndex+i) % lNbr;
+        if(mReplayShutters[lCandidate] == mReplayShutter && mReplayGains[lCandidate] == mReplayGain)
+        {
+            lIndex = lCandidate;
+            break;
         }
+    }
 
-        // Correct distortion
-        if(mRectifyMap1.rows != 0 && mRectifyMap2.rows != 0)
+    // No frame with this exact exposure: the next one is delivered
+    if(lIndex < 0)
+        lIndex = (mReplayIndex+1) % lNbr;
+
+    mReplayIndex = lIndex;
+    mReplayCount++;
+    // Raw recordings are demosaiced as the camera would do it, and color
+    // recordings are sampled as seen by the sensor in raw mode
+    const Mat& lRecorded = mReplayFrames[lIndex];
+    if(mRawMode == (lRecorded.channels() == 1))
+        lRecorded.copyTo(pFrame);
+    else if(mRawMode)
+        mosaic(lRecorded, pFrame, mBayerPattern);
+    else
+        demosaic(lRecorded, pFrame, mBayerPattern, eDemosaicBilinear);
+}
+
+/*******************************************/
+void camera::waitReplayFrame()
+{
+    if(!mReplayRealTime)
+        return;
+
+    traceScope lTrace("replay wait");
+
+    double lNow = boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+    if(mReplayNextTime > lNow)
+        boost::this_thread::sleep_for(boost::chrono::duration<double>(mReplayNextTime-lNow));
+
+    mReplayNextTime = max(lNow, mReplayNextTime) + 1.0/mReplayFrameRate;
+}
+
+/*******************************************/
+float camera::nearestReplayValue(const std::vector<float>& pValues, float pValue, bool pLog)
+{
+    float lNearest = pValue;
+    float lDistance = -1.f;
+
+    for(unsigned int i=0; i<pValues.size(); i++)
+    {
+        float lNewDistance;
+        if(pLog && pValues[i] > 0.f && pValue > 0.f)
+            lNewDistance = fabs(log2(pValues[i]/pValue));
+        else
+            lNewDistance = fabs(pValues[i]-pValue);
+
+        if(lDistance < 0.f || lNewDistance < lDistance)
         {
-            Mat lBuffer;
-            remap(lFrame, lBuffer, mRectifyMap1, mRectifyMap2, INTER_LINEAR, BORDER_CONSTANT, Scalar(0,0,0));
-            lFrame = lBuffer;
+            lDistance = lNewDistance;
+            lNearest = pValues[i];
         }
     }
 
-    return lFrame.clone();
+    return lNearest;
+}
+
+/*******************************************/
+void camera::setReplayExposure()
+{
+    mReplayNextShutter = mShutter;
+    mReplayNextGain = mGain;
+    mReplayNextCount = mReplayCount + mReplayLatency;
 }
@@ -4,6 +4,14 @@
 #include "opencv2/opencv.hpp"
 #include "lcms2.h"
 
+#include <boost/thread.hpp>
+
+#include "demosaic.h"
+#include "framepool.h"
+#include "framering.h"
+#include "settledetector.h"
+#include "snapshot.h"
+
 using namespace cv;
 
 namespace paper
@@ -11,7 +19,8 @@ namespace paper
 enum cameraType
 {
     none,
-    sony
+    sony,
+    replay // frames recorded on disk, see setReplaySource
 };
 
 class camera
@@ -24,6 +33,16 @@ public:
     bool open(cameraType pCamera);
     void close();
 
+    // Set the description of the recorded frames for the replay camera, to call
+    // before open(replay). It is read with cv::FileStorage and contains:
+    //   source: image sequence (as "img_%03d.png") or video, relative to the description
+    //   frameRate: emulated frame rate, in frames per second
+    //   latency: number of frames before a new exposure is visible
+    //   frames: list of {shutter, gain} for each recorded frame
+    //   bayer: optional, pattern of the frames if they are raw Bayer frames (as "RGGB")
+    // In real time mode, frames are delivered at frameRate, otherwise as fast as possible
+    bool setReplaySource(const char* pFile, bool pRealTime = true);
+
     // Set camera parameters
     bool setAperture(float pAperture);
     bool setShutter(float pShutter); // pShutter = 1/t
@@ -34,8 +53,16 @@ public:
     bool setGamma(float pGamma);
     bool setColorBalance(float pRed, float pBlue); // between 0.f and 2.f
     bool setICCProfiles(const char* pInProfile, const char* pOutProfile = "sRGB"); // set an ICC profile for color correction
+    void setICCLut(bool pActive); // use a 3D LUT baked from the ICC transform (default), or the exact lcms transform
     bool setCalibration(const char* pCalibFile); // set a calibration file containing deformation informations on the camera+lense
 
+    // In raw mode, frames are captured as Bayer mosaics (CV_8UC1), without color
+    // correction nor undistortion: developFrame gives the color image when needed
+    // Can't be changed while capturing
+    bool setRawMode(bool pRaw);
+    bool getRawMode();
+    void setBayerPattern(bayerPattern pPattern); // overridden by the replay source, if specified
+
     bool setWidth(unsigned int pWidth);
     bool setHeight(unsigned int pHeight);
     void setFOV(float pFOV); // set the field of view of the camera. Automatically calculated if calibration is set
@@ -50,11 +77,66 @@ public:
     float getEV();
 
     // Capture images
+    // Frames come from a pool of buffers, and are shared: they must not be modified
     Mat getImage();
+    Mat getRawImage(); // color corrected, but not undistorted
+
+    // Capture in a dedicated thread, in a ring of pRingSize frames
+    // tagged with their timestamp and exposure settings
+    bool startCapture(unsigned int pRingSize = 8, bool pUndistort = true);
+    void stopCapture();
+    // Number of frames grabbed after a settings change before the new settings
+    // are considered in effect, to account for the frames queued by the driver
+    void setQueueDepth(unsigned int pDepth);
+    // Identifier of the current exposure settings, incremented on each change
+    unsigned int getSettingsId();
+    // Returns the last frame captured
+    bool getFrame(capturedFrame& pFrame);
+    // Waits for the first frame captured with the given settings (or newer ones),
+    // and with a sequence number at least pSequence
+    bool waitFrame(capturedFrame& pFrame, unsigned int pSettings, unsigned long long pSequence = 0, double pTimeout = 2.0);
+    // Waits for a frame with a sequence number at least pSequence, and returns
+    // the last frame captured, skipping the older ones
+    bool waitLatestFrame(capturedFrame& pFrame, unsigned long long pSequence = 0, double pTimeout = 2.0);
+    // Waits for the first frame captured after the last settings change whose values,
+    // compared to the reference frame, match the EV change. If it can't be decided,
+    // or after pTimeout seconds, falls back to waitFrame with the current settings
+    // To be called from a single thread
+    bool waitSettledFrame(capturedFrame& pFrame, const capturedFrame& pReference, double pTimeout = 2.0);
+
+    // Demosaics a raw frame (bilinear for previews, edge-aware for final frames),
+    // color corrects and undistorts it. Color frames are returned as is
+    void developFrame(const Mat& pRaw, Mat& pImage, bool pFinal = true, bool pUndistort = true);
+
+    // Undistortion maps and ICC LUT are taken from the snapshot when its
+    // entries match the calibration and profiles, instead of being computed
+    // The snapshot must stay open as long as the camera is used
+    void setSnapshot(snapshot* pSnapshot);
+    // Adds the current undistortion maps and ICC LUT to the snapshot
+    void saveSnapshot(snapshot& pSnapshot);
+
+    // Returns the map from the undistorted to the raw image (CV_32FC2),
+    // empty if no calibration is set or if no image has been captured yet
+    Mat getRectifyMap();
 
 private:
     VideoCapture mCamera;
     cameraType mCameraType;
+    framePool mPool;
+    boost::mutex mCameraMutex; // protects mCamera and the exposure tags
+
+    // Capture thread
+    boost::thread mCaptureThread;
+    volatile bool mCapturing;
+    bool mCaptureUndistort;
+    frameRing mRing;
+    unsigned int mQueueDepth;
+    unsigned long long mSequence; // number of frames grabbed
+    unsigned int mSettingsId;
+    frameInfo mCurrentExposure; // exposure of the frames being grabbed
+    frameInfo mNextExposure; // exposure in effect from frame number mNextExposure.sequence
+    unsigned long long mChangeSequence; // number of frames grabbed at the last settings change
+    settleDetector mSettle;
 
     // Camera parameters
     float mAperture;
@@ -63,14 +145,72 @@ private:
     float mGain;
     float mFOV;
     unsigned int mWidth, mHeight;
+    bool mRawMode;
+    bayerPattern mBayerPattern;
 
     // ICC related attributes
     cmsHTRANSFORM mICCTransform;
     bool mIsLabD65;
+    bool mUseICCLut;
+    unsigned int mICCLutSize; // number of nodes along each axis
+    std::vector<float> mICCLut; // output BGR values (0-255), indexed by [b][g][r]
+    uint64_t mICCHash; // hash of the profiles the LUT has been baked from
+
+    // Replay camera
+    std::vector<Mat> mReplayFrames;
+    std::vector<float> mReplayShutters, mReplayGains; // exposure of each recorded frame
+    float mReplayFrameRate;
+    bool mReplayRealTime;
+    unsigned int mReplayLatency;
+    unsigned long long mReplayCount; // number of frames delivered
+    int mReplayIndex; // last frame delivered
+    float mReplayShutter, mReplayGain; // exposure of the frames being delivered
+    float mReplayNextShutter, mReplayNextGain; // exposure from frame number mReplayNextCount
+    unsigned long long mReplayNextCount;
+    double mReplayNextTime; // date of the next frame, in real time mode
 
     // Lense deformation correction
     Mat mCameraMat, mDistortionMat;
     Mat mRectifyMap1, mRectifyMap2;
+    Mat mRectifyMap; // same as above, as a single float map
+    uint64_t mCalibrationHash; // hash of the calibration file
+
+    snapshot* mSnapshot;
+
+    /***************************/
+    // Methods
+    // Bakes the transform between the given profiles (including the conversion
+    // from Lab_D65 to BGR if needed) into mICCLut
+    void createICCLut(cmsHPROFILE pInProfile, cmsHPROFILE pOutProfile, cmsUInt32Number pOutType);
+    // Applies mICCLut to the frame
+    void applyICCLut(Mat& pFrame);
+    // Creates the undistortion maps of a calibration, for the given image size
+    // Does not use the current maps, so that it can run without mCameraMutex
+    void createRectifyMaps(Size pSize, const Mat& pCameraMat, const Mat& pDistortionMat, uint64_t pCalibrationHash,
+                           Mat& pMap1, Mat& pMap2, Mat& pMap);
+    // Hash of the inputs of the undistortion maps, for the given image size
+    uint64_t getRectifyHash(uint64_t pCalibrationHash, Size pSize);
+
+    // Captures a frame, color corrects and undistorts it, in pFrame if it has
+    // the right size and type (otherwise a new buffer is used)
+    // In raw mode, the frame is only captured
+    frameInfo captureFrame(Mat& pFrame, bool pUndistort);
+    // Color corrects pFrame in place, and undistorts it in pOutput if pUndistort
+    // (otherwise pOutput is set to pFrame)
+    void correctFrame(Mat& pFrame, Mat& pOutput, bool pUndistort);
+    // Capture thread loop
+    void captureLoop();
+    // Grabs a frame from the camera, or from the recorded frames for the replay camera
+    void grabFrame(Mat& pFrame);
+    // Waits for the date of the next frame of the replay camera
+    void waitReplayFrame();
+    // Returns the recorded value of pValues nearest to pValue,
+    // in a logarithmic scale if pLog
+    float nearestReplayValue(const std::vector<float>& pValues, float pValue, bool pLog);
+    // Sets the exposure which will be delivered after the emulated latency
+    void setReplayExposure();
+    // To call whenever the exposure settings are changed, with mCameraMutex locked
+    void exposureChanged();
 };
 }
 
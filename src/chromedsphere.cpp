@@ -1,18 +1,44 @@
 #include "chromedsphere.h"
 
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "metrics.h"
+#include "pooledallocator.h"
+#include "scheduler.h"
+#include "trace.h"
+
 using namespace paper;
 
+// Fixed point iterations of pixelFromDirection: the view ray is refined until
+// it moves by less than the tolerance (in radians, well below a pixel)
+#define SPHERE_VIEW_ITERATIONS 16
+#define SPHERE_VIEW_TOLERANCE 1e-5f
+
 /*******************************************/
 chromedSphere::chromedSphere()
 {
     mTrackingLength = 5;
     mThreshold = 2;
     mSphereReflectance = 1.f;
+    mProjection = eEquirectangular;
+    mAreaFiltering = true;
+    mSnapshot = NULL;
+
+    mWorker = NULL;
+    mAsyncActive = false;
+    mAsyncInterval = 0.5;
+    mLastRequestTime = 0.0;
+    mRequestPending = false;
+    mResultReady = false;
+    mGeneration = 0;
 }
 
 /*******************************************/
 chromedSphere::~chromedSphere()
 {
+    setAsyncDetection(false);
 }
 
 /*******************************************/
@@ -49,8 +75,9 @@ bool chromedSphere::setProbe(Mat pImage, float pFOV, Vec3f pSphere)
     // Now we crop around the probe
     mSphereImage = cropImage();
 
-    // Compute the transformation map
-    createTransformationMap();
+    // The transformation maps will be computed when needed
+    mMaps.clear();
+    mRawMaps.clear();
 
     return lReturn;
 }
@@ -67,7 +94,116 @@ bool chromedSphere::setProbe(Mat pImage, bool pFixed)
     mSphereImage = cropImage();
 
     if(!pFixed)
-        createTransformationMap();
+    {
+        mMaps.clear();
+        mRawMaps.clear();
+    }
+
+    return true;
+}
+
+/*******************************************/
+void chromedSphere::setAsyncDetection(bool pActive, double pInterval)
+{
+    mAsyncInterval = pInterval;
+    if(pActive == mAsyncActive)
+        return;
+
+    if(pActive)
+    {
+        mWorker = new chromedSphere;
+        mRequestPending = false;
+        mResultReady = false;
+        mLastRequestTime = 0.0;
+        mAsyncActive = true;
+        mWorkerThread = boost::thread(&chromedSphere::workerLoop, this);
+    }
+    else
+    {
+        {
+            boost::mutex::scoped_lock lLock(mAsyncMutex);
+            mAsyncActive = false;
+            mAsyncCondition.notify_all();
+        }
+        mWorkerThread.join();
+
+        delete mWorker;
+        mWorker = NULL;
+    }
+}
+
+/*******************************************/
+bool chromedSphere::trackProbe(Mat pImage, float pFOV)
+{
+    traceScope lTrace("track probe");
+    if(!mAsyncActive || mSphere[2] == 0.f)
+        return setProbe(pImage, pFOV);
+
+    // The detection is done again for the new size. Results of the requests
+    // sent before could not be used with it: they are dropped
+    if(pImage.rows == 0 || pImage.size() != mImage.size())
+    {
+        {
+            boost::mutex::scoped_lock lLock(mAsyncMutex);
+            mGeneration++;
+            mResultReady = false;
+            mResult = asyncResult();
+        }
+        return setProbe(pImage, pFOV);
+    }
+
+    double lNow = boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+
+    {
+        boost::mutex::scoped_lock lLock(mAsyncMutex);
+
+        // Swap in the last geometry and maps built by the worker, for this image size
+        if(mResultReady && (mResult.generation != mGeneration || mResult.imageSize != pImage.size()))
+        {
+            mResult = asyncResult();
+            mResultReady = false;
+        }
+        if(mResultReady)
+        {
+            mSphere = mResult.sphere;
+            mMaps.swap(mResult.maps);
+            mRawMaps.swap(mResult.rawMaps);
+            mResult.maps.clear();
+            mResult.rawMaps.clear();
+            mResultReady = false;
+        }
+
+        // Ask for a new detection, with the maps currently in use
+        if(!mRequestPending && lNow - mLastRequestTime >= mAsyncInterval)
+        {
+            mRequest.image = pImage;
+            mRequest.FOV = pFOV;
+            mRequest.sizes.clear();
+            mRequest.rawSizes.clear();
+            std::map<std::pair<unsigned int, unsigned int>, Mat>::iterator lMap;
+            for(lMap = mMaps.begin(); lMap != mMaps.end(); lMap++)
+                mRequest.sizes.push_back(Size(lMap->first.first, lMap->first.second));
+            for(lMap = mRawMaps.begin(); lMap != mRawMaps.end(); lMap++)
+                mRequest.rawSizes.push_back(Size(lMap->first.first, lMap->first.second));
+            mRequest.sphereDiameter = mSphereDiameter;
+            mRequest.proj = mProjection;
+            mRequest.areaFiltering = mAreaFiltering;
+            mRequest.trackingLength = mTrackingLength;
+            mRequest.threshold = mThreshold;
+            mRequest.rectifyMap = mRectifyMap;
+            mRequest.generation = mGeneration;
+
+            mRequestPending = true;
+            mLastRequestTime = lNow;
+            mAsyncCondition.notify_all();
+        }
+    }
+
+    // Per frame, only the crop is done
+    mImage = pImage;
+    mFOV = pFOV*M_PI/180.f;
+    distanceFromCamera();
+    mSphereImage = cropImage();
 
     return true;
 }
@@ -75,34 +211,153 @@ bool chromedSphere::setProbe(Mat pImage, bool pFixed)
 /*******************************************/
 Mat chromedSphere::getConvertedProbe()
 {
-    Mat lImage, lProbe;
+    return getConvertedProbe(0, 0);
+}
 
-    // If no sphere was detected
-    if(mSphere[2] == 0.f)
-        return Mat::zeros(256, 512, mImage.type());
+/*******************************************/
+Mat chromedSphere::getConvertedProbe(unsigned int pWidth, unsigned int pHeight)
+{
+    return convertProbe(mSphereImage, pWidth, pHeight);
+}
+
+/*******************************************/
+Mat chromedSphere::convertProbe(Mat pImage, unsigned int pWidth, unsigned int pHeight)
+{
+    Mat lProbe = pooledMat();
+    Size lSize = getOutputSize(pWidth, pHeight);
 
-    // Set the (0,0) pixel to black
-    Mat lPixel = mSphereImage(Rect(0, 0, 1, 1));
-    lPixel.setTo(0);
+    // If no sphere was detected, or if the image does not match it
+    if(mSphere[2] == 0.f || pImage.size() != mSphereImage.size())
+        return Mat::zeros(lSize, pImage.type());
+
+    unsigned int lFactor = getFilteringFactor(lSize);
 
     // Correct the probe
-    remap(mSphereImage, lImage, mMap, Mat(), CV_INTER_LINEAR, BORDER_CONSTANT, Scalar(0, 0, 0));
+    scopedTimer lTimer(eMetricRemap, (unsigned long long)lSize.area()*lFactor*lFactor*pImage.elemSize());
+    remap(pImage, lProbe, getMap(Size(lSize.width*lFactor, lSize.height*lFactor)), Mat(), INTER_LINEAR, BORDER_CONSTANT, Scalar(0, 0, 0));
 
-    // Crop and resize the probe
-    switch(mProjection)
+    return finalizeProbe(lProbe, lSize);
+}
+
+/*******************************************/
+Mat chromedSphere::convertRawProbe(Mat pRawImage, unsigned int pWidth, unsigned int pHeight)
+{
+    Mat lProbe = pooledMat();
+    Size lSize = getOutputSize(pWidth, pHeight);
+
+    // Without any undistortion, the raw image is the image
+    if(mRectifyMap.rows == 0)
     {
-    case eEquirectangular:
-        resize(lImage, lImage, Size(512, 512));
-        lProbe = lImage(Rect(0, 128, 512, 256));
-        break;
-    default:
-        break;
+        setProbe(pRawImage, true);
+        return convertProbe(mSphereImage, lSize.width, lSize.height);
     }
 
-    // And apply the reflectance coefficient
-    lProbe *= 1/mSphereReflectance;
+    if(mSphere[2] == 0.f || pRawImage.size() != mRectifyMap.size())
+        return Mat::zeros(lSize, pRawImage.type());
+
+    unsigned int lFactor = getFilteringFactor(lSize);
+    Size lMapSize(lSize.width*lFactor, lSize.height*lFactor);
+
+    // Get the composed map for this size, create it if needed
+    std::pair<unsigned int, unsigned int> lKey(lMapSize.width, lMapSize.height);
+    std::map<std::pair<unsigned int, unsigned int>, Mat>::iterator lMap = mRawMaps.find(lKey);
+    if(lMap == mRawMaps.end())
+        lMap = mRawMaps.insert(std::make_pair(lKey, composeMap(getMap(lMapSize)))).first;
+
+    scopedTimer lTimer(eMetricRemap, (unsigned long long)lMapSize.area()*pRawImage.elemSize());
+    remap(pRawImage, lProbe, lMap->second, Mat(), INTER_LINEAR, BORDER_CONSTANT, Scalar(0, 0, 0));
 
-    return lProbe;
+    return finalizeProbe(lProbe, lSize);
+}
+
+/*******************************************/
+Mat chromedSphere::getSphereImage()
+{
+    return mSphereImage.clone();
+}
+
+/*******************************************/
+Vec3f chromedSphere::getSphere()
+{
+    return mSphere;
+}
+
+/*******************************************/
+Mat chromedSphere::getRawSphereImage(Mat pRawImage)
+{
+    Mat lImage = pooledMat();
+
+    if(mRectifyMap.rows == 0)
+    {
+        setProbe(pRawImage, true);
+        return getSphereImage();
+    }
+
+    if(mSphere[2] == 0.f || pRawImage.size() != mRectifyMap.size())
+        return Mat::zeros(mSphereImage.size(), pRawImage.type());
+
+    // The part of the undistortion map covering the sphere is all we need
+    remap(pRawImage, lImage, mRectifyMap(getCropRect()), Mat(), INTER_LINEAR, BORDER_CONSTANT, Scalar(0, 0, 0));
+    return lImage;
+}
+
+/*******************************************/
+void chromedSphere::setRectifyMap(Mat pMap)
+{
+    if(pMap.data != mRectifyMap.data)
+        mRawMaps.clear();
+    mRectifyMap = pMap;
+}
+
+/*******************************************/
+bool chromedSphere::setSnapshot(snapshot* pSnapshot, Size pImageSize, float pFOV)
+{
+    mSnapshot = pSnapshot;
+    if(mSnapshot == NULL)
+        return false;
+
+    // Stored as FOV, sphere, then the positions of the averager
+    float lFOV = pFOV*M_PI/180.f;
+    Mat lGeometry = mSnapshot->getMat("sphere.geometry", getGeometryHash(pImageSize, lFOV));
+    if(lGeometry.type() != CV_32F || lGeometry.total() < 4 || (lGeometry.total()-4) % 3 != 0)
+        return false;
+
+    const float* lValues = lGeometry.ptr<float>(0);
+    mFOV = lValues[0];
+    mSphere = Vec3f(lValues[1], lValues[2], lValues[3]);
+    mSpherePositions.clear();
+    for(unsigned int i=4; i<lGeometry.total(); i+=3)
+        mSpherePositions.push_back(Vec3f(lValues[i], lValues[i+1], lValues[i+2]));
+
+    mMaps.clear();
+    mRawMaps.clear();
+
+    return mSphere[2] != 0.f;
+}
+
+/*******************************************/
+void chromedSphere::saveSnapshot(snapshot& pSnapshot)
+{
+    if(mImage.rows == 0 || mSphere[2] == 0.f)
+        return;
+
+    std::vector<float> lValues;
+    lValues.push_back(mFOV);
+    for(int c=0; c<3; c++)
+        lValues.push_back(mSphere[c]);
+    for(unsigned int i=0; i<mSpherePositions.size(); i++)
+        for(int c=0; c<3; c++)
+            lValues.push_back(mSpherePositions[i][c]);
+
+    pSnapshot.addMat("sphere.geometry", Mat(1, lValues.size(), CV_32F, &lValues[0]).clone(), getGeometryHash(mImage.size(), mFOV));
+
+    std::map<std::pair<unsigned int, unsigned int>, Mat>::iterator lMap;
+    for(lMap = mMaps.begin(); lMap != mMaps.end(); lMap++)
+    {
+        Size lSize(lMap->first.first, lMap->first.second);
+        std::string lName = "sphere.map." + boost::lexical_cast<std::string>(lSize.width) + "x" + boost::lexical_cast<std::string>(lSize.height);
+        pSnapshot.addMat(lName.c_str(), lMap->second, getMapHash(lSize));
+    }
 }
 
 /*******************************************/
@@ -120,9 +375,20 @@ void chromedSphere::setSphereReflectance(float pReflectance)
 /*******************************************/
 void chromedSphere::setProjection(projection pProjection)
 {
+    if(pProjection != mProjection)
+    {
+        mMaps.clear();
+        mRawMaps.clear();
+    }
     mProjection = pProjection;
 }
 
+/*******************************************/
+void chromedSphere::setAreaFiltering(bool pActive)
+{
+    mAreaFiltering = pActive;
+}
+
 /*******************************************/
 void chromedSphere::setTrackingLength(unsigned int pLength, float pThreshold)
 {
@@ -133,7 +399,9 @@ void chromedSphere::setTrackingLength(unsigned int pLength, float pThreshold)
 /*******************************************/
 Vec3f chromedSphere::detectSphere()
 {
-    Mat lImage, lBuffer;
+    scopedTimer lTimer(eMetricDetection, mImage.total()*mImage.elemSize());
+    Mat lImage;
+    Mat lBuffer = pooledMat();
 
     // Convert the source image to grayscale
     cvtColor(mImage, lBuffer, CV_BGR2GRAY);
@@ -168,6 +436,60 @@ Vec3f chromedSphere::detectSphere()
     return lCircles[0];
 }
 
+/*******************************************/
+void chromedSphere::workerLoop()
+{
+    trace::setThreadName("sphere worker");
+
+    for(;;)
+    {
+        asyncRequest lRequest;
+        {
+            boost::mutex::scoped_lock lLock(mAsyncMutex);
+            while(mAsyncActive && !mRequestPending)
+                mAsyncCondition.wait(lLock);
+            if(!mAsyncActive)
+                return;
+
+            lRequest = mRequest;
+            mRequest.image = Mat();
+        }
+
+        // The worker keeps its own averager over the successive detections
+        mWorker->setSphereSize(lRequest.sphereDiameter);
+        mWorker->setProjection(lRequest.proj);
+        mWorker->setAreaFiltering(lRequest.areaFiltering);
+        mWorker->setTrackingLength(lRequest.trackingLength, lRequest.threshold);
+        mWorker->setRectifyMap(lRequest.rectifyMap);
+
+        asyncResult lResult;
+        lResult.generation = lRequest.generation;
+        lResult.imageSize = lRequest.image.size();
+        if(mWorker->setProbe(lRequest.image, lRequest.FOV) || mWorker->mSphere[2] != 0.f)
+        {
+            lResult.sphere = mWorker->mSphere;
+            for(unsigned int i=0; i<lRequest.sizes.size(); i++)
+            {
+                std::pair<unsigned int, unsigned int> lKey(lRequest.sizes[i].width, lRequest.sizes[i].height);
+                lResult.maps[lKey] = mWorker->getMap(lRequest.sizes[i]);
+            }
+            for(unsigned int i=0; i<lRequest.rawSizes.size(); i++)
+            {
+                std::pair<unsigned int, unsigned int> lKey(lRequest.rawSizes[i].width, lRequest.rawSizes[i].height);
+                lResult.rawMaps[lKey] = mWorker->composeMap(mWorker->getMap(lRequest.rawSizes[i]));
+            }
+        }
+
+        boost::mutex::scoped_lock lLock(mAsyncMutex);
+        if(lResult.sphere[2] != 0.f && lResult.generation == mGeneration)
+        {
+            mResult = lResult;
+            mResultReady = true;
+        }
+        mRequestPending = false;
+    }
+}
+
 /*******************************************/
 Vec3f chromedSphere::filterSphere(Vec3f pNewSphere)
 {
@@ -285,10 +607,16 @@ void chromedSphere::distanceFromCamera()
     mCameraDistance = mSphereDiameter/(2*tan(lAlpha/2.f)) + lCorrection;
 }
 
+/*******************************************/
+Rect chromedSphere::getCropRect()
+{
+    return Rect(mSphere[0]-mSphere[2], mSphere[1]-mSphere[2], mSphere[2]*2, mSphere[2]*2);
+}
+
 /*******************************************/
 Mat chromedSphere::cropImage()
 {
-    Mat lCroppedImage = mImage(Rect(mSphere[0]-mSphere[2], mSphere[1]-mSphere[2], mSphere[2]*2, mSphere[2]*2));
+    Mat lCroppedImage = mImage(getCropRect());
 
 #ifdef _DEBUG
     imwrite("_debugCrop.png", lCroppedImage);
@@ -298,232 +626,272 @@ Mat chromedSphere::cropImage()
 }
 
 /*******************************************/
-void chromedSphere::createTransformationMap()
+Mat chromedSphere::createTransformationMap(Size pSize)
 {
-    // this is a mirror ball, height = width
-    float lWidth = (float)mSphereImage.cols;
-    float lHeight = lWidth;
-
-    // Allocating the map
-    mMap.create(lHeight, lWidth, CV_32FC2);
-
-#ifdef _DEBUG
-    Mat lDebugAngle = Mat(lHeight, lWidth, CV_8UC3);
-#endif
+    scopedTimer lTimer(eMetricMapBuild, (unsigned long long)pSize.area()*sizeof(Vec2f));
+    Mat lMap;
 
-    // We scan through the light probe
-    for(float x=0; x<lWidth; x++)
+    switch(mProjection)
     {
-        for(float y=0; y<lHeight; y++)
-        {
-            float lAlpha, lBeta; // alpha along width, beta along height
-            // Calculating the view angle
-            // Check if the pixel is on the mirror ball
-            if(sqrtf(powf(x-lWidth/2.f, 2.f)+powf(y-lHeight/2.f, 2.f)) > lWidth/2.f)
-            {
-                // Set the value to a constant, corresponding to the back of the sphere
-                mMap.at<Vec2f>(y, x) = Vec2f(M_PI, M_PI);
-            }
-            else
-            {
-                lAlpha = atanf(((x-lWidth/2.f)*mSphereDiameter/lWidth)/mCameraDistance);
-                lBeta = -atanf(((y-lHeight/2.f)*mSphereDiameter/lHeight)/mCameraDistance);
-
-#ifdef _DEBUG
-                lDebugAngle.at<Vec3b>(y, x)[0] = (unsigned char)roundf(((lAlpha+mCroppedFOV/2.f)*255.f/mCroppedFOV));
-                lDebugAngle.at<Vec3b>(y, x)[1] = (unsigned char)roundf(((lBeta+mCroppedFOV/2.f)*255.f/mCroppedFOV));
-#endif
-
-                mMap.at<Vec2f>(y, x) = directionFromViewAngle(Vec2f(lAlpha, lBeta));
-            }
-        }
+    case eEquirectangular:
+        lMap = createProjectionMap<equirectangularProjection>(pSize);
+        break;
+    case eCubemap:
+        lMap = createProjectionMap<cubemapProjection>(pSize);
+        break;
+    case eOctahedral:
+        lMap = createProjectionMap<octahedralProjection>(pSize);
+        break;
+    case eAngular:
+        lMap = createProjectionMap<angularProjection>(pSize);
+        break;
+    default:
+        lMap = Mat(pSize, CV_32FC2, Scalar(-1.f, -1.f));
     }
 
-#ifdef _DEBUG
-    imwrite("_debugAngle.png", lDebugAngle);
-#endif
-
 #ifdef _DEBUG
     {
-        Mat lDebugMap = Mat::zeros(lHeight, lWidth, CV_32FC3);
+        Mat lDebugMap = Mat::zeros(lMap.rows, lMap.cols, CV_32FC3);
         int fromTo[] = {0, 0, 1, 1};
-        mixChannels(&mMap, 1, &lDebugMap, 1, fromTo, 2);
-        lDebugMap.convertTo(lDebugMap, CV_8UC3, 255.f/(2*M_PI), 127);
-        imwrite("_debugMap.png", lDebugMap);
+        mixChannels(&lMap, 1, &lDebugMap, 1, fromTo, 2);
+        lDebugMap.convertTo(lDebugMap, CV_8UC3, 255.f/(float)mSphereImage.cols, 0.f);
+        imwrite("_debugMapProj.png", lDebugMap);
     }
 #endif
 
-    // Calculate the desired projection
-    projectionMapFromDirections();
+    return lMap;
+}
 
-#ifdef _DEBUG
+/*******************************************/
+Mat chromedSphere::getMap(Size pSize)
+{
+    std::pair<unsigned int, unsigned int> lKey(pSize.width, pSize.height);
+    std::map<std::pair<unsigned int, unsigned int>, Mat>::iterator lMap = mMaps.find(lKey);
+    if(lMap != mMaps.end())
+        return lMap->second;
+
+    // Maps of the snapshot are used as is, from the mapped file
+    Mat lNewMap;
+    if(mSnapshot != NULL)
     {
-        Mat lDebugMap = Mat::zeros(lHeight, lWidth, CV_32FC3);
-        int fromTo[] = {0, 0, 1, 1};
-        mixChannels(&mMap, 1, &lDebugMap, 1, fromTo, 2);
-        lDebugMap.convertTo(lDebugMap, CV_8UC3, 255.f/lWidth, 0.f);
-        imwrite("_debugMapEqui.png", lDebugMap);
+        std::string lName = "sphere.map." + boost::lexical_cast<std::string>(pSize.width) + "x" + boost::lexical_cast<std::string>(pSize.height);
+        lNewMap = mSnapshot->getMat(lName.c_str(), getMapHash(pSize));
     }
-#endif
+    if(lNewMap.size() != pSize || lNewMap.type() != CV_32FC2)
+        lNewMap = createTransformationMap(pSize);
+
+    lMap = mMaps.insert(std::make_pair(lKey, lNewMap)).first;
+
+    return lMap->second;
 }
 
 /*******************************************/
-Vec2f chromedSphere::directionFromViewAngle(Vec2f pAngle)
+uint64_t chromedSphere::getGeometryHash(Size pImageSize, float pFOV)
 {
-    // All formulas are from the mathematica file "chromed_sphere"
+    uint64_t lHash = snapshot::hash(&pImageSize.width, sizeof(pImageSize.width));
+    lHash = snapshot::hash(&pImageSize.height, sizeof(pImageSize.height), lHash);
+    lHash = snapshot::hash(&pFOV, sizeof(pFOV), lHash);
+    lHash = snapshot::hash(&mSphereDiameter, sizeof(mSphereDiameter), lHash);
+    return lHash;
+}
 
-    float lA, lB; // for lisibility, we will stock the angles in these vars
-    float lC; // ... and the distance to camera in this one ...
-    float lR; // ... and the sphere radius
-    lA = pAngle[0];
-    lB = pAngle[1];
-    lC = -mCameraDistance;
-    lR = mSphereDiameter/2.f;
+/*******************************************/
+uint64_t chromedSphere::getMapHash(Size pSize)
+{
+    // The map depends on the geometry, and on the image through the camera distance
+    uint64_t lHash = snapshot::hash(&mSphere[0], 3*sizeof(float));
+    lHash = snapshot::hash(&mFOV, sizeof(mFOV), lHash);
+    lHash = snapshot::hash(&mCameraDistance, sizeof(mCameraDistance), lHash);
+    lHash = snapshot::hash(&mSphereDiameter, sizeof(mSphereDiameter), lHash);
+    int lProjection = mProjection;
+    lHash = snapshot::hash(&lProjection, sizeof(lProjection), lHash);
+    lHash = snapshot::hash(&pSize.width, sizeof(pSize.width), lHash);
+    lHash = snapshot::hash(&pSize.height, sizeof(pSize.height), lHash);
+    return lHash;
+}
 
-    // Precomputing some useful values
-    float lCosA = cosf(lA);
-    float lCosB = cosf(lB);
-    float lCos2A = cosf(2*lA);
-    float lCos2B = cosf(2*lB);
+/*******************************************/
+Mat chromedSphere::composeMap(Mat pMap)
+{
+    scopedTimer lTimer(eMetricMapBuild, pMap.total()*sizeof(Vec2f));
+    Mat lMap(pMap.size(), CV_32FC2);
+    scheduler::parallelFor(Range(0, pMap.rows), boost::bind(&chromedSphere::composeRows, this, pMap, lMap, getCropRect(), _1));
 
-    // First we verify that the pixel is on the sphere
-    // (although this test should have been done before)
-    float lDelta = lCosA*lCosA*lCosB*lCosB*(-2*lC*lC+3*lR*lR+lR*lR*lCos2B+lCos2A*(lR*lR+(2*lC*lC-lR*lR)*lCos2B));
-    if(lDelta < 0.f)
-    {
-        // not on the sphere: no projection!
-        return Vec2f(0.f, 0.f);
-    }
+    return lMap;
+}
 
-    // We can safely calculate the t parameter
-    float lNum, lDenom;
-    lNum = 4*lC+4*lC*lCos2A+2*lC*cosf(2*lA-2*lB)+4*lC*lCos2B+2*lC*cosf(2*(lA+lB));
-    lDenom = 2*(-6-2*lCos2A+cosf(2*lA-2*lB)-2*lCos2B+cosf(2*(lA+lB)));
-    float lT;
-    if(lDenom > 0.f)
-        lT = (lNum-8*sqrtf(lDelta))/lDenom;
-    else
-        lT = (lNum+8*sqrtf(lDelta))/lDenom;
-
-    // And we calculte the point of impact
-    float lX, lY, lZ;
-    lX = lC+lT;
-    lY = lT*tanf(lA);
-    lZ = lT*tanf(lB);
-
-    // Now, we create a base to project the ray from the camera on
-    Vec3f lU, lV, lW;
-    lU = Vec3f(lX, lY, lZ)*(1/lR); // This is the normal to the sphere
-    lV = Vec3f(lU[1], -lU[0], 0);
-    lW = lU.cross(lV);
-
-    // Projection on this new base
-    Vec3f lNewCoords;
-    Vec3f lInDir = Vec3f(lX-lC, lY, lZ);
-    lNewCoords[0] = lInDir.dot(lU);
-    lNewCoords[1] = lInDir.dot(lV);
-    lNewCoords[2] = lInDir.dot(lW);
-
-    // The reflected ray has the same direction, except on the axis
-    // which is normal to the sphere: there it goes the opposite
-    lNewCoords[0] = -lNewCoords[0];
-
-    // We can reproject the direction in the old base
-    Vec3f lOutDir = lNewCoords[0]*lU + lNewCoords[1]*lV + lNewCoords[2]*lW;
-
-    // Calculate Euler angles from this new direction
-    lOutDir = lOutDir*(1/sqrtf(lOutDir.dot(lOutDir)));
-
-    float lYaw, lPitch;
-    // First, yaw
-    if(lOutDir[0] == 0.f)
-    {
-        if(lOutDir[1] > 0.f)
-            lYaw = M_PI_2;
-        else
-            lYaw = -M_PI_2;
-    }
-    else if(lOutDir[0] > 0.f)
+/*******************************************/
+void chromedSphere::composeRows(Mat pMap, Mat pComposed, Rect pCrop, const Range& pRows)
+{
+    for(int y=pRows.start; y<pRows.end; y++)
     {
-        if(lOutDir[1] < 0.f)
-            lYaw = asinf(-lOutDir[1]/sqrt(lOutDir[0]*lOutDir[0]+lOutDir[1]*lOutDir[1]));
-        else
-            lYaw = 2*M_PI+asinf(-lOutDir[1]/sqrt(lOutDir[0]*lOutDir[0]+lOutDir[1]*lOutDir[1]));
+        const Vec2f* lIn = pMap.ptr<Vec2f>(y);
+        Vec2f* lOut = pComposed.ptr<Vec2f>(y);
+        for(int x=0; x<pMap.cols; x++)
+        {
+            if(lIn[x][0] < 0.f || lIn[x][1] < 0.f)
+            {
+                lOut[x] = Vec2f(-1.f, -1.f);
+                continue;
+            }
+
+            // Position in the undistorted image, and bilinear interpolation
+            // of the undistortion map at this position
+            float lX = min(max(lIn[x][0] + (float)pCrop.x, 0.f), (float)(mRectifyMap.cols-1));
+            float lY = min(max(lIn[x][1] + (float)pCrop.y, 0.f), (float)(mRectifyMap.rows-1));
+            int lX0 = min((int)lX, mRectifyMap.cols-2);
+            int lY0 = min((int)lY, mRectifyMap.rows-2);
+            float lFx = lX-(float)lX0;
+            float lFy = lY-(float)lY0;
+
+            const Vec2f* lRow0 = mRectifyMap.ptr<Vec2f>(lY0);
+            const Vec2f* lRow1 = mRectifyMap.ptr<Vec2f>(lY0+1);
+            lOut[x] = (lRow0[lX0]*(1.f-lFx) + lRow0[lX0+1]*lFx)*(1.f-lFy)
+                    + (lRow1[lX0]*(1.f-lFx) + lRow1[lX0+1]*lFx)*lFy;
+        }
     }
+}
+
+/*******************************************/
+Size chromedSphere::getOutputSize(unsigned int pWidth, unsigned int pHeight)
+{
+    if(pWidth == 0 || pHeight == 0)
+        return getDefaultSize();
     else
-    {
-        lYaw = M_PI-asinf(-lOutDir[1]/sqrt(lOutDir[0]*lOutDir[0]+lOutDir[1]*lOutDir[1]));
-    }
+        return Size(pWidth, pHeight);
+}
 
-    // Then pitch
-    lPitch = asinf(lOutDir[2]);
+/*******************************************/
+unsigned int chromedSphere::getFilteringFactor(Size pSize)
+{
+    // If the output is much smaller than the sphere, we compute it at a
+    // higher resolution and average it down, to prevent aliasing.
+    // The diameter of the sphere covers 2*PI radians.
+    if(!mAreaFiltering)
+        return 1;
+
+    float lRatio = (float)mSphereImage.cols/(2*M_PI)/getResolution(pSize);
+    return min(4u, max(1u, (unsigned int)lRatio));
+}
+
+/*******************************************/
+Mat chromedSphere::finalizeProbe(Mat pProbe, Size pSize)
+{
+    if(pProbe.size() != pSize)
+        resize(pProbe, pProbe, pSize, 0, 0, INTER_AREA);
+
+    // And apply the reflectance coefficient
+    pProbe *= 1/mSphereReflectance;
 
-    return Vec2f(lYaw-M_PI, lPitch);
+    return pProbe;
 }
 
 /*******************************************/
-void chromedSphere::projectionMapFromDirections()
+template<class Projection>
+Mat chromedSphere::createProjectionMap(Size pSize)
 {
-    switch(mProjection)
-    {
-    case eEquirectangular:
-        // If equirectangular, we have to scale the projection to the dimension
-        // of the source probe image
-    {
-        float lWCoeff = (float)mSphereImage.cols/(2*M_PI);
-        float lHCoeff = (float)mSphereImage.rows/(2*M_PI);
+    Mat lMap(pSize, CV_32FC2);
+    scheduler::parallelFor(Range(0, lMap.rows), boost::bind(&chromedSphere::projectRows<Projection>, this, lMap, _1));
 
-        for(int x=0; x<mSphereImage.cols; x++)
+    return lMap;
+}
+
+/*******************************************/
+template<class Projection>
+void chromedSphere::projectRows(Mat pMap, const Range& pRows)
+{
+    float lUCoeff = 1.f/(float)pMap.cols;
+    float lVCoeff = 1.f/(float)pMap.rows;
+
+    for(int y=pRows.start; y<pRows.end; y++)
+    {
+        Vec2f* lRow = pMap.ptr<Vec2f>(y);
+        float lV = ((float)y+0.5f)*lVCoeff;
+        for(int x=0; x<pMap.cols; x++)
         {
-            for(int y=0; y<mSphereImage.rows; y++)
-            {
-                mMap.at<Vec2f>(y,x)[0] = (mMap.at<Vec2f>(y,x)[0]+M_PI)*lHCoeff;
-                mMap.at<Vec2f>(y,x)[1] = (mMap.at<Vec2f>(y,x)[1]+M_PI)*lWCoeff;
-            }
+            Vec3f lDirection;
+            if(Projection::direction(((float)x+0.5f)*lUCoeff, lV, lDirection))
+                lRow[x] = pixelFromDirection(lDirection);
+            else
+                lRow[x] = Vec2f(-1.f, -1.f);
         }
     }
-        break;
+}
+
+/*******************************************/
+Size chromedSphere::getDefaultSize()
+{
+    switch(mProjection)
+    {
+    case eCubemap:
+        return cubemapProjection::defaultSize();
+    case eOctahedral:
+        return octahedralProjection::defaultSize();
+    case eAngular:
+        return angularProjection::defaultSize();
     default:
-        return;
+        return equirectangularProjection::defaultSize();
     }
+}
 
-    // We have a forward map: cv::remap needs a backward one
-    // So we will create it, as well as a mask for non-set values
-    // Going through the probe ...
-    Mat lBackMap = Mat::zeros(mMap.rows, mMap.cols, mMap.type());
-    Mat lMask = Mat::zeros(mMap.rows, mMap.cols, CV_8U);
+/*******************************************/
+float chromedSphere::getResolution(Size pSize)
+{
+    switch(mProjection)
+    {
+    case eCubemap:
+        return cubemapProjection::resolution(pSize);
+    case eOctahedral:
+        return octahedralProjection::resolution(pSize);
+    case eAngular:
+        return angularProjection::resolution(pSize);
+    default:
+        return equirectangularProjection::resolution(pSize);
+    }
+}
 
-    for(int x=0; x<mMap.cols; x++)
+/*******************************************/
+Vec2f chromedSphere::pixelFromDirection(Vec3f pDirection)
+{
+    // The sphere is centered on the origin, the camera is at (-mCameraDistance, 0, 0)
+    // and looks toward +x. The y axis goes to the right of the image, z to the top.
+    float lR = mSphereDiameter/2.f;
+    float lC = mCameraDistance;
+    float lDiameter = (float)mSphereImage.cols;
+
+    // The normal at the point of impact is the bisector of the reversed view ray
+    // and the reflected ray. As the view ray depends on the point of impact,
+    // we iterate starting from an orthographic view. The error shrinks roughly
+    // by R/C at each step, so a few iterations are usually enough; a sphere
+    // close to the camera needs more.
+    Vec3f lView(1.f, 0.f, 0.f);
+    Vec3f lPoint;
+    for(int i=0; i<SPHERE_VIEW_ITERATIONS; i++)
     {
-        for(int y=0; y<mMap.rows; y++)
-        {
-            // We set (in chromedSphere::createTransformationMap()) values for the
-            // angles to M_PI. We don't want to consider them, so ...
-            if(mMap.at<Vec2f>(y, x)[0] < mSphereImage.rows-1 && mMap.at<Vec2f>(y, x)[1] < mSphereImage.cols-1)
-            {
-                int u, v;
-                u = round(mMap.at<Vec2f>(y,x)[0]);
-                v = round(mMap.at<Vec2f>(y,x)[1]);
+        Vec3f lNormal = pDirection - lView;
+        float lNorm = sqrtf(lNormal.dot(lNormal));
 
-                lBackMap.at<Vec2f>(v,u)[0] = mMap.cols-x;
-                lBackMap.at<Vec2f>(v,u)[1] = mMap.rows-y;
+        // Directly behind the sphere: no projection!
+        if(lNorm < 1e-4f)
+            return Vec2f(-1.f, -1.f);
 
-                lMask.at<unsigned char>(v,u) = 255;
-            }
-        }
-    }
+        lPoint = lNormal*(lR/lNorm);
+        Vec3f lNewView = lPoint + Vec3f(lC, 0.f, 0.f);
+        lNewView *= 1.f/sqrtf(lNewView.dot(lNewView));
 
-    // Mask inversion
-    lMask = 255-lMask;
+        Vec3f lChange = lNewView - lView;
+        lView = lNewView;
+        if(lChange.dot(lChange) < SPHERE_VIEW_TOLERANCE*SPHERE_VIEW_TOLERANCE)
+            break;
+    }
 
-    // We need to filter the result to fill the holes
-    Mat lBuffer = Mat::zeros(mMap.rows, mMap.cols, mMap.type());
+    if(lPoint[0]+lC <= 0.f)
+        return Vec2f(-1.f, -1.f);
 
-    // We dilate the map in a temp buffer
-    dilate(lBackMap, lBuffer, Mat(), Point(-1, -1), 4);
+    // Projection on the image plane
+    float lTanA = lPoint[1]/(lPoint[0]+lC);
+    float lTanB = lPoint[2]/(lPoint[0]+lC);
 
-    // And add it mask-wise
-    mMap = lBackMap;
-    add(mMap, lBuffer, mMap, lMask, mMap.type());
-    mMap = lBuffer;
+    return Vec2f(lDiameter/2.f + lTanA*lC*lDiameter/mSphereDiameter,
+                 lDiameter/2.f - lTanB*lC*lDiameter/mSphereDiameter);
 }
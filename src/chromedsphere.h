@@ -1,11 +1,16 @@
 // The class will convert the lightprobe captured by a chromed sphere
-// to a standard panoramic image, using an equirectangular projection
-// as of yet.
+// to a standard panoramic image, using an equirectangular, cubemap,
+// octahedral or angular projection (see projection.h).
 
 #ifndef CHROMEDSPHERE_H
 #define CHROMEDSPHERE_H
 
+#include <map>
 #include <opencv2/opencv.hpp>
+#include <boost/thread.hpp>
+
+#include "projection.h"
+#include "snapshot.h"
 
 //#define _DEBUG
 
@@ -13,11 +18,6 @@ using namespace cv;
 
 namespace paper
 {
-enum projection
-{
-    eEquirectangular = 0
-};
-
 class chromedSphere
 {
 public:
@@ -27,12 +27,43 @@ public:
     // Set and retrieve lightprobe
     bool setProbe(Mat pImage, float pFOV, Vec3f pSphere = Vec3f(0.f, 0.f, 0.f)); // pFOV in degree, see mSphere for pSphere
     bool setProbe(Mat pImage, bool pFixed=false); // Set a new probe while knowing the sphere position has not changed
-    Mat getConvertedProbe();
+    Mat getConvertedProbe(); // Returns a probe of the default size for the projection
+    Mat getConvertedProbe(unsigned int pWidth, unsigned int pHeight); // Returns a probe of the given size, 0 for the default one
+    Mat getSphereImage(); // Returns the image cropped around the sphere
+    Vec3f getSphere(); // Returns the position and radius of the sphere in the image, see mSphere
+    // Converts an image of the cropped sphere (as returned by getSphereImage)
+    // of any type, 8 bits or float, for example an HDRI merged from sphere images
+    Mat convertProbe(Mat pImage, unsigned int pWidth = 0, unsigned int pHeight = 0);
+
+    // Same as above, but directly from the raw (distorted) camera image, in a
+    // single remap composing the undistortion and the sphere maps.
+    // The sphere must have been set from an undistorted image before.
+    void setRectifyMap(Mat pMap); // Map from the undistorted to the raw image, CV_32FC2
+    Mat convertRawProbe(Mat pRawImage, unsigned int pWidth = 0, unsigned int pHeight = 0);
+    Mat getRawSphereImage(Mat pRawImage);
+
+    // Detects the sphere and builds the new maps in a background thread, at most every
+    // pInterval seconds. Meanwhile, trackProbe only crops the image and keeps
+    // using the current maps, until the new ones are swapped in
+    void setAsyncDetection(bool pActive, double pInterval = 0.5);
+    // Same as setProbe(pImage, pFOV), with the detection done in the background if active
+    // The first detection is done synchronously
+    bool trackProbe(Mat pImage, float pFOV);
+
+    // Restores the filtered sphere geometry from the snapshot, if it was saved for
+    // the same image size, FOV and sphere size. The probe can then be set with
+    // setProbe(pImage, true), without detection. Transformation maps are also
+    // taken from the snapshot when they match the geometry
+    // The snapshot must stay open as long as the sphere is used
+    bool setSnapshot(snapshot* pSnapshot, Size pImageSize, float pFOV);
+    // Adds the sphere geometry and the current transformation maps to the snapshot
+    void saveSnapshot(snapshot& pSnapshot);
 
     // Sets various parameters
     void setSphereSize(float pSize); // Chromed sphere size, in mm
     void setSphereReflectance(float pReflectance); // % of reflected light
     void setProjection(projection pProjection);
+    void setAreaFiltering(bool pActive); // Area-weighted downsampling when the output is smaller than the sphere
     void setTrackingLength(unsigned int pLength, float pThreshold); // Length of the averager for the sphere detection smoothing
                                                                     // and threshold to detect large movements and stop averaging
 
@@ -52,15 +83,57 @@ private:
     float mCameraDistance;
 
     projection mProjection; // projection type, default to equirectangular
-    Mat mMap; // map of the geometrical transformation
+    std::map<std::pair<unsigned int, unsigned int>, Mat> mMaps; // maps of the geometrical transformation, per output size
+    bool mAreaFiltering;
+
+    Mat mRectifyMap; // map from the undistorted to the raw image
+    std::map<std::pair<unsigned int, unsigned int>, Mat> mRawMaps; // composition of mRectifyMap and mMaps
+
+    snapshot* mSnapshot;
 
     unsigned int mTrackingLength; // Averager length for the sphere detection
     float mThreshold; // Threshold to consider that the sphere has moved (if move > mThreshold*sigma)
 
+    // Asynchronous detection
+    struct asyncRequest
+    {
+        Mat image;
+        float FOV;
+        std::vector<Size> sizes, rawSizes; // maps in use, to be rebuilt
+        float sphereDiameter;
+        projection proj;
+        bool areaFiltering;
+        unsigned int trackingLength;
+        float threshold;
+        Mat rectifyMap;
+        unsigned int generation;
+    };
+    struct asyncResult
+    {
+        unsigned int generation; // of the request
+        Size imageSize; // of the image the sphere was detected in
+        Vec3f sphere;
+        std::map<std::pair<unsigned int, unsigned int>, Mat> maps, rawMaps;
+    };
+
+    chromedSphere* mWorker; // only used by the worker thread
+    boost::thread mWorkerThread;
+    boost::mutex mAsyncMutex; // protects the request and the result
+    boost::condition_variable mAsyncCondition;
+    volatile bool mAsyncActive;
+    double mAsyncInterval;
+    double mLastRequestTime;
+    bool mRequestPending, mResultReady;
+    unsigned int mGeneration; // incremented when the image size changes, older results being discarded
+    asyncRequest mRequest;
+    asyncResult mResult;
+
     /***************************/
     // Methods
     // Detect the chromed sphere
     Vec3f detectSphere();
+    // Worker thread loop, for the asynchronous detection
+    void workerLoop();
     // Filters the sphere position and radius according to parameters
     Vec3f filterSphere(Vec3f pNewSphere);
 
@@ -68,17 +141,37 @@ private:
     void distanceFromCamera();
 
     // Crops the view to keep only the sphere
+    Rect getCropRect();
     Mat cropImage();
 
-    // Creates the transformation map (mMap)
-    void createTransformationMap();
-
-    // Calculating illumination direction from the position
-    // of pixels on the chrome sphere
-    Vec2f directionFromViewAngle(Vec2f pAngle);
-
-    // Convert the map according to the chosen projection
-    void projectionMapFromDirections();
+    // Creates the transformation map from the output probe of size pSize
+    // to the cropped sphere image
+    Mat createTransformationMap(Size pSize);
+    template<class Projection> Mat createProjectionMap(Size pSize);
+    template<class Projection> void projectRows(Mat pMap, const Range& pRows);
+    // Returns the map for the given size, creates it if needed
+    Mat getMap(Size pSize);
+    // Hash of the inputs of the sphere geometry (pFOV in radians), and of the transformation map of size pSize
+    uint64_t getGeometryHash(Size pImageSize, float pFOV);
+    uint64_t getMapHash(Size pSize);
+    // Composes the given map with mRectifyMap
+    Mat composeMap(Mat pMap);
+    void composeRows(Mat pMap, Mat pComposed, Rect pCrop, const Range& pRows);
+
+    // Output size (the default one if pWidth or pHeight is 0), oversampling
+    // factor used for area filtering, and final downsampling of the probe
+    Size getOutputSize(unsigned int pWidth, unsigned int pHeight);
+    unsigned int getFilteringFactor(Size pSize);
+    Mat finalizeProbe(Mat pProbe, Size pSize);
+
+    // Default size and resolution (in pixels per radian) of the output
+    // for the current projection
+    Size getDefaultSize();
+    float getResolution(Size pSize);
+
+    // Calculating the position of the pixel on the chromed sphere
+    // reflecting the light coming from pDirection
+    Vec2f pixelFromDirection(Vec3f pDirection);
 };
 }
 
@@ -0,0 +1,296 @@
+#include "controlserver.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+using namespace paper;
+
+// Longest request accepted, the connection is closed otherwise
+#define CONTROL_MAX_LINE 4096
+// Seconds to send a reply, after which the client is considered gone
+#define CONTROL_SEND_TIMEOUT 10
+
+/*******************************************/
+// Sends the whole buffer, without raising SIGPIPE if the peer is gone
+static bool sendAll(int pSocket, const char* pData, size_t pSize)
+{
+    while(pSize != 0)
+    {
+        ssize_t lSent = send(pSocket, pData, pSize, MSG_NOSIGNAL);
+        if(lSent < 0 && errno == EINTR)
+            continue;
+        if(lSent <= 0)
+            return false;
+
+        pData += lSent;
+        pSize -= lSent;
+    }
+
+    return true;
+}
+
+/*******************************************/
+controlServer::controlServer()
+{
+    mSocket = -1;
+    mRunning = false;
+    mNextId = 0;
+}
+
+/*******************************************/
+controlServer::~controlServer()
+{
+    close();
+}
+
+/*******************************************/
+bool controlServer::open(const char* pPath)
+{
+    close();
+
+    sockaddr_un lAddress;
+    memset(&lAddress, 0, sizeof(lAddress));
+    if(strlen(pPath) >= sizeof(lAddress.sun_path))
+        return false;
+    lAddress.sun_family = AF_UNIX;
+    strncpy(lAddress.sun_path, pPath, sizeof(lAddress.sun_path)-1);
+
+    // Socket left by a previous run. Anything else is not removed
+    struct stat lStat;
+    if(lstat(pPath, &lStat) == 0 && S_ISSOCK(lStat.st_mode))
+        unlink(pPath);
+
+    int lSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(lSocket < 0)
+        return false;
+
+    // Requests run with the privileges of the server, other users must not
+    // connect. Nobody can before listen, so the permissions are set in between
+    if(bind(lSocket, (sockaddr*)&lAddress, sizeof(lAddress)) != 0)
+    {
+        ::close(lSocket);
+        return false;
+    }
+
+    if(chmod(pPath, S_IRUSR | S_IWUSR) != 0 || listen(lSocket, 16) != 0)
+    {
+        unlink(pPath);
+        ::close(lSocket);
+        return false;
+    }
+
+    mSocket = lSocket;
+    mPath = pPath;
+    mRunning = true;
+    mAcceptThread = boost::thread(&controlServer::acceptLoop, this);
+
+    return true;
+}
+
+/*******************************************/
+void controlServer::close()
+{
+    if(mSocket < 0)
+        return;
+
+    // Shutting the sockets down wakes up the threads blocked on them. Replies
+    // already given are still sent
+    {
+        boost::mutex::scoped_lock lLock(mMutex);
+        mRunning = false;
+        shutdown(mSocket, SHUT_RDWR);
+        for(unsigned int i=0; i<mClients.size(); i++)
+            shutdown(mClients[i], SHUT_RD);
+        mCondition.notify_all();
+    }
+
+    mAcceptThread.join();
+
+    {
+        boost::mutex::scoped_lock lLock(mMutex);
+        while(mClients.size() != 0)
+            mCondition.wait(lLock);
+        mRequests.clear();
+        mReplies.clear();
+    }
+
+    ::close(mSocket);
+    mSocket = -1;
+    unlink(mPath.c_str());
+}
+
+/*******************************************/
+bool controlServer::isOpen()
+{
+    return mRunning;
+}
+
+/*******************************************/
+bool controlServer::waitRequest(controlRequest& pRequest, double pTimeout)
+{
+    boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::microseconds((long)(pTimeout*1e6));
+
+    boost::mutex::scoped_lock lLock(mMutex);
+    while(mRunning && mRequests.size() == 0)
+    {
+        if(pTimeout < 0.0)
+            mCondition.wait(lLock);
+        else if(!mCondition.timed_wait(lLock, lDeadline))
+            break;
+    }
+
+    if(!mRunning || mRequests.size() == 0)
+        return false;
+
+    pRequest = mRequests.front();
+    mRequests.pop_front();
+    return true;
+}
+
+/*******************************************/
+void controlServer::reply(const controlRequest& pRequest, const string& pReply)
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    if(!mRunning)
+        return;
+
+    mReplies[pRequest.id] = pReply;
+    mCondition.notify_all();
+}
+
+/*******************************************/
+bool controlServer::sendRequest(const char* pPath, const string& pRequest, FILE* pOutput)
+{
+    sockaddr_un lAddress;
+    memset(&lAddress, 0, sizeof(lAddress));
+    if(strlen(pPath) >= sizeof(lAddress.sun_path))
+        return false;
+    lAddress.sun_family = AF_UNIX;
+    strncpy(lAddress.sun_path, pPath, sizeof(lAddress.sun_path)-1);
+
+    int lSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(lSocket < 0)
+        return false;
+
+    // The end of the request tells the server to close the connection once it replied
+    string lLine = pRequest + "\n";
+    bool lResult = connect(lSocket, (sockaddr*)&lAddress, sizeof(lAddress)) == 0
+        && sendAll(lSocket, lLine.data(), lLine.size())
+        && shutdown(lSocket, SHUT_WR) == 0;
+
+    char lData[4096];
+    while(lResult)
+    {
+        ssize_t lSize = recv(lSocket, lData, sizeof(lData), 0);
+        if(lSize < 0 && errno == EINTR)
+            continue;
+        if(lSize <= 0)
+        {
+            lResult = lSize == 0;
+            break;
+        }
+        fwrite(lData, 1, lSize, pOutput);
+    }
+
+    ::close(lSocket);
+    fflush(pOutput);
+    return lResult;
+}
+
+/*******************************************/
+void controlServer::acceptLoop()
+{
+    trace::setThreadName("control");
+
+    while(mRunning)
+    {
+        int lClient = accept(mSocket, NULL, NULL);
+        if(lClient < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        boost::mutex::scoped_lock lLock(mMutex);
+        if(!mRunning)
+        {
+            ::close(lClient);
+            break;
+        }
+
+        timeval lTimeout = {CONTROL_SEND_TIMEOUT, 0};
+        setsockopt(lClient, SOL_SOCKET, SO_SNDTIMEO, &lTimeout, sizeof(lTimeout));
+
+        mClients.push_back(lClient);
+        boost::thread(&controlServer::clientLoop, this, lClient).detach();
+    }
+}
+
+/*******************************************/
+void controlServer::clientLoop(int pClient)
+{
+    string lBuffer;
+    char lData[1024];
+
+    while(mRunning)
+    {
+        size_t lEnd = lBuffer.find('\n');
+        if(lEnd == string::npos)
+        {
+            if(lBuffer.size() > CONTROL_MAX_LINE)
+                break;
+
+            ssize_t lSize = recv(pClient, lData, sizeof(lData), 0);
+            if(lSize < 0 && errno == EINTR)
+                continue;
+            if(lSize <= 0)
+                break;
+            lBuffer.append(lData, lSize);
+            continue;
+        }
+
+        controlRequest lRequest;
+        lRequest.line = lBuffer.substr(0, lEnd);
+        lBuffer.erase(0, lEnd+1);
+        if(lRequest.line.size() != 0 && lRequest.line[lRequest.line.size()-1] == '\r')
+            lRequest.line.erase(lRequest.line.size()-1);
+        if(lRequest.line.size() == 0)
+            continue;
+
+        // Queued with the requests of the other clients
+        string lReply;
+        {
+            boost::mutex::scoped_lock lLock(mMutex);
+            lRequest.id = mNextId++;
+            mRequests.push_back(lRequest);
+            mCondition.notify_all();
+
+            while(mRunning && mReplies.find(lRequest.id) == mReplies.end())
+                mCondition.wait(lLock);
+
+            map<unsigned long long, string>::iterator lFound = mReplies.find(lRequest.id);
+            if(lFound == mReplies.end())
+                break;
+            lReply.swap(lFound->second);
+            mReplies.erase(lFound);
+        }
+
+        if(!sendAll(pClient, lReply.data(), lReply.size()))
+            break;
+    }
+
+    // Closed with the lock held, so that close does not shut a reused descriptor down
+    boost::mutex::scoped_lock lLock(mMutex);
+    mClients.erase(find(mClients.begin(), mClients.end(), pClient));
+    ::close(pClient);
+    mCondition.notify_all();
+}
@@ -0,0 +1,74 @@
+// Control of a running capture from other local processes, through a Unix
+// stream socket. Requests are lines of text, read from any number of
+// clients, and queued in their order of arrival: a single thread executes
+// them with waitRequest and answers with reply. A client sends its next
+// request once the previous one is answered, so several requests can be
+// written at once on a connection.
+// Replies are sent as is, and can hold binary data after their first line.
+
+#ifndef CONTROLSERVER_H
+#define CONTROLSERVER_H
+
+#include <deque>
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace paper
+{
+struct controlRequest
+{
+    unsigned long long id;
+    string line; // without the end of line
+};
+
+class controlServer
+{
+public:
+    controlServer();
+    ~controlServer();
+
+    // Listens on the socket pPath, replacing any previous one
+    // Only the user running the server can connect to it
+    bool open(const char* pPath);
+    // Disconnects the clients, pending requests are dropped
+    void close();
+    bool isOpen();
+
+    // Waits up to pTimeout seconds (forever if negative) for the next request
+    // Returns false on timeout, or if the server is closed
+    bool waitRequest(controlRequest& pRequest, double pTimeout = -1.0);
+    void reply(const controlRequest& pRequest, const string& pReply);
+
+    // Client: sends one request to the server pPath, and copies the whole
+    // reply to pOutput
+    static bool sendRequest(const char* pPath, const string& pRequest, FILE* pOutput);
+
+private:
+    /*****************/
+    // Attributes
+    string mPath;
+    int mSocket;
+    volatile bool mRunning;
+
+    boost::mutex mMutex;
+    boost::condition_variable mCondition;
+    deque<controlRequest> mRequests;
+    map<unsigned long long, string> mReplies;
+    unsigned long long mNextId;
+    vector<int> mClients; // connected sockets, each read by its own detached thread
+
+    boost::thread mAcceptThread;
+
+    /****************/
+    // Methods
+    void acceptLoop();
+    void clientLoop(int pClient);
+};
+}
+
+#endif // CONTROLSERVER_H
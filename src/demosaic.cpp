@@ -0,0 +1,310 @@
+#include "demosaic.h"
+
+#include "pooledallocator.h"
+#include "scheduler.h"
+
+using namespace paper;
+
+// Border added around the raw frame, so that no pixel needs bound checks
+// Reflection around the first pixel keeps the Bayer pattern
+#define DEMOSAIC_BORDER 2
+
+namespace
+{
+// Kinds of sites of the Bayer pattern
+enum bayerSite
+{
+    eSiteRed,
+    eSiteBlue,
+    eSiteGreenRed, // green on a red row
+    eSiteGreenBlue // green on a blue row
+};
+
+/*******************************************/
+inline unsigned char clampValue(int pValue)
+{
+    return (unsigned char)(pValue < 0 ? 0 : (pValue > 255 ? 255 : pValue));
+}
+
+/*******************************************/
+// Sites of the even and odd columns of row y
+void getRowSites(bayerPattern pPattern, int pY, bayerSite pSites[2])
+{
+    // Position of the red site in the 2x2 block
+    int lRedY = (pPattern == eBayerGBRG || pPattern == eBayerBGGR) ? 1 : 0;
+    int lRedX = (pPattern == eBayerGRBG || pPattern == eBayerBGGR) ? 1 : 0;
+
+    if((pY & 1) == lRedY)
+    {
+        pSites[lRedX] = eSiteRed;
+        pSites[1-lRedX] = eSiteGreenRed;
+    }
+    else
+    {
+        pSites[1-lRedX] = eSiteBlue;
+        pSites[lRedX] = eSiteGreenBlue;
+    }
+}
+
+/*******************************************/
+// Bilinear interpolation
+class bilinearDemosaicer : public ParallelLoopBody
+{
+public:
+    bilinearDemosaicer(const Mat& pRaw, Mat& pImage, bayerPattern pPattern)
+        : mRaw(pRaw), mImage(pImage), mPattern(pPattern) {}
+
+    void operator()(const Range& pRange) const
+    {
+        int lWidth = mImage.cols;
+
+        for(int y=pRange.start; y<pRange.end; y++)
+        {
+            // Pointers on the pixel (y, 0) of the padded frame and its neighbours
+            const unsigned char* lRow = mRaw.ptr<unsigned char>(y+DEMOSAIC_BORDER) + DEMOSAIC_BORDER;
+            const unsigned char* lAbove = lRow - mRaw.step[0];
+            const unsigned char* lBelow = lRow + mRaw.step[0];
+            unsigned char* lOut = mImage.ptr<unsigned char>(y);
+
+            bayerSite lSites[2];
+            getRowSites(mPattern, y, lSites);
+
+            for(int lParity=0; lParity<2; lParity++)
+            {
+                if(lSites[lParity] == eSiteRed || lSites[lParity] == eSiteBlue)
+                {
+                    // Index of the color of the site, and of the opposite one
+                    int lOwn = lSites[lParity] == eSiteRed ? 2 : 0;
+                    int lOther = 2-lOwn;
+                    for(int x=lParity; x<lWidth; x+=2)
+                    {
+                        lOut[3*x+lOwn] = lRow[x];
+                        lOut[3*x+1] = (lAbove[x] + lBelow[x] + lRow[x-1] + lRow[x+1] + 2) >> 2;
+                        lOut[3*x+lOther] = (lAbove[x-1] + lAbove[x+1] + lBelow[x-1] + lBelow[x+1] + 2) >> 2;
+                    }
+                }
+                else
+                {
+                    // Index of the color found on the same row, and of the one found on the same column
+                    int lHorizontal = lSites[lParity] == eSiteGreenRed ? 2 : 0;
+                    int lVertical = 2-lHorizontal;
+                    for(int x=lParity; x<lWidth; x+=2)
+                    {
+                        lOut[3*x+1] = lRow[x];
+                        lOut[3*x+lHorizontal] = (lRow[x-1] + lRow[x+1] + 1) >> 1;
+                        lOut[3*x+lVertical] = (lAbove[x] + lBelow[x] + 1) >> 1;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    const Mat& mRaw;
+    Mat& mImage;
+    bayerPattern mPattern;
+};
+
+/*******************************************/
+// First pass of the edge-aware demosaicing: the green plane
+class greenInterpolator : public ParallelLoopBody
+{
+public:
+    greenInterpolator(const Mat& pRaw, Mat& pGreen, bayerPattern pPattern)
+        : mRaw(pRaw), mGreen(pGreen), mPattern(pPattern) {}
+
+    void operator()(const Range& pRange) const
+    {
+        int lWidth = mGreen.cols;
+        int lStep = (int)mRaw.step[0];
+
+        for(int y=pRange.start; y<pRange.end; y++)
+        {
+            const unsigned char* lRow = mRaw.ptr<unsigned char>(y+DEMOSAIC_BORDER) + DEMOSAIC_BORDER;
+            unsigned char* lOut = mGreen.ptr<unsigned char>(y);
+
+            bayerSite lSites[2];
+            getRowSites(mPattern, y, lSites);
+
+            for(int lParity=0; lParity<2; lParity++)
+            {
+                if(lSites[lParity] == eSiteGreenRed || lSites[lParity] == eSiteGreenBlue)
+                {
+                    for(int x=lParity; x<lWidth; x+=2)
+                        lOut[x] = lRow[x];
+                    continue;
+                }
+
+                for(int x=lParity; x<lWidth; x+=2)
+                {
+                    int lCenter = 2*lRow[x];
+                    int lLeft = lRow[x-1], lRight = lRow[x+1];
+                    int lUp = lRow[x-lStep], lDown = lRow[x+lStep];
+
+                    // Second derivative of the site color along each direction
+                    int lLaplacianH = lCenter - lRow[x-2] - lRow[x+2];
+                    int lLaplacianV = lCenter - lRow[x-2*lStep] - lRow[x+2*lStep];
+
+                    int lGradientH = abs(lLeft-lRight) + abs(lLaplacianH);
+                    int lGradientV = abs(lUp-lDown) + abs(lLaplacianV);
+
+                    // Four times the green estimates
+                    int lEstimateH = 2*(lLeft+lRight) + lLaplacianH;
+                    int lEstimateV = 2*(lUp+lDown) + lLaplacianV;
+
+                    int lEstimate;
+                    if(lGradientH < lGradientV)
+                        lEstimate = lEstimateH;
+                    else if(lGradientV < lGradientH)
+                        lEstimate = lEstimateV;
+                    else
+                        lEstimate = (lEstimateH+lEstimateV) >> 1;
+
+                    lOut[x] = clampValue((lEstimate+2) >> 2);
+                }
+            }
+        }
+    }
+
+private:
+    const Mat& mRaw;
+    Mat& mGreen;
+    bayerPattern mPattern;
+};
+
+/*******************************************/
+// Second pass of the edge-aware demosaicing: red and blue, interpolated
+// as differences to the green plane
+class colorInterpolator : public ParallelLoopBody
+{
+public:
+    colorInterpolator(const Mat& pRaw, const Mat& pGreen, Mat& pImage, bayerPattern pPattern)
+        : mRaw(pRaw), mGreen(pGreen), mImage(pImage), mPattern(pPattern) {}
+
+    void operator()(const Range& pRange) const
+    {
+        int lWidth = mImage.cols;
+
+        for(int y=pRange.start; y<pRange.end; y++)
+        {
+            const unsigned char* lRow = mRaw.ptr<unsigned char>(y+DEMOSAIC_BORDER) + DEMOSAIC_BORDER;
+            const unsigned char* lAbove = lRow - mRaw.step[0];
+            const unsigned char* lBelow = lRow + mRaw.step[0];
+            const unsigned char* lGreen = mGreen.ptr<unsigned char>(y+DEMOSAIC_BORDER) + DEMOSAIC_BORDER;
+            const unsigned char* lGreenAbove = lGreen - mGreen.step[0];
+            const unsigned char* lGreenBelow = lGreen + mGreen.step[0];
+            unsigned char* lOut = mImage.ptr<unsigned char>(y);
+
+            bayerSite lSites[2];
+            getRowSites(mPattern, y, lSites);
+
+            for(int lParity=0; lParity<2; lParity++)
+            {
+                if(lSites[lParity] == eSiteRed || lSites[lParity] == eSiteBlue)
+                {
+                    int lOwn = lSites[lParity] == eSiteRed ? 2 : 0;
+                    int lOther = 2-lOwn;
+                    for(int x=lParity; x<lWidth; x+=2)
+                    {
+                        int lDiagonal = (lAbove[x-1] - lGreenAbove[x-1]) + (lAbove[x+1] - lGreenAbove[x+1])
+                                + (lBelow[x-1] - lGreenBelow[x-1]) + (lBelow[x+1] - lGreenBelow[x+1]);
+                        lOut[3*x+lOwn] = lRow[x];
+                        lOut[3*x+1] = lGreen[x];
+                        lOut[3*x+lOther] = clampValue(lGreen[x] + (lDiagonal >> 2));
+                    }
+                }
+                else
+                {
+                    int lHorizontal = lSites[lParity] == eSiteGreenRed ? 2 : 0;
+                    int lVertical = 2-lHorizontal;
+                    for(int x=lParity; x<lWidth; x+=2)
+                    {
+                        int lDiffH = (lRow[x-1] - lGreen[x-1]) + (lRow[x+1] - lGreen[x+1]);
+                        int lDiffV = (lAbove[x] - lGreenAbove[x]) + (lBelow[x] - lGreenBelow[x]);
+                        lOut[3*x+1] = lRow[x];
+                        lOut[3*x+lHorizontal] = clampValue(lRow[x] + (lDiffH >> 1));
+                        lOut[3*x+lVertical] = clampValue(lRow[x] + (lDiffV >> 1));
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    const Mat& mRaw;
+    const Mat& mGreen;
+    Mat& mImage;
+    bayerPattern mPattern;
+};
+}
+
+/*******************************************/
+void paper::demosaic(const Mat& pRaw, Mat& pImage, bayerPattern pPattern, demosaicMethod pMethod)
+{
+    if(pRaw.rows == 0 || pRaw.type() != CV_8UC1)
+        return;
+
+    pImage.create(pRaw.size(), CV_8UC3);
+
+    Mat lPadded = pooledMat();
+    copyMakeBorder(pRaw, lPadded, DEMOSAIC_BORDER, DEMOSAIC_BORDER, DEMOSAIC_BORDER, DEMOSAIC_BORDER, BORDER_REFLECT_101);
+
+    if(pMethod == eDemosaicBilinear)
+    {
+        bilinearDemosaicer lDemosaicer(lPadded, pImage, pPattern);
+        scheduler::parallelFor(Range(0, pRaw.rows), lDemosaicer);
+    }
+    else
+    {
+        Mat lGreen = pooledMat(pRaw.size(), CV_8UC1);
+        greenInterpolator lGreenPass(lPadded, lGreen, pPattern);
+        scheduler::parallelFor(Range(0, pRaw.rows), lGreenPass);
+
+        Mat lPaddedGreen = pooledMat();
+        copyMakeBorder(lGreen, lPaddedGreen, DEMOSAIC_BORDER, DEMOSAIC_BORDER, DEMOSAIC_BORDER, DEMOSAIC_BORDER, BORDER_REFLECT_101);
+        colorInterpolator lColorPass(lPadded, lPaddedGreen, pImage, pPattern);
+        scheduler::parallelFor(Range(0, pRaw.rows), lColorPass);
+    }
+}
+
+/*******************************************/
+void paper::mosaic(const Mat& pImage, Mat& pRaw, bayerPattern pPattern)
+{
+    if(pImage.rows == 0 || pImage.type() != CV_8UC3)
+        return;
+
+    pRaw.create(pImage.size(), CV_8UC1);
+
+    for(int y=0; y<pImage.rows; y++)
+    {
+        const unsigned char* lPixels = pImage.ptr<unsigned char>(y);
+        unsigned char* lOut = pRaw.ptr<unsigned char>(y);
+
+        bayerSite lSites[2];
+        getRowSites(pPattern, y, lSites);
+
+        for(int lParity=0; lParity<2; lParity++)
+        {
+            int lChannel = lSites[lParity] == eSiteRed ? 2 : (lSites[lParity] == eSiteBlue ? 0 : 1);
+            for(int x=lParity; x<pImage.cols; x+=2)
+                lOut[x] = lPixels[3*x+lChannel];
+        }
+    }
+}
+
+/*******************************************/
+bool paper::bayerPatternFromString(const string& pName, bayerPattern& pPattern)
+{
+    if(pName == "RGGB")
+        pPattern = eBayerRGGB;
+    else if(pName == "GRBG")
+        pPattern = eBayerGRBG;
+    else if(pName == "GBRG")
+        pPattern = eBayerGBRG;
+    else if(pName == "BGGR")
+        pPattern = eBayerBGGR;
+    else
+        return false;
+
+    return true;
+}
@@ -0,0 +1,45 @@
+// Demosaicing of raw 8 bits Bayer frames into BGR images, in parallel
+// over blocks of rows. Inner loops handle one kind of Bayer site at a
+// time, without branches, so that the compiler can vectorize them.
+//   - bilinear: average of the nearest samples of each color, for previews
+//   - edge-aware: green interpolated along the smoothest direction with a
+//     second order correction (Hamilton-Adams), red and blue interpolated
+//     as differences to green, for final captures
+
+#ifndef DEMOSAIC_H
+#define DEMOSAIC_H
+
+#include <string>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+// Colors of the first 2x2 block of the sensor
+enum bayerPattern
+{
+    eBayerRGGB = 0,
+    eBayerGRBG,
+    eBayerGBRG,
+    eBayerBGGR
+};
+
+enum demosaicMethod
+{
+    eDemosaicBilinear = 0,
+    eDemosaicEdgeAware
+};
+
+// Demosaics pRaw (CV_8UC1) into pImage (CV_8UC3), allocated if needed
+void demosaic(const Mat& pRaw, Mat& pImage, bayerPattern pPattern, demosaicMethod pMethod);
+
+// Samples the BGR image pImage (CV_8UC3) as seen by a Bayer sensor, into pRaw (CV_8UC1)
+void mosaic(const Mat& pImage, Mat& pRaw, bayerPattern pPattern);
+
+// Reads a pattern from its name ("RGGB", "GRBG", "GBRG" or "BGGR")
+bool bayerPatternFromString(const string& pName, bayerPattern& pPattern);
+}
+
+#endif // DEMOSAIC_H
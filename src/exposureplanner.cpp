@@ -0,0 +1,221 @@
+#include "exposureplanner.h"
+
+using namespace paper;
+
+// Values under this one are considered as black, their radiance is unknown
+#define PLANNER_BLACK_LEVEL 2
+
+/*******************************************/
+exposurePlanner::exposurePlanner()
+{
+    mLow = 32;
+    mHigh = 224;
+    mTailFraction = 0.002f;
+    mStep = 4;
+    mOverlap = 0.5f;
+
+    mHistogram.assign(256, 0);
+    reset();
+}
+
+/*******************************************/
+exposurePlanner::~exposurePlanner()
+{
+}
+
+/*******************************************/
+void exposurePlanner::setBand(unsigned char pLow, unsigned char pHigh)
+{
+    if(pLow >= pHigh || pLow == 0)
+        return;
+
+    mLow = pLow;
+    mHigh = pHigh;
+}
+
+/*******************************************/
+void exposurePlanner::setTailFraction(float pFraction)
+{
+    mTailFraction = max(min(pFraction, 0.5f), 0.f);
+}
+
+/*******************************************/
+void exposurePlanner::setSubsampling(unsigned int pStep)
+{
+    mStep = max(pStep, 1u);
+}
+
+/*******************************************/
+void exposurePlanner::setOverlap(float pStops)
+{
+    mOverlap = max(pStops, 0.f);
+}
+
+/*******************************************/
+void exposurePlanner::reset()
+{
+    mFrames = 0;
+    mMinEV = mMaxEV = 0.f;
+    mShadowsDone = mHighlightsDone = false;
+    mShadowsEV = mHighlightsEV = 0.f;
+    mNextEV = 0.f;
+    mNextSide = 0;
+    mSamples = 0;
+}
+
+/*******************************************/
+bool exposurePlanner::addFrame(const Mat& pFrame, float pEV, bool pDisk)
+{
+    if(pFrame.rows == 0 || pFrame.type() != CV_8UC3)
+        return false;
+
+    computeHistogram(pFrame, pDisk);
+    if(mSamples == 0)
+        return false;
+
+    // If the exposure asked for could not be reached, the camera is at its limit
+    if(mFrames != 0)
+    {
+        if(mNextSide == 1 && pEV <= mMaxEV + 0.01f)
+            mHighlightsDone = true;
+        else if(mNextSide == -1 && pEV >= mMinEV - 0.01f)
+            mShadowsDone = true;
+    }
+
+    // The least exposed frame tells about the highlights, the most exposed one about the shadows
+    // (the higher the EV, the darker the frame)
+    bool lDarkest = mFrames == 0 || pEV > mMaxEV;
+    bool lBrightest = mFrames == 0 || pEV < mMinEV;
+    if(lDarkest)
+        mMaxEV = pEV;
+    if(lBrightest)
+        mMinEV = pEV;
+    mFrames++;
+
+    // Each frame covers the band, minus the overlap with the next one
+    float lBand = max(getBandStops() - mOverlap, 0.5f);
+
+    if(lDarkest && !mHighlightsDone)
+    {
+        unsigned int lTop = getPercentile(1.f - mTailFraction);
+        if(lTop <= mHigh)
+        {
+            mHighlightsDone = true;
+        }
+        else
+        {
+            // Clipped values are of unknown radiance, we go as far as possible
+            float lNeeded = lBand;
+            if(lTop < 255)
+                lNeeded = log2((float)lTop/(float)mHigh);
+            // Equal steps over the needed range
+            float lSteps = ceilf(lNeeded/lBand);
+            mHighlightsEV = mMaxEV + lNeeded/lSteps;
+        }
+    }
+
+    if(lBrightest && !mShadowsDone)
+    {
+        unsigned int lBottom = getPercentile(mTailFraction);
+        if(lBottom >= mLow)
+        {
+            mShadowsDone = true;
+        }
+        else
+        {
+            float lNeeded = lBand;
+            if(lBottom > PLANNER_BLACK_LEVEL)
+                lNeeded = log2((float)mLow/(float)lBottom);
+            float lSteps = ceilf(lNeeded/lBand);
+            mShadowsEV = mMinEV - lNeeded/lSteps;
+        }
+    }
+
+    // Highlights first, as they are the most likely to need several frames
+    if(!mHighlightsDone)
+    {
+        mNextSide = 1;
+        mNextEV = mHighlightsEV;
+    }
+    else if(!mShadowsDone)
+    {
+        mNextSide = -1;
+        mNextEV = mShadowsEV;
+    }
+    else
+    {
+        mNextSide = 0;
+        mNextEV = pEV;
+    }
+
+    return mNextSide != 0;
+}
+
+/*******************************************/
+float exposurePlanner::getNextEV()
+{
+    return mNextEV;
+}
+
+/*******************************************/
+vector<unsigned int> exposurePlanner::getHistogram()
+{
+    return mHistogram;
+}
+
+/*******************************************/
+void exposurePlanner::computeHistogram(const Mat& pFrame, bool pDisk)
+{
+    mHistogram.assign(256, 0);
+    mSamples = 0;
+
+    float lCenterX = (float)pFrame.cols/2.f;
+    float lCenterY = (float)pFrame.rows/2.f;
+
+    for(int y=mStep/2; y<pFrame.rows; y+=mStep)
+    {
+        const unsigned char* lPixels = pFrame.ptr<unsigned char>(y);
+
+        int lStart = mStep/2;
+        int lEnd = pFrame.cols;
+        // Only the part of the row inside the inscribed ellipse
+        if(pDisk)
+        {
+            float lV = ((float)y+0.5f-lCenterY)/lCenterY;
+            if(lV*lV >= 1.f)
+                continue;
+            float lHalf = lCenterX*sqrtf(1.f-lV*lV);
+            lStart = max(lStart, (int)ceilf(lCenterX-lHalf));
+            lEnd = min(lEnd, (int)(lCenterX+lHalf));
+        }
+
+        for(int x=lStart; x<lEnd; x+=mStep)
+        {
+            // A pixel is clipped as soon as one of its channels is
+            unsigned char lValue = max(lPixels[3*x], max(lPixels[3*x+1], lPixels[3*x+2]));
+            mHistogram[lValue]++;
+            mSamples++;
+        }
+    }
+}
+
+/*******************************************/
+unsigned int exposurePlanner::getPercentile(float pFraction)
+{
+    unsigned int lTarget = (unsigned int)(pFraction*(float)mSamples);
+    unsigned int lSum = 0;
+    for(unsigned int i=0; i<256; i++)
+    {
+        lSum += mHistogram[i];
+        if(lSum > lTarget)
+            return i;
+    }
+
+    return 255;
+}
+
+/*******************************************/
+float exposurePlanner::getBandStops()
+{
+    return log2((float)mHigh/(float)mLow);
+}
@@ -0,0 +1,74 @@
+// Plans the exposures of a bracket from the histograms of the frames
+// already captured. Each frame covers the values falling in the useful
+// band of the HDR weighting function: the next exposure is chosen so that
+// the shadows or highlights left outside of this band get into it, with
+// the minimum number of steps. The bracket ends once both tails are covered.
+
+#ifndef EXPOSUREPLANNER_H
+#define EXPOSUREPLANNER_H
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+class exposurePlanner
+{
+public:
+    exposurePlanner();
+    ~exposurePlanner();
+
+    // Sets the values where the weighting function is useful
+    // Default to [32, 224], where the gaussian weight of hdriBuilder is above 5%
+    void setBand(unsigned char pLow, unsigned char pHigh);
+    // Sets the fraction of the pixels allowed outside of the band, for each tail
+    void setTailFraction(float pFraction);
+    // Sets the sampling step of the histograms, in pixels
+    void setSubsampling(unsigned int pStep);
+    // Sets the overlap between two successive exposures, in stops
+    void setOverlap(float pStops);
+
+    // Starts a new bracket
+    void reset();
+
+    // Adds a frame of the bracket, of type RGB8u, captured with the given EV
+    // If pDisk, only the disk inscribed in the frame is considered (as for a cropped sphere)
+    // Returns true if another frame is needed, its EV being given by getNextEV
+    bool addFrame(const Mat& pFrame, float pEV, bool pDisk = false);
+    float getNextEV();
+
+    // Returns the histogram of the last frame, 256 values
+    vector<unsigned int> getHistogram();
+
+private:
+    /*****************/
+    // Attributes
+    unsigned char mLow, mHigh;
+    float mTailFraction;
+    unsigned int mStep;
+    float mOverlap;
+
+    unsigned int mFrames;
+    float mMinEV, mMaxEV; // range of the frames captured
+    bool mShadowsDone, mHighlightsDone;
+    float mShadowsEV, mHighlightsEV; // next exposures for each tail
+    float mNextEV;
+    int mNextSide; // -1 for the shadows, 1 for the highlights, 0 if done
+
+    vector<unsigned int> mHistogram;
+    unsigned int mSamples;
+
+    /****************/
+    // Methods
+    // Fills the histogram of the maximum channel of the sampled pixels
+    void computeHistogram(const Mat& pFrame, bool pDisk);
+    // Returns the value below which lies the given fraction of the samples
+    unsigned int getPercentile(float pFraction);
+    // Returns the width of the useful band, in stops
+    float getBandStops();
+};
+}
+
+#endif // EXPOSUREPLANNER_H
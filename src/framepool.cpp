@@ -0,0 +1,95 @@
+#include "framepool.h"
+
+using namespace paper;
+
+// Enough for the frames of a bracket and those in the pipeline queues
+#define FRAMEPOOL_DEFAULT_CAPACITY 32
+
+/*******************************************/
+framePool::framePool()
+{
+    mCapacity = FRAMEPOOL_DEFAULT_CAPACITY;
+}
+
+/*******************************************/
+framePool::~framePool()
+{
+}
+
+/*******************************************/
+Mat framePool::getBuffer(Size pSize, int pType)
+{
+    if(pSize.width <= 0 || pSize.height <= 0)
+        return Mat();
+
+    boost::mutex::scoped_lock lLock(mMutex);
+
+    // A free buffer of the same format first, then any free buffer
+    int lFree = -1;
+    for(unsigned int i=0; i<mBuffers.size(); i++)
+    {
+        // A refcount of 1 means that only the pool holds the buffer.
+        // Nobody else can get a reference to it, so it won't change
+        // while we are looking at it.
+        if(mBuffers[i].refcount == NULL || *mBuffers[i].refcount != 1)
+            continue;
+
+        if(mBuffers[i].size() == pSize && mBuffers[i].type() == pType)
+            return mBuffers[i];
+        if(lFree < 0)
+            lFree = i;
+    }
+
+    // Buffers of another format are not useful anymore
+    if(lFree >= 0)
+    {
+        mBuffers[lFree].create(pSize, pType);
+        return mBuffers[lFree];
+    }
+
+    if(mBuffers.size() >= mCapacity)
+        return Mat(pSize, pType);
+
+    mBuffers.push_back(Mat(pSize, pType));
+    return mBuffers.back();
+}
+
+/*******************************************/
+void framePool::clear()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    mBuffers.clear();
+}
+
+/*******************************************/
+void framePool::trim()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+
+    vector<Mat> lBuffers;
+    for(unsigned int i=0; i<mBuffers.size(); i++)
+    {
+        if(mBuffers[i].refcount != NULL && *mBuffers[i].refcount != 1)
+            lBuffers.push_back(mBuffers[i]);
+    }
+    mBuffers.swap(lBuffers);
+}
+
+/*******************************************/
+void framePool::setCapacity(unsigned int pCapacity)
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    mCapacity = max(pCapacity, 1u);
+
+    // Buffers above the capacity are dropped by the pool, the ones in use
+    // being freed by their last holder
+    if(mBuffers.size() > mCapacity)
+        mBuffers.resize(mCapacity);
+}
+
+/*******************************************/
+unsigned int framePool::getSize()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    return mBuffers.size();
+}
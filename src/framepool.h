@@ -0,0 +1,46 @@
+// Pool of image buffers, reused once nobody holds them anymore.
+// Buffers are handed out as Mat, which are reference counted: a buffer
+// is free again when the Mat returned by getBuffer, and all its copies,
+// are released. Consumers share the frames, they must not write in them.
+// The pool keeps at most its capacity of buffers, further ones being
+// allocated normally and freed when released.
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <boost/thread/mutex.hpp>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+class framePool
+{
+public:
+    framePool();
+    ~framePool();
+
+    // Returns a buffer of the given size and type, reusing a free one if possible
+    Mat getBuffer(Size pSize, int pType);
+
+    // Releases all the buffers (they stay valid for those still holding them)
+    void clear();
+    // Releases the free buffers, after a change of format
+    void trim();
+
+    // Maximum number of buffers kept by the pool
+    void setCapacity(unsigned int pCapacity);
+
+    // Number of buffers allocated by the pool
+    unsigned int getSize();
+
+private:
+    boost::mutex mMutex;
+    vector<Mat> mBuffers;
+    unsigned int mCapacity;
+};
+}
+
+#endif // FRAMEPOOL_H
@@ -0,0 +1,179 @@
+#include "framering.h"
+
+using namespace paper;
+
+/*******************************************/
+frameRing::frameRing()
+{
+    mCount = 0;
+}
+
+/*******************************************/
+frameRing::~frameRing()
+{
+}
+
+/*******************************************/
+void frameRing::init(unsigned int pSize, Size pFrameSize, int pType)
+{
+    pSize = max(pSize, 1u);
+
+    mSlots.resize(pSize);
+    for(unsigned int i=0; i<pSize; i++)
+    {
+        mSlots[i].counter = 0;
+        mSlots[i].buffer = -1;
+    }
+
+    // One buffer per slot, plus some for the producer and the consumers
+    mBuffers.resize(2*pSize+2);
+    for(unsigned int i=0; i<mBuffers.size(); i++)
+        mBuffers[i] = Mat(pFrameSize, pType);
+    mPublished.assign(mBuffers.size(), false);
+
+    mCount = 0;
+}
+
+/*******************************************/
+Mat frameRing::getWriteBuffer(int& pIndex)
+{
+    for(unsigned int i=0; i<mBuffers.size(); i++)
+    {
+        // A buffer referenced by no slot and held by nobody else
+        // can't be acquired by a consumer anymore
+        if(!mPublished[i] && *mBuffers[i].refcount == 1)
+        {
+            pIndex = i;
+            return mBuffers[i];
+        }
+    }
+
+    pIndex = -1;
+    return Mat();
+}
+
+/*******************************************/
+void frameRing::publish(int pIndex, const frameInfo& pInfo)
+{
+    if(pIndex < 0 || mSlots.size() == 0)
+        return;
+
+    slot& lSlot = mSlots[mCount % mSlots.size()];
+
+    lSlot.counter++;
+    __sync_synchronize();
+
+    if(lSlot.buffer >= 0)
+        mPublished[lSlot.buffer] = false;
+    lSlot.buffer = pIndex;
+    lSlot.info = pInfo;
+    mPublished[pIndex] = true;
+
+    __sync_synchronize();
+    lSlot.counter++;
+
+    __sync_synchronize();
+    mCount++;
+
+    boost::mutex::scoped_lock lLock(mWaitMutex);
+    mWaitCondition.notify_all();
+}
+
+/*******************************************/
+bool frameRing::getLatest(capturedFrame& pFrame)
+{
+    unsigned long long lCount = mCount;
+    __sync_synchronize();
+
+    if(lCount == 0)
+        return false;
+
+    return readSlot((lCount-1) % mSlots.size(), pFrame);
+}
+
+/*******************************************/
+bool frameRing::getFirst(capturedFrame& pFrame, unsigned long long pSequence, unsigned int pSettings)
+{
+    unsigned long long lCount = mCount;
+    __sync_synchronize();
+
+    // From the oldest frame to the newest
+    unsigned long long lStart = lCount > mSlots.size() ? lCount-mSlots.size() : 0;
+    for(unsigned long long i=lStart; i<lCount; i++)
+    {
+        capturedFrame lFrame;
+        if(!readSlot(i % mSlots.size(), lFrame))
+            continue;
+
+        if(lFrame.info.sequence >= pSequence && lFrame.info.settings >= pSettings)
+        {
+            pFrame = lFrame;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*******************************************/
+bool frameRing::waitFirst(capturedFrame& pFrame, unsigned long long pSequence, unsigned int pSettings, double pTimeout)
+{
+    boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::microseconds((long)(pTimeout*1e6));
+
+    boost::mutex::scoped_lock lLock(mWaitMutex);
+    while(!getFirst(pFrame, pSequence, pSettings))
+    {
+        if(!mWaitCondition.timed_wait(lLock, lDeadline))
+            return getFirst(pFrame, pSequence, pSettings);
+    }
+
+    return true;
+}
+
+/*******************************************/
+bool frameRing::waitLatest(capturedFrame& pFrame, unsigned long long pSequence, double pTimeout)
+{
+    boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::microseconds((long)(pTimeout*1e6));
+
+    boost::mutex::scoped_lock lLock(mWaitMutex);
+    while(!getLatest(pFrame) || pFrame.info.sequence < pSequence)
+    {
+        if(!mWaitCondition.timed_wait(lLock, lDeadline))
+            return getLatest(pFrame) && pFrame.info.sequence >= pSequence;
+    }
+
+    return true;
+}
+
+/*******************************************/
+unsigned long long frameRing::getCount()
+{
+    return mCount;
+}
+
+/*******************************************/
+bool frameRing::readSlot(unsigned int pIndex, capturedFrame& pFrame)
+{
+    slot& lSlot = mSlots[pIndex];
+
+    unsigned int lCounter = lSlot.counter;
+    __sync_synchronize();
+    if(lCounter & 1)
+        return false;
+
+    int lBuffer = lSlot.buffer;
+    frameInfo lInfo = lSlot.info;
+    if(lBuffer < 0)
+        return false;
+
+    // Taking a reference prevents the producer from reusing the buffer.
+    // If the slot changed meanwhile, we drop it.
+    Mat lImage = mBuffers[lBuffer];
+    __sync_synchronize();
+    if(lSlot.counter != lCounter)
+        return false;
+
+    pFrame.image = lImage;
+    pFrame.info = lInfo;
+    return true;
+}
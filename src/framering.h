@@ -0,0 +1,92 @@
+// Ring of the last captured frames, written by a single capture thread
+// and read by any number of consumers without locking.
+// Each slot is protected by a sequence counter (odd while it is written):
+// readers copy the slot and check that the counter has not changed.
+// Frames are stored in buffers allocated once, which are only written by
+// the producer when nobody holds them anymore.
+
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <boost/thread.hpp>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+struct frameInfo
+{
+    unsigned long long sequence; // index of the frame since the capture started
+    double timestamp; // capture time, in seconds, from a monotonic clock
+    unsigned int settings; // identifier of the exposure settings in effect
+    float aperture;
+    float shutter;
+    float gain;
+    float EV;
+};
+
+struct capturedFrame
+{
+    Mat image; // shared, must not be modified
+    frameInfo info;
+};
+
+class frameRing
+{
+public:
+    frameRing();
+    ~frameRing();
+
+    // Allocates the slots and the buffers, for frames of the given size and type
+    // Must not be called while the ring is in use
+    void init(unsigned int pSize, Size pFrameSize, int pType);
+
+    // Producer side, from a single thread
+    // Returns a buffer to write the next frame in, or an empty Mat if the
+    // consumers are holding all of them
+    Mat getWriteBuffer(int& pIndex);
+    void publish(int pIndex, const frameInfo& pInfo);
+
+    // Consumer side
+    // Returns the last frame published
+    bool getLatest(capturedFrame& pFrame);
+    // Returns the first frame still in the ring with a sequence number and
+    // settings identifier at least equal to the given ones
+    bool getFirst(capturedFrame& pFrame, unsigned long long pSequence, unsigned int pSettings);
+    // Same, waiting for it up to pTimeout seconds
+    bool waitFirst(capturedFrame& pFrame, unsigned long long pSequence, unsigned int pSettings, double pTimeout);
+    // Returns the last frame published, once its sequence number is at least
+    // pSequence, waiting for it up to pTimeout seconds
+    bool waitLatest(capturedFrame& pFrame, unsigned long long pSequence, double pTimeout);
+
+    // Number of frames published
+    unsigned long long getCount();
+
+private:
+    struct slot
+    {
+        volatile unsigned int counter; // odd while being written
+        int buffer; // index in mBuffers, -1 if empty
+        frameInfo info;
+    };
+
+    /*****************/
+    // Attributes
+    vector<slot> mSlots;
+    vector<Mat> mBuffers; // headers are never modified after init
+    vector<bool> mPublished; // producer side only, buffers referenced by a slot
+    volatile unsigned long long mCount;
+
+    // Only used to wake up waiting consumers
+    boost::mutex mWaitMutex;
+    boost::condition_variable mWaitCondition;
+
+    /****************/
+    // Methods
+    bool readSlot(unsigned int pIndex, capturedFrame& pFrame);
+};
+}
+
+#endif // FRAMERING_H
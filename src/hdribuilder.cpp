@@ -1,10 +1,18 @@
 #include "hdribuilder.h"
 
+#include <boost/bind.hpp>
+
+#include "metrics.h"
+#include "pooledallocator.h"
+#include "scheduler.h"
+
 using namespace paper;
 
 /*******************************************/
 hdriBuilder::hdriBuilder()
 {
+    // The HDRI keeps its buffer from one bracket to the next
+    mHDRi = pooledMat();
     mMinSum = 0.1f;
     mMinExposureIndex = 0;
     mMaxExposureIndex = 0;
@@ -58,6 +66,12 @@ bool hdriBuilder::addLDR(const Mat *pImage, float pEV)
     }
 }
 
+/*******************************************/
+void hdriBuilder::clearLDRi()
+{
+    mLDRi.clear();
+}
+
 /*******************************************/
 Mat hdriBuilder::getHDRI()
 {
@@ -71,16 +85,27 @@ bool hdriBuilder::computeHDRI()
     if(mLDRi.size() == 0)
         return false;
 
+    scopedTimer lTimer(eMetricMerge, mLDRi.size()*mLDRi[0].image.total()*mLDRi[0].image.elemSize());
+
     // HDRi the same size as LDRi, but RGB32f
     mHDRi.create(mLDRi[0].image.rows, mLDRi[0].image.cols, CV_32FC3);
 
     // Ordering images
     orderLDRi();
 
-    // Calculation of each HDR pixel
-    for(unsigned int x=0; x<(unsigned int)mHDRi.cols; x++)
+    // Calculation of each HDR pixel, on blocks of rows in parallel
+    scheduler::parallelFor(Range(0, mHDRi.rows), boost::bind(&hdriBuilder::mergeRows, this, _1));
+
+    mLDRi.clear();
+    return true;
+}
+
+/*******************************************/
+void hdriBuilder::mergeRows(const Range& pRows)
+{
+    for(int y=pRows.start; y<pRows.end; y++)
     {
-        for(unsigned int y=0; y<(unsigned int)mHDRi.rows; y++)
+        for(unsigned int x=0; x<(unsigned int)mHDRi.cols; x++)
         {
             float lHDRPixel[3], lSum[3];
             lHDRPixel[0] = 0.f;
@@ -146,9 +171,6 @@ bool hdriBuilder::computeHDRI()
             mHDRi.at<Vec3f>(y, x)[2] = lHDRPixel[2];
         }
     }
-
-    mLDRi.clear();
-    return true;
 }
 
 /*******************************************/
@@ -23,6 +23,8 @@ public:
     // Adds an LDR image to the list
     // LDRi must be of type RGB8u
     bool addLDR(const Mat* pImage, float pEV);
+    // Drops the LDR images added so far, for an interrupted bracket
+    void clearLDRi();
 
     // Retrieves the HDRI
     // To call after the HDRI generation
@@ -50,6 +52,9 @@ private:
 
     /****************/
     // Methods
+    // Merges the rows of the LDRi into mHDRi
+    void mergeRows(const Range& pRows);
+
     // Returns the coefficient to apply to a 8u value
     // according to a gaussian curve centered on 127
     float getGaussian(unsigned char pValue);
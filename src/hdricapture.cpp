@@ -0,0 +1,649 @@
+#include "hdricapture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <opencv2/opencv.hpp>
+
+#include "camera.h"
+#include "chromedsphere.h"
+#include "hdribuilder.h"
+#include "rgbe.h"
+#include "scheduler.h"
+
+using namespace cv;
+using namespace paper;
+
+struct hdrc_camera
+{
+    camera cam;
+    unsigned long long nextFrame; // sequence of the next frame to return
+};
+
+struct hdrc_sphere
+{
+    chromedSphere sphere;
+    Mat image; // caller's image, referenced
+    bool detected;
+};
+
+struct hdrc_builder
+{
+    hdriBuilder builder;
+    Mat hdri;
+};
+
+namespace
+{
+/*******************************************/
+int getType(hdrc_format pFormat)
+{
+    switch(pFormat)
+    {
+    case HDRC_BGR8:
+    case HDRC_RGB8:
+        return CV_8UC3;
+    case HDRC_GRAY8:
+        return CV_8UC1;
+    case HDRC_RGB32F:
+        return CV_32FC3;
+    default:
+        return -1;
+    }
+}
+
+/*******************************************/
+// Wraps the caller's image in a Mat header, without copy
+bool wrapImage(const hdrc_image* pImage, Mat& pMat)
+{
+    if(pImage == NULL || pImage->data == NULL || pImage->width <= 0 || pImage->height <= 0)
+        return false;
+
+    int lType = getType(pImage->format);
+    if(lType < 0)
+        return false;
+
+    size_t lRowSize = (size_t)pImage->width*CV_ELEM_SIZE(lType);
+    size_t lStride = pImage->stride != 0 ? pImage->stride : lRowSize;
+    if(lStride < lRowSize)
+        return false;
+
+    pMat = Mat(pImage->height, pImage->width, lType, pImage->data, lStride);
+    return true;
+}
+
+/*******************************************/
+// Writes pSource (BGR if 8 bits) into the caller's image, which must match it
+bool writeImage(const Mat& pSource, hdrc_image* pImage)
+{
+    Mat lOutput;
+    if(!wrapImage(pImage, lOutput) || lOutput.size() != pSource.size() || lOutput.type() != pSource.type())
+        return false;
+
+    if(pImage->format == HDRC_RGB8)
+        cvtColor(pSource, lOutput, CV_BGR2RGB);
+    else
+        pSource.copyTo(lOutput);
+
+    // The caller's buffer must not have been replaced
+    return lOutput.data == pImage->data;
+}
+
+/*******************************************/
+void fillInfo(const frameInfo& pInfo, hdrc_frame_info* pOutput)
+{
+    if(pOutput == NULL)
+        return;
+
+    pOutput->sequence = pInfo.sequence;
+    pOutput->timestamp = pInfo.timestamp;
+    pOutput->aperture = pInfo.aperture;
+    pOutput->shutter = pInfo.shutter;
+    pOutput->gain = pInfo.gain;
+    pOutput->ev = pInfo.EV;
+}
+
+/*******************************************/
+bool writeRGBE(FILE* pFile, const Mat& pHDRi)
+{
+    if(RGBE_WriteHeader(pFile, pHDRi.cols, pHDRi.rows, NULL) != RGBE_RETURN_SUCCESS)
+        return false;
+
+    // Row by row, as the caller's image may not be continuous
+    for(int y=0; y<pHDRi.rows; y++)
+    {
+        if(RGBE_WritePixels(pFile, (float*)pHDRi.ptr(y), pHDRi.cols) != RGBE_RETURN_SUCCESS)
+            return false;
+    }
+
+    return true;
+}
+}
+
+/*******************************************/
+int hdrc_get_version(void)
+{
+    return HDRC_API_VERSION;
+}
+
+/*******************************************/
+int hdrc_scheduler_configure(unsigned int pThreads, int pAffinity, int pNuma)
+{
+    schedulerSettings lSettings;
+    lSettings.threads = pThreads;
+    lSettings.affinity = pAffinity != 0;
+    lSettings.numa = pNuma != 0;
+
+    try
+    {
+        scheduler::configure(lSettings);
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_scheduler_stop(void)
+{
+    try
+    {
+        scheduler::stop();
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+hdrc_camera* hdrc_camera_open(const char* pReplay)
+{
+    // The replay description is read through FileStorage, which throws on
+    // malformed files
+    hdrc_camera* lCamera = NULL;
+    bool lResult;
+    try
+    {
+        lCamera = new hdrc_camera;
+        lCamera->nextFrame = 0;
+
+        if(pReplay != NULL)
+            lResult = lCamera->cam.setReplaySource(pReplay) && lCamera->cam.open(replay);
+        else
+            lResult = lCamera->cam.open(sony);
+    }
+    catch(...)
+    {
+        lResult = false;
+    }
+
+    if(!lResult)
+    {
+        delete lCamera;
+        return NULL;
+    }
+
+    return lCamera;
+}
+
+/*******************************************/
+void hdrc_camera_close(hdrc_camera* pCamera)
+{
+    if(pCamera == NULL)
+        return;
+
+    pCamera->cam.close();
+    delete pCamera;
+}
+
+/*******************************************/
+int hdrc_camera_set_shutter(hdrc_camera* pCamera, float pShutter)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+    return pCamera->cam.setShutter(pShutter) ? HDRC_OK : HDRC_ERROR;
+}
+
+/*******************************************/
+int hdrc_camera_set_gain(hdrc_camera* pCamera, float pGain)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+    return pCamera->cam.setGain(pGain) ? HDRC_OK : HDRC_ERROR;
+}
+
+/*******************************************/
+int hdrc_camera_set_aperture(hdrc_camera* pCamera, float pAperture)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+    return pCamera->cam.setAperture(pAperture) ? HDRC_OK : HDRC_ERROR;
+}
+
+/*******************************************/
+int hdrc_camera_set_frame_rate(hdrc_camera* pCamera, float pRate)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+    return pCamera->cam.setFrameRate(pRate) ? HDRC_OK : HDRC_ERROR;
+}
+
+/*******************************************/
+int hdrc_camera_set_calibration(hdrc_camera* pCamera, const char* pFile)
+{
+    if(pCamera == NULL || pFile == NULL)
+        return HDRC_INVALID;
+
+    try
+    {
+        return pCamera->cam.setCalibration(pFile) ? HDRC_OK : HDRC_ERROR;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+}
+
+/*******************************************/
+int hdrc_camera_set_icc_profiles(hdrc_camera* pCamera, const char* pIn, const char* pOut)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+
+    try
+    {
+        // Disabling the correction also returns false
+        if(pIn == NULL)
+        {
+            pCamera->cam.setICCProfiles(NULL);
+            return HDRC_OK;
+        }
+
+        return pCamera->cam.setICCProfiles(pIn, pOut != NULL ? pOut : "sRGB") ? HDRC_OK : HDRC_ERROR;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+}
+
+/*******************************************/
+int hdrc_camera_set_raw_mode(hdrc_camera* pCamera, int pRaw)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+    try
+    {
+        return pCamera->cam.setRawMode(pRaw != 0) ? HDRC_OK : HDRC_ERROR;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+}
+
+/*******************************************/
+float hdrc_camera_get_shutter(hdrc_camera* pCamera)
+{
+    return pCamera != NULL ? pCamera->cam.getShutter() : 0.f;
+}
+
+/*******************************************/
+float hdrc_camera_get_ev(hdrc_camera* pCamera)
+{
+    return pCamera != NULL ? pCamera->cam.getEV() : 0.f;
+}
+
+/*******************************************/
+float hdrc_camera_get_fov(hdrc_camera* pCamera)
+{
+    return pCamera != NULL ? pCamera->cam.getFOV() : 0.f;
+}
+
+/*******************************************/
+int hdrc_camera_start(hdrc_camera* pCamera, unsigned int pRingSize)
+{
+    if(pCamera == NULL || pRingSize == 0)
+        return HDRC_INVALID;
+
+    pCamera->nextFrame = 0;
+    try
+    {
+        return pCamera->cam.startCapture(pRingSize) ? HDRC_OK : HDRC_ERROR;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+}
+
+/*******************************************/
+int hdrc_camera_stop(hdrc_camera* pCamera)
+{
+    if(pCamera == NULL)
+        return HDRC_INVALID;
+
+    try
+    {
+        pCamera->cam.stopCapture();
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_camera_wait_frame(hdrc_camera* pCamera, double pTimeout, hdrc_frame_callback pCallback, void* pUser)
+{
+    if(pCamera == NULL || pCallback == NULL)
+        return HDRC_INVALID;
+
+    // The callback may be C++ code, its exceptions are stopped here too
+    try
+    {
+        capturedFrame lFrame;
+        if(!pCamera->cam.waitFrame(lFrame, 0, pCamera->nextFrame, pTimeout))
+            return HDRC_TIMEOUT;
+        pCamera->nextFrame = lFrame.info.sequence+1;
+
+        // The callback sees the buffer of the ring, held by lFrame meanwhile
+        hdrc_image lImage;
+        lImage.data = lFrame.image.data;
+        lImage.width = lFrame.image.cols;
+        lImage.height = lFrame.image.rows;
+        lImage.stride = lFrame.image.step;
+        lImage.format = lFrame.image.type() == CV_8UC1 ? HDRC_GRAY8 : HDRC_BGR8;
+
+        hdrc_frame_info lInfo;
+        fillInfo(lFrame.info, &lInfo);
+
+        pCallback(&lImage, &lInfo, pUser);
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_camera_read_frame(hdrc_camera* pCamera, double pTimeout, hdrc_image* pImage, hdrc_frame_info* pInfo)
+{
+    if(pCamera == NULL || pImage == NULL || (pImage->format != HDRC_BGR8 && pImage->format != HDRC_RGB8))
+        return HDRC_INVALID;
+
+    capturedFrame lFrame;
+    try
+    {
+        if(!pCamera->cam.waitFrame(lFrame, 0, pCamera->nextFrame, pTimeout))
+            return HDRC_TIMEOUT;
+        pCamera->nextFrame = lFrame.info.sequence+1;
+
+        Mat lImage;
+        pCamera->cam.developFrame(lFrame.image, lImage);
+        if(!writeImage(lImage, pImage))
+            return HDRC_INVALID;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    fillInfo(lFrame.info, pInfo);
+    return HDRC_OK;
+}
+
+/*******************************************/
+hdrc_sphere* hdrc_sphere_create(void)
+{
+    hdrc_sphere* lSphere = new (std::nothrow) hdrc_sphere;
+    if(lSphere != NULL)
+        lSphere->detected = false;
+    return lSphere;
+}
+
+/*******************************************/
+void hdrc_sphere_destroy(hdrc_sphere* pSphere)
+{
+    delete pSphere;
+}
+
+/*******************************************/
+int hdrc_sphere_set_projection(hdrc_sphere* pSphere, hdrc_projection pProjection)
+{
+    if(pSphere == NULL)
+        return HDRC_INVALID;
+
+    switch(pProjection)
+    {
+    case HDRC_EQUIRECTANGULAR:
+        pSphere->sphere.setProjection(eEquirectangular);
+        break;
+    case HDRC_CUBEMAP:
+        pSphere->sphere.setProjection(eCubemap);
+        break;
+    case HDRC_OCTAHEDRAL:
+        pSphere->sphere.setProjection(eOctahedral);
+        break;
+    case HDRC_ANGULAR:
+        pSphere->sphere.setProjection(eAngular);
+        break;
+    default:
+        return HDRC_INVALID;
+    }
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_sphere_set_size(hdrc_sphere* pSphere, float pDiameter)
+{
+    if(pSphere == NULL || pDiameter <= 0.f)
+        return HDRC_INVALID;
+
+    pSphere->sphere.setSphereSize(pDiameter);
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_sphere_set_reflectance(hdrc_sphere* pSphere, float pReflectance)
+{
+    if(pSphere == NULL || pReflectance <= 0.f)
+        return HDRC_INVALID;
+
+    pSphere->sphere.setSphereReflectance(pReflectance);
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_sphere_set_probe(hdrc_sphere* pSphere, const hdrc_image* pImage, float pFOV, int pFixed)
+{
+    Mat lImage;
+    if(pSphere == NULL || !wrapImage(pImage, lImage) || pImage->format != HDRC_BGR8)
+        return HDRC_INVALID;
+
+    try
+    {
+        pSphere->image = lImage;
+        if(pFixed != 0 && pSphere->detected)
+            pSphere->sphere.setProbe(pSphere->image, true);
+        else
+            pSphere->detected = pSphere->sphere.setProbe(pSphere->image, pFOV);
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    return pSphere->detected ? HDRC_OK : HDRC_ERROR;
+}
+
+/*******************************************/
+int hdrc_sphere_convert(hdrc_sphere* pSphere, hdrc_image* pProbe)
+{
+    if(pSphere == NULL || pProbe == NULL || pProbe->format != HDRC_BGR8 || pProbe->width <= 0 || pProbe->height <= 0)
+        return HDRC_INVALID;
+    if(!pSphere->detected)
+        return HDRC_ERROR;
+
+    try
+    {
+        Mat lProbe = pSphere->sphere.getConvertedProbe(pProbe->width, pProbe->height);
+        if(!writeImage(lProbe, pProbe))
+            return HDRC_INVALID;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_sphere_get_position(hdrc_sphere* pSphere, float* pX, float* pY, float* pRadius)
+{
+    if(pSphere == NULL)
+        return HDRC_INVALID;
+    if(!pSphere->detected)
+        return HDRC_ERROR;
+
+    Vec3f lSphere = pSphere->sphere.getSphere();
+    if(pX != NULL)
+        *pX = lSphere[0];
+    if(pY != NULL)
+        *pY = lSphere[1];
+    if(pRadius != NULL)
+        *pRadius = lSphere[2];
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+hdrc_builder* hdrc_builder_create(void)
+{
+    return new (std::nothrow) hdrc_builder;
+}
+
+/*******************************************/
+void hdrc_builder_destroy(hdrc_builder* pBuilder)
+{
+    delete pBuilder;
+}
+
+/*******************************************/
+int hdrc_builder_add_ldr(hdrc_builder* pBuilder, const hdrc_image* pImage, float pEV)
+{
+    Mat lImage;
+    if(pBuilder == NULL || !wrapImage(pImage, lImage) || pImage->format != HDRC_RGB8)
+        return HDRC_INVALID;
+
+    try
+    {
+        return pBuilder->builder.addLDR(&lImage, pEV) ? HDRC_OK : HDRC_INVALID;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+}
+
+/*******************************************/
+int hdrc_builder_compute(hdrc_builder* pBuilder, int* pWidth, int* pHeight)
+{
+    if(pBuilder == NULL)
+        return HDRC_INVALID;
+
+    try
+    {
+        if(!pBuilder->builder.computeHDRI())
+            return HDRC_ERROR;
+        pBuilder->hdri = pBuilder->builder.getHDRI();
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+
+    if(pWidth != NULL)
+        *pWidth = pBuilder->hdri.cols;
+    if(pHeight != NULL)
+        *pHeight = pBuilder->hdri.rows;
+
+    return HDRC_OK;
+}
+
+/*******************************************/
+int hdrc_builder_get_hdri(hdrc_builder* pBuilder, hdrc_image* pHDRi)
+{
+    if(pBuilder == NULL || pHDRi == NULL || pHDRi->format != HDRC_RGB32F)
+        return HDRC_INVALID;
+    if(pBuilder->hdri.rows == 0)
+        return HDRC_ERROR;
+
+    try
+    {
+        return writeImage(pBuilder->hdri, pHDRi) ? HDRC_OK : HDRC_INVALID;
+    }
+    catch(...)
+    {
+        return HDRC_ERROR;
+    }
+}
+
+/*******************************************/
+int hdrc_write_rgbe(const char* pFile, const hdrc_image* pHDRi)
+{
+    Mat lHDRi;
+    if(pFile == NULL || !wrapImage(pHDRi, lHDRi) || pHDRi->format != HDRC_RGB32F)
+        return HDRC_INVALID;
+
+    FILE* lFile = fopen(pFile, "wb");
+    if(lFile == NULL)
+        return HDRC_ERROR;
+
+    bool lResult = writeRGBE(lFile, lHDRi);
+    lResult &= fclose(lFile) == 0;
+
+    return lResult ? HDRC_OK : HDRC_ERROR;
+}
+
+/*******************************************/
+int hdrc_encode_rgbe(const hdrc_image* pHDRi, hdrc_write_callback pCallback, void* pUser)
+{
+    Mat lHDRi;
+    if(pCallback == NULL || !wrapImage(pHDRi, lHDRi) || pHDRi->format != HDRC_RGB32F)
+        return HDRC_INVALID;
+
+    // Encoded in memory, then given to the caller at once
+    char* lBuffer = NULL;
+    size_t lSize = 0;
+    FILE* lFile = open_memstream(&lBuffer, &lSize);
+    if(lFile == NULL)
+        return HDRC_ERROR;
+
+    bool lResult = writeRGBE(lFile, lHDRi);
+    lResult &= fclose(lFile) == 0;
+    try
+    {
+        if(lResult)
+            lResult = pCallback(lBuffer, lSize, pUser) == 0;
+    }
+    catch(...)
+    {
+        lResult = false;
+    }
+
+    free(lBuffer);
+    return lResult ? HDRC_OK : HDRC_ERROR;
+}
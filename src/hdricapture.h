@@ -0,0 +1,153 @@
+/* C API of libhdricapture, to capture light probes and build HDRIs from
+ * another process without going through the hdricapture binary and files.
+ *
+ * Images are described by hdrc_image and always belong to the caller:
+ *  - input images are used in place, without copy. When an input is kept
+ *    across calls (hdrc_sphere_set_probe, hdrc_builder_add_ldr), it has to
+ *    stay valid as documented for the function
+ *  - outputs are written into the caller's image, which must have the
+ *    expected size and format
+ * Handles stay valid until they are closed or destroyed. A handle must
+ * not be used from several threads at the same time.
+ * Functions returning an int return HDRC_OK or a negative error code, those
+ * returning a handle NULL on failure. */
+
+#ifndef HDRICAPTURE_H
+#define HDRICAPTURE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HDRC_API_VERSION 1
+
+/* Status codes */
+#define HDRC_OK 0
+#define HDRC_ERROR -1 /* the operation failed */
+#define HDRC_INVALID -2 /* invalid handle, image or parameter */
+#define HDRC_TIMEOUT -3
+
+typedef enum
+{
+    HDRC_BGR8 = 0,
+    HDRC_RGB8 = 1,
+    HDRC_GRAY8 = 2, /* raw Bayer frames */
+    HDRC_RGB32F = 3
+} hdrc_format;
+
+typedef enum
+{
+    HDRC_EQUIRECTANGULAR = 0,
+    HDRC_CUBEMAP = 1,
+    HDRC_OCTAHEDRAL = 2,
+    HDRC_ANGULAR = 3
+} hdrc_projection;
+
+typedef struct
+{
+    void* data;
+    int width;
+    int height;
+    size_t stride; /* bytes between the start of two rows, 0 if rows are packed */
+    hdrc_format format;
+} hdrc_image;
+
+typedef struct
+{
+    unsigned long long sequence; /* index of the frame since the capture started */
+    double timestamp; /* in seconds, from a monotonic clock */
+    float aperture;
+    float shutter; /* 1/t */
+    float gain; /* in dB */
+    float ev;
+} hdrc_frame_info;
+
+typedef struct hdrc_camera hdrc_camera;
+typedef struct hdrc_sphere hdrc_sphere;
+typedef struct hdrc_builder hdrc_builder;
+
+/* Called with a captured frame, which is only valid during the call */
+typedef void (*hdrc_frame_callback)(const hdrc_image* frame, const hdrc_frame_info* info, void* user);
+/* Called with successive parts of an encoded file. Returns 0 on success */
+typedef int (*hdrc_write_callback)(const void* data, size_t size, void* user);
+
+/* Returns HDRC_API_VERSION of the library */
+int hdrc_get_version(void);
+
+/* Threads of the processing. Until configured, the processing runs in the
+ * calling threads, and OpenCV's thread count is left as it is.
+ * Starts workers for a budget of threads (0 for one per CPU), the calling
+ * thread included, pinned to a CPU if affinity is not 0, and spread over the
+ * NUMA nodes if numa is not 0. OpenCV's own functions then run in the calling
+ * thread, so that both stay within the budget.
+ * These must not be called while another function of the library runs */
+int hdrc_scheduler_configure(unsigned int threads, int affinity, int numa);
+/* Stops the workers and restores OpenCV's thread count */
+int hdrc_scheduler_stop(void);
+
+/* Camera
+ * replay is a replay description (see camera::setReplaySource), or NULL for the camera */
+hdrc_camera* hdrc_camera_open(const char* replay);
+void hdrc_camera_close(hdrc_camera* camera);
+
+int hdrc_camera_set_shutter(hdrc_camera* camera, float shutter); /* 1/t */
+int hdrc_camera_set_gain(hdrc_camera* camera, float gain); /* in dB */
+int hdrc_camera_set_aperture(hdrc_camera* camera, float aperture);
+int hdrc_camera_set_frame_rate(hdrc_camera* camera, float rate);
+int hdrc_camera_set_calibration(hdrc_camera* camera, const char* file);
+int hdrc_camera_set_icc_profiles(hdrc_camera* camera, const char* in, const char* out); /* NULL in to disable */
+int hdrc_camera_set_raw_mode(hdrc_camera* camera, int raw);
+float hdrc_camera_get_shutter(hdrc_camera* camera);
+float hdrc_camera_get_ev(hdrc_camera* camera);
+float hdrc_camera_get_fov(hdrc_camera* camera); /* in degrees */
+
+/* Starts and stops the capture thread, with ring_size frames kept */
+int hdrc_camera_start(hdrc_camera* camera, unsigned int ring_size);
+int hdrc_camera_stop(hdrc_camera* camera);
+
+/* Waits up to timeout seconds for the next frame, and calls the callback with
+ * it, without copy. BGR8, or GRAY8 in raw mode */
+int hdrc_camera_wait_frame(hdrc_camera* camera, double timeout, hdrc_frame_callback callback, void* user);
+/* Same, the frame being copied (and developed in raw mode) into the caller's
+ * BGR8 or RGB8 image, of the size of the frames. info can be NULL */
+int hdrc_camera_read_frame(hdrc_camera* camera, double timeout, hdrc_image* image, hdrc_frame_info* info);
+
+/* Chromed sphere */
+hdrc_sphere* hdrc_sphere_create(void);
+void hdrc_sphere_destroy(hdrc_sphere* sphere);
+
+int hdrc_sphere_set_projection(hdrc_sphere* sphere, hdrc_projection projection);
+int hdrc_sphere_set_size(hdrc_sphere* sphere, float diameter); /* in mm */
+int hdrc_sphere_set_reflectance(hdrc_sphere* sphere, float reflectance);
+
+/* Sets the BGR8 image of the sphere, taken with the given FOV (in degrees).
+ * The sphere is detected, unless fixed is not 0 and it was detected before.
+ * The image is referenced until the next call, or the destruction of the sphere */
+int hdrc_sphere_set_probe(hdrc_sphere* sphere, const hdrc_image* image, float fov, int fixed);
+/* Unwraps the probe into the caller's BGR8 image, of any size */
+int hdrc_sphere_convert(hdrc_sphere* sphere, hdrc_image* probe);
+/* Position and radius of the sphere in the image, in pixels */
+int hdrc_sphere_get_position(hdrc_sphere* sphere, float* x, float* y, float* radius);
+
+/* HDRI builder */
+hdrc_builder* hdrc_builder_create(void);
+void hdrc_builder_destroy(hdrc_builder* builder);
+
+/* Adds an RGB8 image of the bracket. Images are referenced until hdrc_builder_compute */
+int hdrc_builder_add_ldr(hdrc_builder* builder, const hdrc_image* image, float ev);
+/* Merges the images added so far. width and height (can be NULL) receive the size of the HDRI */
+int hdrc_builder_compute(hdrc_builder* builder, int* width, int* height);
+/* Copies the last HDRI into the caller's RGB32F image */
+int hdrc_builder_get_hdri(hdrc_builder* builder, hdrc_image* hdri);
+
+/* Radiance RGBE encoding of an RGB32F image, to a file or through a callback */
+int hdrc_write_rgbe(const char* file, const hdrc_image* hdri);
+int hdrc_encode_rgbe(const hdrc_image* hdri, hdrc_write_callback callback, void* user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HDRICAPTURE_H */
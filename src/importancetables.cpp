@@ -0,0 +1,212 @@
+#include "importancetables.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+using namespace paper;
+
+/*******************************************/
+// Computes the weights and the conditional CDF of each row
+class conditionalBuilder : public ParallelLoopBody
+{
+public:
+    conditionalBuilder(const Mat& pHDRI, float* pWeights, float* pConditional, double* pRowSums)
+        : mHDRI(pHDRI), mWeights(pWeights), mConditional(pConditional), mRowSums(pRowSums) {}
+
+    void operator()(const Range& pRange) const
+    {
+        int lWidth = mHDRI.cols;
+
+        for(int y=pRange.start; y<pRange.end; y++)
+        {
+            float lSinTheta = sinf(((float)y+0.5f)*M_PI/(float)mHDRI.rows);
+            const float* lPixels = mHDRI.ptr<float>(y);
+            float* lWeights = mWeights + y*lWidth;
+            float* lCdf = mConditional + y*(lWidth+1);
+
+            double lSum = 0.0;
+            lCdf[0] = 0.f;
+            for(int x=0; x<lWidth; x++)
+            {
+                float lLuminance = 0.2126f*lPixels[3*x] + 0.7152f*lPixels[3*x+1] + 0.0722f*lPixels[3*x+2];
+                lWeights[x] = max(lLuminance, 0.f)*lSinTheta;
+                lSum += lWeights[x];
+                lCdf[x+1] = (float)lSum;
+            }
+
+            // Normalization, or uniform distribution for black rows
+            for(int x=1; x<=lWidth; x++)
+            {
+                if(lSum > 0.0)
+                    lCdf[x] = (float)(lCdf[x]/lSum);
+                else
+                    lCdf[x] = (float)x/(float)lWidth;
+            }
+            lCdf[lWidth] = 1.f;
+
+            mRowSums[y] = lSum;
+        }
+    }
+
+private:
+    const Mat& mHDRI;
+    float* mWeights;
+    float* mConditional;
+    double* mRowSums;
+};
+
+/*******************************************/
+importanceTables::importanceTables()
+{
+    mWidth = 0;
+    mHeight = 0;
+    mIntegral = 0.f;
+}
+
+/*******************************************/
+importanceTables::~importanceTables()
+{
+}
+
+/*******************************************/
+bool importanceTables::compute(Mat pHDRI)
+{
+    if(pHDRI.rows == 0 || pHDRI.type() != CV_32FC3)
+        return false;
+
+    mWidth = pHDRI.cols;
+    mHeight = pHDRI.rows;
+
+    vector<float> lWeights(mWidth*mHeight);
+    vector<double> lRowSums(mHeight);
+    mConditional.resize(mHeight*(mWidth+1));
+
+    conditionalBuilder lBuilder(pHDRI, &lWeights[0], &mConditional[0], &lRowSums[0]);
+    scheduler::parallelFor(Range(0, mHeight), lBuilder);
+
+    // Marginal CDF over the rows
+    double lSum = 0.0;
+    mMarginal.resize(mHeight+1);
+    mMarginal[0] = 0.f;
+    for(unsigned int y=0; y<mHeight; y++)
+    {
+        lSum += lRowSums[y];
+        mMarginal[y+1] = (float)lSum;
+    }
+    for(unsigned int y=1; y<=mHeight; y++)
+    {
+        if(lSum > 0.0)
+            mMarginal[y] = (float)(mMarginal[y]/lSum);
+        else
+            mMarginal[y] = (float)y/(float)mHeight;
+    }
+    mMarginal[mHeight] = 1.f;
+
+    // Each pixel covers (2*PI/width)*(PI/height) in longitude and latitude
+    mIntegral = (float)(lSum*2*M_PI*M_PI/(double)(mWidth*mHeight));
+
+    createAliasTable(lWeights, lSum);
+
+    return true;
+}
+
+/*******************************************/
+bool importanceTables::write(const char* pFile)
+{
+    if(mWidth == 0 || mHeight == 0)
+        return false;
+
+    FILE* lFile = fopen(pFile, "wb");
+    if(lFile == NULL)
+        return false;
+
+    // Sections are aligned on 16 bytes
+    importanceHeader lHeader;
+    memset(&lHeader, 0, sizeof(lHeader));
+    strncpy(lHeader.magic, IMPORTANCE_MAGIC, sizeof(lHeader.magic)-1);
+    lHeader.version = IMPORTANCE_VERSION;
+    lHeader.width = mWidth;
+    lHeader.height = mHeight;
+    lHeader.integral = mIntegral;
+    lHeader.marginalOffset = (sizeof(lHeader)+15) & ~(uint64_t)15;
+    lHeader.conditionalOffset = (lHeader.marginalOffset + mMarginal.size()*sizeof(float) + 15) & ~(uint64_t)15;
+    lHeader.aliasProbOffset = (lHeader.conditionalOffset + mConditional.size()*sizeof(float) + 15) & ~(uint64_t)15;
+    lHeader.aliasIndexOffset = (lHeader.aliasProbOffset + mAliasProb.size()*sizeof(float) + 15) & ~(uint64_t)15;
+
+    bool lResult = true;
+    char lPadding[16] = {0};
+    uint64_t lPosition = 0;
+
+    lResult &= fwrite(&lHeader, sizeof(lHeader), 1, lFile) == 1;
+    lPosition += sizeof(lHeader);
+
+    const void* lData[4] = {&mMarginal[0], &mConditional[0], &mAliasProb[0], &mAliasIndex[0]};
+    size_t lSizes[4] = {mMarginal.size()*sizeof(float), mConditional.size()*sizeof(float),
+                        mAliasProb.size()*sizeof(float), mAliasIndex.size()*sizeof(uint32_t)};
+    uint64_t lOffsets[4] = {lHeader.marginalOffset, lHeader.conditionalOffset,
+                            lHeader.aliasProbOffset, lHeader.aliasIndexOffset};
+
+    for(int i=0; i<4 && lResult; i++)
+    {
+        lResult &= fwrite(lPadding, 1, lOffsets[i]-lPosition, lFile) == lOffsets[i]-lPosition;
+        lResult &= fwrite(lData[i], 1, lSizes[i], lFile) == lSizes[i];
+        lPosition = lOffsets[i]+lSizes[i];
+    }
+
+    fclose(lFile);
+    return lResult;
+}
+
+/*******************************************/
+void importanceTables::createAliasTable(const vector<float>& pWeights, double pSum)
+{
+    unsigned int lNbr = pWeights.size();
+    mAliasProb.resize(lNbr);
+    mAliasIndex.resize(lNbr);
+
+    // Probabilities scaled so that their mean is 1
+    vector<double> lScaled(lNbr);
+    vector<uint32_t> lSmall, lLarge;
+    lSmall.reserve(lNbr);
+    lLarge.reserve(lNbr);
+
+    for(unsigned int i=0; i<lNbr; i++)
+    {
+        lScaled[i] = pSum > 0.0 ? (double)pWeights[i]*(double)lNbr/pSum : 1.0;
+        if(lScaled[i] < 1.0)
+            lSmall.push_back(i);
+        else
+            lLarge.push_back(i);
+    }
+
+    while(lSmall.size() != 0 && lLarge.size() != 0)
+    {
+        uint32_t lLess = lSmall.back();
+        lSmall.pop_back();
+        uint32_t lMore = lLarge.back();
+
+        mAliasProb[lLess] = (float)lScaled[lLess];
+        mAliasIndex[lLess] = lMore;
+
+        lScaled[lMore] -= 1.0-lScaled[lLess];
+        if(lScaled[lMore] < 1.0)
+        {
+            lLarge.pop_back();
+            lSmall.push_back(lMore);
+        }
+    }
+
+    // Remaining values are 1, up to rounding errors
+    for(unsigned int i=0; i<lLarge.size(); i++)
+    {
+        mAliasProb[lLarge[i]] = 1.f;
+        mAliasIndex[lLarge[i]] = lLarge[i];
+    }
+    for(unsigned int i=0; i<lSmall.size(); i++)
+    {
+        mAliasProb[lSmall[i]] = 1.f;
+        mAliasIndex[lSmall[i]] = lSmall[i];
+    }
+}
@@ -0,0 +1,72 @@
+// Builds the tables needed to importance sample an equirectangular HDRI:
+// marginal and conditional CDFs, and an alias table over all the pixels.
+// Pixels are weighted by their luminance times sin(theta), theta being
+// the angle from the up direction, to account for their solid angle.
+//
+// The tables are written in a binary file which can be memory-mapped
+// as is. All values are little endian, sections are aligned on 16 bytes:
+//   importanceHeader
+//   float    marginal CDF, height+1 values
+//   float    conditional CDFs, height rows of width+1 values
+//   float    alias probabilities, width*height values
+//   uint32_t alias indices, width*height values (index = y*width+x)
+
+#ifndef IMPORTANCETABLES_H
+#define IMPORTANCETABLES_H
+
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+#define IMPORTANCE_MAGIC "HDRIIMP"
+#define IMPORTANCE_VERSION 1
+
+struct importanceHeader
+{
+    char magic[8]; // IMPORTANCE_MAGIC, null terminated
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    float integral; // integral of the luminance over the sphere
+    uint64_t marginalOffset; // offsets of the sections, in bytes from the start of the file
+    uint64_t conditionalOffset;
+    uint64_t aliasProbOffset;
+    uint64_t aliasIndexOffset;
+};
+
+class importanceTables
+{
+public:
+    importanceTables();
+    ~importanceTables();
+
+    // Computes the tables from an equirectangular HDRI
+    // The HDRI must be of type RGB32f
+    bool compute(Mat pHDRI);
+
+    // Writes the tables to the given file
+    bool write(const char* pFile);
+
+private:
+    /*****************/
+    // Attributes
+    unsigned int mWidth, mHeight;
+    float mIntegral;
+
+    vector<float> mMarginal; // mHeight+1 values
+    vector<float> mConditional; // mHeight*(mWidth+1) values
+    vector<float> mAliasProb; // mWidth*mHeight values
+    vector<uint32_t> mAliasIndex;
+
+    /****************/
+    // Methods
+    // Builds the alias table from the pixel weights (Vose's method)
+    void createAliasTable(const vector<float>& pWeights, double pSum);
+};
+}
+
+#endif // IMPORTANCETABLES_H
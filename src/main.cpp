@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <iostream>
+#include <signal.h>
+#include <sstream>
 #include <stdio.h>
 #include <opencv2/opencv.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
 #include "rgbe.h"
@@ -8,106 +12,212 @@
 #include "hdribuilder.h"
 #include "camera.h"
 #include "chromedsphere.h"
+#include "controlserver.h"
+#include "exposureplanner.h"
+#include "importancetables.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "scenegenerator.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "sphericalharmonics.h"
+#include "trace.h"
 
 using namespace std;
 using namespace cv;
 using namespace paper;
 
-float gFOV;
-boost::mutex gMutex;
-Mat gFrame;
-bool gFrameUpdated;
-bool gStopAll;
-bool gFixSphere;
-bool gHDR, gHDR_done;
-float gEV;
+unsigned int gPanoWidth, gPanoHeight;
+projection gProjection;
+bool gSphereMerge;
+unsigned int gSHOrder; // 0 if no SH are computed
+bool gLiveSH;
+bool gImportance;
+float gDetectionRate; // sphere detections per second in view mode, 0 to detect on each frame
+volatile sig_atomic_t gTerminate; // set by SIGTERM and SIGINT in daemon mode
+
+// Seconds a daemon request waits for its frame or HDRI
+#define DAEMON_FRAME_TIMEOUT 5.0
+#define DAEMON_HDR_TIMEOUT 120.0
 
 /*************************************/
-void probe()
+// Reads the next command of the headless mode, one per line, either
+// as the key of the view mode or as a word. Returns 'q' at the end of the input
+// and -1 for an unknown command
+int readCommand(FILE* pControl)
 {
-    chromedSphere lSphere;
-    hdriBuilder lHDRiBuilder;
+    char lLine[256];
+    if(pControl == NULL || fgets(lLine, sizeof(lLine), pControl) == NULL)
+        return 'q';
+
+    string lCommand(lLine);
+    size_t lEnd = lCommand.find_last_not_of(" \t\r\n");
+    lCommand = lEnd == string::npos ? "" : lCommand.substr(0, lEnd+1);
+
+    // Any other key would end the capture, as in the view mode
+    if(lCommand.size() == 1 && strchr("fmpshgiq", lCommand[0]) != NULL)
+        return lCommand[0];
+    else if(lCommand == "fix")
+        return 'f';
+    else if(lCommand == "slower")
+        return 'm';
+    else if(lCommand == "faster")
+        return 'p';
+    else if(lCommand == "capture")
+        return 's';
+    else if(lCommand == "hdr")
+        return 'h';
+    else if(lCommand == "gamma")
+        return 'g';
+    else if(lCommand == "icc")
+        return 'i';
+    else if(lCommand == "quit")
+        return 'q';
+
+    if(lCommand.size() != 0)
+        cout << "Unknown command: " << lCommand << endl;
+    return -1;
+}
 
-    lSphere.setProjection(eEquirectangular);
-    lSphere.setSphereSize(50.8f);
-    lSphere.setSphereReflectance(0.48f);
+/*************************************/
+void stopDaemon(int pSignal)
+{
+    gTerminate = 1;
+}
 
-    lSphere.setTrackingLength(30, 3);
+/*************************************/
+// Message on a single line, for the replies of the daemon mode
+string replyLine(string pMessage)
+{
+    replace(pMessage.begin(), pMessage.end(), '\n', ' ');
+    return pMessage + "\n";
+}
 
-    bool lStop = false;
-    bool lUpdated = false;
-    bool lFixSphere = false;
-    bool lHDR = false;
-    bool lHDR_done = false;
-    float lEV;
-    Mat lFrame, lPano;
+/*************************************/
+// Path of a file named by a daemon client, in pDirectory. Empty if the name
+// is absolute or goes up, as the client could write anywhere otherwise
+string resolveOutputFile(const string& pName, const string& pDirectory)
+{
+    boost::filesystem::path lName(pName);
+    if(lName.empty() || lName.has_root_path())
+        return "";
 
-    for(;;)
+    for(boost::filesystem::path::iterator lPart = lName.begin(); lPart != lName.end(); lPart++)
     {
-        gMutex.lock();
-        lUpdated = gFrameUpdated;
-        lFixSphere = gFixSphere;
-        if(gFrameUpdated)
-        {
-            lFrame = gFrame.clone();
-            gFrameUpdated = false;
-        }
-        lHDR = gHDR;
-        lHDR_done = gHDR_done;
-        lEV = gEV;
-        gMutex.unlock();
-
-        if(lUpdated)
-        {
-            if(lFixSphere)
-                lSphere.setProbe(gFrame, true);
-            else
-                lSphere.setProbe(gFrame, gFOV);
-
-            lPano = lSphere.getConvertedProbe();
+        if(lPart->string() == "..")
+            return "";
+    }
 
-            if(lHDR && !lHDR_done)
-            {
-                Mat lPano_RGB(lPano.size(), lPano.type());
-                cvtColor(lPano, lPano_RGB, CV_BGR2RGB);
-                if(lHDRiBuilder.addLDR(&lPano_RGB, lEV))
-                    cout << "LDRi successfully added, EV=" << lEV << endl;
+    return (boost::filesystem::path(pDirectory) / lName).string();
+}
 
-                string lStr;
-                lStr = "img_" + boost::lexical_cast<std::string>(lEV) + ".png";
-                imwrite(lStr, lFrame);
-            }
+/*************************************/
+// Executes a request of the daemon mode. Requests are:
+//   capture [file]: writes the next frame, capture_<n>.png by default
+//   frame: replies "OK <width> <height> <channels> <bytes>", then the BGR pixels of the next frame
+//   hdr [file]: writes an HDRI, hdri.hdr by default, and replies once it is written
+//   set shutter|gain|gamma|fix <value>
+//   get shutter|gain|ev|fov
+//   quit
+// Files are written in pOutputDirectory
+// Replies are a line starting with "OK", followed by the result, or "ERROR" and the reason
+string executeRequest(const string& pRequest, pipeline& pPipeline, camera& pCamera, const string& pOutputDirectory,
+                      unsigned int& pNbrShot, bool& pQuit)
+{
+    istringstream lStream(pRequest);
+    string lCommand, lArgument, lValue;
+    lStream >> lCommand >> lArgument >> lValue;
 
-            if(lHDR_done && lHDR)
-            {
-                if(lHDRiBuilder.computeHDRI())
-                {
-                    Mat lHDRi = lHDRiBuilder.getHDRI();
-                    FILE *lFile = fopen("hdri.hdr", "wb");
-                    if(lHDRi.isContinuous())
-                    {
-                        RGBE_WriteHeader(lFile, lHDRi.cols, lHDRi.rows, NULL);
-                        RGBE_WritePixels(lFile, (float*)lHDRi.data, lHDRi.rows*lHDRi.cols);
-                    }
-                    fclose(lFile);
+    if(lCommand == "capture" || lCommand == "frame")
+    {
+        // A frame captured after the request
+        Mat lFrame;
+        while(pPipeline.getFrame(lFrame));
+        if(!pPipeline.waitFrame(lFrame, DAEMON_FRAME_TIMEOUT))
+            return "ERROR no frame\n";
 
-                    cout << "HDRi computed and saved." << endl;
-                }
-                gMutex.lock();
-                gHDR = false;
-                gMutex.unlock();
-            }
+        if(lCommand == "frame")
+        {
+            if(!lFrame.isContinuous())
+                lFrame = lFrame.clone();
+            size_t lSize = lFrame.total()*lFrame.elemSize();
+            ostringstream lReply;
+            lReply << "OK " << lFrame.cols << " " << lFrame.rows << " " << lFrame.channels() << " " << lSize << "\n";
+            return lReply.str() + string((const char*)lFrame.data, lSize);
         }
 
-        imshow("probe", lPano);
-        usleep(1);
+        string lName = lArgument;
+        if(lName.size() == 0)
+            lName = "capture_" + boost::lexical_cast<std::string>(pNbrShot++) + ".png";
+        string lFile = resolveOutputFile(lName, pOutputDirectory);
+        if(lFile.size() == 0)
+            return "ERROR invalid file " + lName + "\n";
+        if(!imwrite(lFile, lFrame))
+            return "ERROR unable to write " + lFile + "\n";
+        return "OK " + lFile + "\n";
+    }
+    else if(lCommand == "hdr")
+    {
+        string lName = lArgument.size() != 0 ? lArgument : "hdri.hdr";
+        string lFile = resolveOutputFile(lName, pOutputDirectory);
+        if(lFile.size() == 0)
+            return "ERROR invalid file " + lName + "\n";
+        unsigned long long lBracket = pPipeline.startHDR(lFile);
+        if(lBracket == 0)
+            return "ERROR not in probe mode\n";
+        if(!pPipeline.waitHDR(lBracket, DAEMON_HDR_TIMEOUT))
+            return "ERROR unable to create " + lFile + "\n";
+        return "OK " + lFile + "\n";
+    }
+    else if(lCommand == "set")
+    {
+        float lNumber;
+        try
+        {
+            lNumber = boost::lexical_cast<float>(lValue);
+        }
+        catch(boost::bad_lexical_cast&)
+        {
+            return "ERROR invalid value " + lValue + "\n";
+        }
 
-        gMutex.lock();
-        lStop = gStopAll;
-        gMutex.unlock();
-        if(lStop)
-            break;
+        bool lResult = true;
+        if(lArgument == "shutter")
+            lResult = pCamera.setShutter(lNumber);
+        else if(lArgument == "gain")
+            lResult = pCamera.setGain(lNumber);
+        else if(lArgument == "gamma")
+            lResult = pCamera.setGamma(lNumber);
+        else if(lArgument == "fix")
+            pPipeline.setFixSphere(lNumber != 0.f);
+        else
+            return "ERROR unknown parameter " + lArgument + "\n";
+
+        return lResult ? "OK\n" : "ERROR unable to set " + lArgument + "\n";
+    }
+    else if(lCommand == "get")
+    {
+        float lNumber;
+        if(lArgument == "shutter")
+            lNumber = pCamera.getShutter();
+        else if(lArgument == "gain")
+            lNumber = pCamera.getGain();
+        else if(lArgument == "ev")
+            lNumber = pCamera.getEV();
+        else if(lArgument == "fov")
+            lNumber = pCamera.getFOV();
+        else
+            return "ERROR unknown parameter " + lArgument + "\n";
+
+        return "OK " + boost::lexical_cast<std::string>(lNumber) + "\n";
     }
+    else if(lCommand == "quit")
+    {
+        pQuit = true;
+        return "OK\n";
+    }
+
+    return "ERROR unknown command " + lCommand + "\n";
 }
 
 /*************************************/
@@ -117,7 +227,32 @@ int main(int argc, char** argv)
     bool lViewMode = false;
     bool lCreateHDRi = false;
     bool lProbeMode = false;
+    bool lAdaptive = false;
     int lLdrNbr = 5;
+    // Without display, commands are read from the control file descriptor
+    bool lHeadless = false;
+    int lControlFd = 0;
+    // Statistics of the stages, written periodically
+    char* lMetricsFile = NULL;
+    double lMetricsInterval = 1.0;
+    // Timeline of the session, written on exit
+    char* lTraceFile = NULL;
+    // Shared memory output of the live probes and HDRIs
+    char* lShmName = NULL;
+    // Daemon mode, controlled through a Unix socket, and its client
+    char* lDaemonSocket = NULL;
+    char* lSendSocket = NULL;
+    char* lSendRequest = NULL;
+    string lOutputDirectory = ".";
+    // Synthetic brackets generated from a description, without camera
+    char* lSceneFile = NULL;
+    char* lScenePrefix = NULL;
+    // Worker threads shared by the parallel parts of the processing
+    schedulerSettings lThreads;
+
+    // Snapshot of the pipeline state, declared first as it has to outlive its users
+    snapshot lSnapshot;
+    char* lSnapshotFile = NULL;
 
     // Camera parameters
     camera lCamera;
@@ -128,11 +263,19 @@ int main(int argc, char** argv)
     float lGain = 0.0f;
     bool lGamma = false;
     bool lICC = false;
+    bool lProfile = false;
     char* lICCProfile = "RGB_E";
-
-    gHDR = false;
-    gStopAll = false;
-    gFixSphere = false;
+    char* lReplayFile = NULL;
+    bool lReplayRealTime = true;
+
+    gPanoWidth = 0;
+    gPanoHeight = 0;
+    gProjection = eEquirectangular;
+    gSphereMerge = false;
+    gSHOrder = 0;
+    gLiveSH = false;
+    gImportance = false;
+    gDetectionRate = 2.f;
 
     if(argc < 2)
     {
@@ -147,6 +290,61 @@ int main(int argc, char** argv)
             {
                 lViewMode = true;
             }
+            else if(strcmp(argv[i], "--headless") == 0)
+            {
+                lHeadless = true;
+            }
+            else if(strcmp(argv[i], "--control") == 0)
+            {
+                lControlFd = boost::lexical_cast<int>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--metrics") == 0)
+            {
+                lMetricsFile = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--metricsinterval") == 0)
+            {
+                lMetricsInterval = boost::lexical_cast<double>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--trace") == 0)
+            {
+                lTraceFile = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--shm") == 0)
+            {
+                lShmName = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--daemon") == 0)
+            {
+                lViewMode = true;
+                lDaemonSocket = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--outputdir") == 0)
+            {
+                lOutputDirectory = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--send") == 0)
+            {
+                lSendSocket = argv[i+1];
+                lSendRequest = argv[i+2];
+            }
+            else if(strcmp(argv[i], "--synthesize") == 0)
+            {
+                lSceneFile = argv[i+1];
+                lScenePrefix = argv[i+2];
+            }
+            else if(strcmp(argv[i], "--threads") == 0)
+            {
+                lThreads.threads = boost::lexical_cast<unsigned int>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--affinity") == 0)
+            {
+                lThreads.affinity = true;
+            }
+            else if(strcmp(argv[i], "--numa") == 0)
+            {
+                lThreads.numa = true;
+            }
             else if(strcmp(argv[i], "--gain") == 0)
             {
                 lGain = boost::lexical_cast<float>(argv[i+1]);
@@ -171,14 +369,139 @@ int main(int argc, char** argv)
             {
                 lProbeMode = true;
             }
+            else if(strcmp(argv[i], "--adaptive") == 0)
+            {
+                lAdaptive = true;
+            }
+            else if(strcmp(argv[i], "--panowidth") == 0)
+            {
+                gPanoWidth = boost::lexical_cast<unsigned int>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--panoheight") == 0)
+            {
+                gPanoHeight = boost::lexical_cast<unsigned int>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--sh") == 0)
+            {
+                gSHOrder = boost::lexical_cast<unsigned int>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--livesh") == 0)
+            {
+                gLiveSH = true;
+            }
+            else if(strcmp(argv[i], "--importance") == 0)
+            {
+                gImportance = true;
+            }
+            else if(strcmp(argv[i], "--detectrate") == 0)
+            {
+                gDetectionRate = boost::lexical_cast<float>(argv[i+1]);
+            }
+            else if(strcmp(argv[i], "--spheremerge") == 0)
+            {
+                gSphereMerge = true;
+            }
+            else if(strcmp(argv[i], "--projection") == 0)
+            {
+                if(strcmp(argv[i+1], "cubemap") == 0)
+                    gProjection = eCubemap;
+                else if(strcmp(argv[i+1], "octahedral") == 0)
+                    gProjection = eOctahedral;
+                else if(strcmp(argv[i+1], "angular") == 0)
+                    gProjection = eAngular;
+                else
+                    gProjection = eEquirectangular;
+            }
             else if(strcmp(argv[i], "--profile") == 0)
             {
-                lICC = lCamera.setICCProfiles("profile.icc", lICCProfile);
+                lProfile = true;
+            }
+            else if(strcmp(argv[i], "--snapshot") == 0)
+            {
+                lSnapshotFile = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--iccexact") == 0)
+            {
+                lCamera.setICCLut(false);
+            }
+            else if(strcmp(argv[i], "--replay") == 0)
+            {
+                lReplayFile = argv[i+1];
+            }
+            else if(strcmp(argv[i], "--replayfast") == 0)
+            {
+                lReplayRealTime = false;
+            }
+            else if(strcmp(argv[i], "--raw") == 0)
+            {
+                lCamera.setRawMode(true);
+            }
+            else if(strcmp(argv[i], "--bayer") == 0)
+            {
+                bayerPattern lPattern;
+                if(bayerPatternFromString(argv[i+1], lPattern))
+                    lCamera.setBayerPattern(lPattern);
             }
         }
     }
 
-    if(!lCamera.open(sony))
+    // Client of a daemon, the reply is written to stdout
+    if(lSendSocket != NULL)
+    {
+        if(lSendRequest == NULL || !controlServer::sendRequest(lSendSocket, lSendRequest, stdout))
+        {
+            cout << "Unable to send the request to " << lSendSocket << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if(lMetricsFile != NULL)
+        metrics::startDump(lMetricsFile, lMetricsInterval);
+    if(lTraceFile != NULL)
+    {
+        trace::start();
+        trace::setThreadName("main");
+    }
+    scheduler::configure(lThreads);
+
+    // The generator uses the scheduler, and replaces the camera
+    if(lSceneFile != NULL)
+    {
+        sceneGenerator lGenerator;
+        lResult = lScenePrefix != NULL && lGenerator.open(lSceneFile) && lGenerator.generate(lScenePrefix);
+        if(!lResult)
+            cout << "Error while generating the scene." << endl;
+
+        scheduler::stop();
+        metrics::stopDump();
+        if(lTraceFile != NULL)
+        {
+            trace::stop();
+            trace::write(lTraceFile);
+        }
+        return lResult ? 0 : 1;
+    }
+
+    // The snapshot is used as soon as the state is created
+    if(lSnapshotFile != NULL)
+    {
+        if(lSnapshot.open(lSnapshotFile))
+            cout << "Snapshot loaded." << endl;
+        lCamera.setSnapshot(&lSnapshot);
+    }
+    if(lProfile)
+        lICC = lCamera.setICCProfiles("profile.icc", lICCProfile);
+
+    // Recorded frames replace the camera, for tests and benchmarks
+    if(lReplayFile != NULL)
+    {
+        if(!lCamera.setReplaySource(lReplayFile, lReplayRealTime))
+            return 1;
+        if(!lCamera.open(replay))
+            return 1;
+    }
+    else if(!lCamera.open(sony))
         return 1;
 
     lCamera.setAperture(lAperture);
@@ -191,111 +514,143 @@ int main(int argc, char** argv)
 
     lCamera.setFOV(52.8f);
     lCamera.setCalibration("camera.xml");
-    gFOV = lCamera.getFOV();
 
     Mat lFrame, lProbe;
 
     if(lViewMode)
     {
         unsigned int lNbrShot = 0;
-        unsigned int lHDRShots = 0;
 
-        double lShutterSpeed = 15.f;
-        lCamera.setShutter(lShutterSpeed);
-
-        boost::thread lThread;
-
-        if(lProbeMode)
+        lCamera.setShutter(15.f);
+
+        // Capture, unwrapping and merging run in their own threads,
+        // this one only displays the frames and handles the keys
+        pipelineSettings lSettings;
+        lSettings.probe = lProbeMode;
+        lSettings.FOV = lCamera.getFOV();
+        lSettings.proj = gProjection;
+        lSettings.panoWidth = gPanoWidth;
+        lSettings.panoHeight = gPanoHeight;
+        lSettings.sphereMerge = gSphereMerge;
+        lSettings.shOrder = gSHOrder;
+        lSettings.liveSH = gLiveSH;
+        lSettings.importance = gImportance;
+        lSettings.detectionRate = gDetectionRate;
+        lSettings.ldrNbr = lLdrNbr;
+        lSettings.stopSteps = lStopSteps;
+        lSettings.shutterStart = lShutterStart;
+        if(lShmName != NULL)
+            lSettings.shmName = lShmName;
+
+        pipeline lPipeline(&lCamera);
+        lPipeline.setSettings(lSettings);
+        if(!lPipeline.start())
+            return 1;
+
+        // In daemon mode, requests are executed in their order of arrival
+        // until quit or a signal, while the pipeline keeps everything warm
+        if(lDaemonSocket != NULL)
         {
-            lThread = boost::thread(&probe);
-        }
+            controlServer lServer;
+            if(!lServer.open(lDaemonSocket))
+            {
+                cout << "Unable to listen on " << lDaemonSocket << endl;
+                lPipeline.stop();
+                return 1;
+            }
 
-        for(;;)
-        {
+            gTerminate = 0;
+            signal(SIGTERM, stopDaemon);
+            signal(SIGINT, stopDaemon);
 
-            // If in HDR mode, we wait for the shutter to be set
-            if(gHDR && lHDRShots < lLdrNbr)
+            bool lQuit = false;
+            controlRequest lRequest;
+            while(!lQuit && !gTerminate)
             {
-                for(int i=0; i<10; i++)
+                if(!lServer.waitRequest(lRequest, 0.5))
+                    continue;
+
+                // A failing request must not stop the daemon
+                string lReply;
+                try
+                {
+                    lReply = executeRequest(lRequest.line, lPipeline, lCamera, lOutputDirectory, lNbrShot, lQuit);
+                }
+                catch(cv::Exception& e)
+                {
+                    lReply = "ERROR " + replyLine(e.err);
+                }
+                catch(std::exception& e)
                 {
-                    lCamera.getImage();
-                    usleep(15000);
+                    lReply = "ERROR " + replyLine(e.what());
                 }
+                catch(...)
+                {
+                    lReply = "ERROR unexpected failure\n";
+                }
+                lServer.reply(lRequest, lReply);
             }
 
-            // Image capture
-            gMutex.lock();
-            gEV = lCamera.getEV();
-            gFrame = lCamera.getImage();
-            gFrameUpdated = true;
-            imshow("frame", gFrame);
-            gMutex.unlock();
+            lServer.close();
+        }
+
+        FILE* lControl = NULL;
+        if(lHeadless && lDaemonSocket == NULL)
+        {
+            lControl = fdopen(lControlFd, "r");
+            if(lControl == NULL)
+                cout << "Unable to read commands from fd " << lControlFd << endl;
+        }
 
-            if(gHDR && lHDRShots < lLdrNbr)
+        while(lDaemonSocket == NULL)
+        {
+            // Headless, this thread sleeps until the next command, while
+            // the pipeline runs at the rate of the camera
+            int lKey;
+            if(lHeadless)
+            {
+                lKey = readCommand(lControl);
+            }
+            else
             {
-                double lOldSpeed = lShutterSpeed;
-                lShutterSpeed *= pow(2.f, lStopSteps);
-                lCamera.setShutter(lShutterSpeed);
-                lShutterSpeed = lCamera.getShutter();
-                lHDRShots ++;
+                if(lPipeline.getFrame(lFrame))
+                    imshow("frame", lFrame);
+                if(lPipeline.getProbe(lProbe))
+                    imshow("probe", lProbe);
 
-                if(lOldSpeed == lShutterSpeed || lHDRShots >= lLdrNbr)
-                {
-                    gMutex.lock();
-                    gHDR_done = true;
-                    gMutex.unlock();
-                }
+                lKey = waitKey(5);
             }
 
-            int lKey = waitKey(5);
             if(lKey >= 0)
             {
                 if(lKey == 'f')
                 {
-                    gMutex.lock();
-                    gFixSphere = !gFixSphere;
-                    gMutex.unlock();
+                    lPipeline.setFixSphere(!lPipeline.getFixSphere());
                 }
                 else if(lKey == 'm')
                 {
-                    lShutterSpeed = min(lShutterSpeed*2.0, 5000.0);
-                    lCamera.setShutter(lShutterSpeed);
-                    lShutterSpeed = lCamera.getShutter();
+                    lCamera.setShutter(min(lCamera.getShutter()*2.0, 5000.0));
                 }
                 else if(lKey == 'p')
                 {
-                    lShutterSpeed = max(lShutterSpeed/2.0, 1.0);
-                    lCamera.setShutter(lShutterSpeed);
-                    lShutterSpeed = lCamera.getShutter();
+                    lCamera.setShutter(max(lCamera.getShutter()/2.0, 1.0));
                 }
                 else if(lKey == 's')
                 {
+                    // Latest frame, not displayed when headless
+                    while(lPipeline.getFrame(lFrame));
+                    if(lFrame.rows == 0)
+                        continue;
+
                     cout << "Shot!" << endl;
-                    gMutex.lock();
                     string lStr = "capture_" + boost::lexical_cast<std::string>(lNbrShot) + ".png";
-                    imwrite(lStr.c_str(), gFrame);
+                    imwrite(lStr.c_str(), lFrame);
                     lNbrShot++;
-                    gMutex.unlock();
                 }
                 else if(lKey == 'h')
                 {
-                    if(lProbeMode)
-                    {
-                        // Entering HDR creation mode
-                        gMutex.lock();
-                        gHDR = true;
-                        gHDR_done = false;
-                        gFixSphere = true;
-
-                        lShutterSpeed = lShutterStart;
-                        lCamera.setShutter(lShutterSpeed);
-                        lShutterSpeed = lCamera.getShutter();
-                        lCamera.setGamma(1.f);
-
-                        lHDRShots = 0;
-
-                        gMutex.unlock();
-                    }
+                    // Entering HDR creation mode
+                    lPipeline.startHDR();
                 }
                 else if(lKey == 'g')
                 {
@@ -323,22 +678,26 @@ int main(int argc, char** argv)
                 }
                 else
                 {
-                    gMutex.lock();
-                    gStopAll = true;
-                    gMutex.unlock();
                     break;
                 }
             }
         }
 
-        if(lProbeMode)
-            lThread.join();
+        if(lControl != NULL)
+            fclose(lControl);
+        lPipeline.stop();
     }
     else if(!lViewMode)
     {
         hdriBuilder lHDRiBuilder;
         double lShutterSpeed = lShutterStart;
 
+        // With adaptive bracketing, --ldr is the maximum number of frames
+        // and the exposures are planned from the histograms
+        exposurePlanner lPlanner;
+        bool lBracketDone = false;
+        capturedFrame lPrevious;
+
         // Set gamma to 1
         lCamera.setGamma(1.f);
 
@@ -349,49 +708,95 @@ int main(int argc, char** argv)
         {
             // Set various parameters
             lSphere = new chromedSphere;
-            lSphere->setProjection(eEquirectangular);
+            lSphere->setProjection(gProjection);
             lSphere->setSphereSize(50.8f);
             lSphere->setTrackingLength(30, 3);
             lCamera.setShutter(lShutterSpeed);
 
-            // Detect the sphere
-            for(int i=0; i<30; i++)
+            // Detect the sphere, unless its position is known from the snapshot
+            lFrame = lCamera.getImage();
+            if(lSnapshotFile != NULL && lSphere->setSnapshot(&lSnapshot, lFrame.size(), 50.8f))
             {
-                lFrame = lCamera.getImage();
-                lSphere->setProbe(lFrame, 50.8f);
-                usleep(100);
+                lSphere->setProbe(lFrame, true);
             }
+            else
+            {
+                for(int i=0; i<30; i++)
+                {
+                    lFrame = lCamera.getImage();
+                    lSphere->setProbe(lFrame, 50.8f);
+                    usleep(100);
+                }
+            }
+            lSphere->setRectifyMap(lCamera.getRectifyMap());
         }
 
+        // Frames are captured in a dedicated thread. In probe mode,
+        // the undistortion is done along with the unwrapping
+        lCamera.startCapture(8, !lProbeMode);
+
         for(int i=0; i<lLdrNbr; i++)
         {
             lCamera.setShutter(lShutterSpeed);
             // Real shutter speed might differ from the specified one
             lShutterSpeed = lCamera.getShutter();
 
-            // Loop to empty the buffer
-            for(int j=0; j<10; j++)
+            // Wait for the first frame captured with this shutter, detected
+            // by comparison with the previous frame of the bracket
+            capturedFrame lCaptured;
+            bool lCapturedOk;
+            if(lPrevious.image.rows == 0)
+                lCapturedOk = lCamera.waitFrame(lCaptured, lCamera.getSettingsId());
+            else
+                lCapturedOk = lCamera.waitSettledFrame(lCaptured, lPrevious);
+            if(!lCapturedOk)
             {
-                lCamera.getImage();
-                usleep(15000);
+                cout << "Error while capturing image n°" << i << endl;
+                lShutterSpeed *= pow(2, lStopSteps);
+                continue;
+            }
+            lPrevious = lCaptured;
+
+            // Raw frames are kept, along with the developed ones. In probe mode,
+            // the undistortion is done along with the unwrapping
+            if(lCamera.getRawMode())
+            {
+                string lRawStr = "img_raw_" + boost::lexical_cast<std::string>(i) + ".png";
+                scopedTimer lTimer(eMetricEncode, lCaptured.image.total()*lCaptured.image.elemSize());
+                imwrite(lRawStr, lCaptured.image);
+            }
+            lCamera.developFrame(lCaptured.image, lFrame, true, !lProbeMode);
+
+            // Next exposure, measured on the sphere only in probe mode
+            if(lAdaptive)
+            {
+                if(lProbeMode)
+                    lBracketDone = !lPlanner.addFrame(lSphere->getRawSphereImage(lFrame), lCaptured.info.EV, true);
+                else
+                    lBracketDone = !lPlanner.addFrame(lFrame, lCaptured.info.EV);
             }
-            lFrame = lCamera.getImage();
 
             string lStr = "img_probe_" + boost::lexical_cast<std::string>(i) + ".png";
-            lResult = imwrite(lStr, lFrame);
+            {
+                scopedTimer lTimer(eMetricEncode, lFrame.total()*lFrame.elemSize());
+                lResult = imwrite(lStr, lFrame);
+            }
 
             if(lProbeMode)
             {
-                // Extract the panoramic probe
-                lSphere->setProbe(lFrame, true);
-                lFrame = lSphere->getConvertedProbe();
+                // Extract the panoramic probe, or only the sphere if
+                // the brackets are merged before unwrapping
+                if(gSphereMerge && lCreateHDRi)
+                    lFrame = lSphere->getRawSphereImage(lFrame);
+                else
+                    lFrame = lSphere->convertRawProbe(lFrame, gPanoWidth, gPanoHeight);
             }
 
             if(lCreateHDRi == true)
             {
                 Mat lFrame_RGB(lFrame.size(), lFrame.type());
                 cvtColor(lFrame, lFrame_RGB, CV_BGR2RGB);
-                lResult = lHDRiBuilder.addLDR(&lFrame_RGB, lCamera.getEV());
+                lResult = lHDRiBuilder.addLDR(&lFrame_RGB, lCaptured.info.EV);
                 if(lResult)
                     cout << "LDRi successfully added, f=" << lAperture << ", 1/t=" << lShutterSpeed << endl;
                 else
@@ -399,13 +804,29 @@ int main(int argc, char** argv)
             }
 
             lStr = "img_" + boost::lexical_cast<std::string>(i) + ".bmp";
-            lResult = imwrite(lStr, lFrame);
+            {
+                scopedTimer lTimer(eMetricEncode, lFrame.total()*lFrame.elemSize());
+                lResult = imwrite(lStr, lFrame);
+            }
             if(!lResult)
             {
                 cout << "Error while writing image n°" << i << endl;
             }
 
-            lShutterSpeed *= pow(2, lStopSteps);
+            if(!lAdaptive)
+            {
+                lShutterSpeed *= pow(2, lStopSteps);
+            }
+            else if(lBracketDone)
+            {
+                cout << "Dynamic range covered with " << i+1 << " frames." << endl;
+                break;
+            }
+            else
+            {
+                // The shutter is proportional to 2^EV
+                lShutterSpeed *= pow(2, lPlanner.getNextEV()-lCaptured.info.EV);
+            }
         }
 
         if(lCreateHDRi)
@@ -418,16 +839,58 @@ int main(int argc, char** argv)
 
             // Saving in Radiance HDR format
             Mat lHDRi = lHDRiBuilder.getHDRI();
+            if(lProbeMode && gSphereMerge)
+                lHDRi = lSphere->convertProbe(lHDRi, gPanoWidth, gPanoHeight);
             FILE *lFile = fopen("hdri.hdr", "wb");
             if(lHDRi.isContinuous())
             {
+                scopedTimer lTimer(eMetricWrite, lHDRi.total()*4);
                 RGBE_WriteHeader(lFile, lHDRi.cols, lHDRi.rows, NULL);
                 RGBE_WritePixels(lFile, (float*)lHDRi.data, lHDRi.rows*lHDRi.cols);
             }
             fclose(lFile);
+
+            // Spherical harmonics of the probe
+            if(lProbeMode && gSHOrder != 0)
+            {
+                sphericalHarmonics lSH;
+                lSH.setOrder(gSHOrder);
+                if(lSH.compute(lHDRi, gProjection))
+                    lSH.write("hdri_sh.txt");
+            }
+
+            // Importance sampling tables
+            if(lProbeMode && gImportance)
+            {
+                importanceTables lTables;
+                if(gProjection != eEquirectangular)
+                    cout << "Importance tables are only computed for equirectangular probes." << endl;
+                else if(lTables.compute(lHDRi) && lTables.write("hdri_importance.bin"))
+                    cout << "Importance tables saved." << endl;
+            }
         }
+
+        if(lProbeMode && lSnapshotFile != NULL)
+            lSphere->saveSnapshot(lSnapshot);
+    }
+
+    if(lSnapshotFile != NULL)
+    {
+        lCamera.saveSnapshot(lSnapshot);
+        if(!lSnapshot.write(lSnapshotFile))
+            cout << "Error while writing the snapshot." << endl;
     }
 
     lCamera.close();
+    scheduler::stop();
+    metrics::stopDump();
+
+    if(lTraceFile != NULL)
+    {
+        trace::stop();
+        if(!trace::write(lTraceFile))
+            cout << "Error while writing the trace." << endl;
+    }
+
     return 0;
 }
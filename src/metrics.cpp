@@ -0,0 +1,259 @@
+#include "metrics.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <boost/chrono.hpp>
+
+#include "pooledallocator.h"
+#include "trace.h"
+
+using namespace paper;
+
+// Histogram buckets: from 1 us, four per octave, up to about an hour
+#define METRICS_BUCKETS 128
+#define METRICS_BUCKETS_PER_OCTAVE 4
+#define METRICS_MIN_DURATION 1e-6
+
+namespace
+{
+struct stageCounters
+{
+    volatile unsigned long long buckets[METRICS_BUCKETS];
+    volatile unsigned long long count;
+    volatile unsigned long long bytes;
+    volatile unsigned long long maxNs; // maximum duration, in nanoseconds
+};
+
+const char* gStageNames[eMetricStageNbr] = {"grab", "icc", "undistort", "detection", "mapbuild", "remap", "merge", "encode", "write"};
+stageCounters gCounters[eMetricStageNbr];
+double gResetTime = metrics::now();
+
+boost::thread gDumpThread;
+std::string gDumpFile;
+}
+
+/*******************************************/
+double metrics::now()
+{
+    return boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*******************************************/
+void metrics::record(metricStage pStage, double pDuration, unsigned long long pBytes)
+{
+    if(pStage < 0 || pStage >= eMetricStageNbr)
+        return;
+
+    stageCounters& lCounters = gCounters[pStage];
+
+    int lBucket = 0;
+    if(pDuration > METRICS_MIN_DURATION)
+        lBucket = std::min((int)(log2(pDuration/METRICS_MIN_DURATION)*METRICS_BUCKETS_PER_OCTAVE), METRICS_BUCKETS-1);
+
+    __sync_fetch_and_add(&lCounters.buckets[lBucket], 1);
+    __sync_fetch_and_add(&lCounters.count, 1);
+    if(pBytes != 0)
+        __sync_fetch_and_add(&lCounters.bytes, pBytes);
+
+    unsigned long long lDuration = (unsigned long long)(std::max(pDuration, 0.0)*1e9);
+    unsigned long long lMax = lCounters.maxNs;
+    while(lDuration > lMax && !__sync_bool_compare_and_swap(&lCounters.maxNs, lMax, lDuration))
+        lMax = lCounters.maxNs;
+}
+
+/*******************************************/
+stageStatistics metrics::getStatistics(metricStage pStage)
+{
+    stageStatistics lStats;
+    memset(&lStats, 0, sizeof(lStats));
+    if(pStage < 0 || pStage >= eMetricStageNbr)
+        return lStats;
+
+    const stageCounters& lCounters = gCounters[pStage];
+    lStats.name = gStageNames[pStage];
+
+    // The buckets are read once, the percentiles are computed on this copy
+    unsigned long long lBuckets[METRICS_BUCKETS];
+    unsigned long long lTotal = 0;
+    for(int i=0; i<METRICS_BUCKETS; i++)
+    {
+        lBuckets[i] = lCounters.buckets[i];
+        lTotal += lBuckets[i];
+    }
+
+    lStats.count = lTotal;
+    lStats.max = (double)lCounters.maxNs*1e-9;
+
+    double lElapsed = now() - gResetTime;
+    if(lElapsed > 0.0)
+    {
+        lStats.framesPerSecond = (double)lTotal/lElapsed;
+        lStats.bytesPerSecond = (double)lCounters.bytes/lElapsed;
+    }
+
+    if(lTotal == 0)
+        return lStats;
+
+    double* lPercentiles[3] = {&lStats.p50, &lStats.p95, &lStats.p99};
+    double lRanks[3] = {0.5, 0.95, 0.99};
+    for(int p=0; p<3; p++)
+    {
+        unsigned long long lTarget = (unsigned long long)ceil(lRanks[p]*lTotal);
+        unsigned long long lCumulated = 0;
+        int i = 0;
+        for(; i<METRICS_BUCKETS-1; i++)
+        {
+            lCumulated += lBuckets[i];
+            if(lCumulated >= lTarget)
+                break;
+        }
+
+        // Upper bound of the bucket, never above the maximum
+        double lBound = METRICS_MIN_DURATION*pow(2.0, (double)(i+1)/METRICS_BUCKETS_PER_OCTAVE);
+        *lPercentiles[p] = std::min(lBound, lStats.max);
+    }
+
+    return lStats;
+}
+
+/*******************************************/
+void metrics::reset()
+{
+    for(int s=0; s<eMetricStageNbr; s++)
+    {
+        for(int i=0; i<METRICS_BUCKETS; i++)
+            gCounters[s].buckets[i] = 0;
+        gCounters[s].count = 0;
+        gCounters[s].bytes = 0;
+        gCounters[s].maxNs = 0;
+    }
+    __sync_synchronize();
+
+    gResetTime = now();
+}
+
+/*******************************************/
+bool metrics::write(const char* pFile)
+{
+    size_t lLength = strlen(pFile);
+    if(lLength >= 5 && strcmp(pFile+lLength-5, ".json") == 0)
+        return writeJSON(pFile);
+    else
+        return writeCSV(pFile);
+}
+
+/*******************************************/
+void metrics::startDump(const char* pFile, double pInterval)
+{
+    stopDump();
+
+    gDumpFile = pFile;
+    gDumpThread = boost::thread(&metrics::dumpLoop, gDumpFile, std::max(pInterval, 0.01));
+}
+
+/*******************************************/
+void metrics::stopDump()
+{
+    if(gDumpFile.size() == 0)
+        return;
+
+    gDumpThread.interrupt();
+    gDumpThread.join();
+
+    write(gDumpFile.c_str());
+    gDumpFile.clear();
+}
+
+/*******************************************/
+void metrics::dumpLoop(std::string pFile, double pInterval)
+{
+    try
+    {
+        for(;;)
+        {
+            boost::this_thread::sleep_for(boost::chrono::duration<double>(pInterval));
+            write(pFile.c_str());
+        }
+    }
+    catch(boost::thread_interrupted&)
+    {
+    }
+}
+
+/*******************************************/
+bool metrics::writeCSV(const char* pFile)
+{
+    FILE* lFile = fopen(pFile, "a");
+    if(lFile == NULL)
+        return false;
+
+    // Header only for a new file
+    if(ftell(lFile) == 0)
+        fprintf(lFile, "time,stage,count,p50_ms,p95_ms,p99_ms,max_ms,frames_per_s,bytes_per_s\n");
+
+    double lTime = now() - gResetTime;
+    for(int s=0; s<eMetricStageNbr; s++)
+    {
+        stageStatistics lStats = getStatistics((metricStage)s);
+        fprintf(lFile, "%.3f,%s,%llu,%.3f,%.3f,%.3f,%.3f,%.2f,%.0f\n", lTime, lStats.name, lStats.count,
+                lStats.p50*1e3, lStats.p95*1e3, lStats.p99*1e3, lStats.max*1e3, lStats.framesPerSecond, lStats.bytesPerSecond);
+    }
+
+    return fclose(lFile) == 0;
+}
+
+/*******************************************/
+bool metrics::writeJSON(const char* pFile)
+{
+    // Written aside then renamed, so that readers never see a partial file
+    std::string lTemporary = std::string(pFile) + ".tmp";
+    FILE* lFile = fopen(lTemporary.c_str(), "w");
+    if(lFile == NULL)
+        return false;
+
+    fprintf(lFile, "{\n  \"time\": %.3f,\n  \"stages\": {\n", now() - gResetTime);
+    for(int s=0; s<eMetricStageNbr; s++)
+    {
+        stageStatistics lStats = getStatistics((metricStage)s);
+        fprintf(lFile, "    \"%s\": {\"count\": %llu, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"frames_per_s\": %.2f, \"bytes_per_s\": %.0f}%s\n",
+                lStats.name, lStats.count, lStats.p50*1e3, lStats.p95*1e3, lStats.p99*1e3, lStats.max*1e3,
+                lStats.framesPerSecond, lStats.bytesPerSecond, s+1 < eMetricStageNbr ? "," : "");
+    }
+    fprintf(lFile, "  },\n");
+
+    allocatorStatistics lAllocator = pooledAllocator::get()->getStatistics();
+    fprintf(lFile, "  \"allocator\": {\"allocations\": %llu, \"system_allocations\": %llu, \"frame_allocations\": %llu, \"frame_system_allocations\": %llu, \"bytes_in_use\": %llu, \"high_water\": %llu, \"bytes_reserved\": %llu}\n}\n",
+            lAllocator.allocations, lAllocator.systemAllocations, lAllocator.frameAllocations, lAllocator.frameSystemAllocations,
+            (unsigned long long)lAllocator.bytesInUse, (unsigned long long)lAllocator.highWater, (unsigned long long)lAllocator.bytesReserved);
+
+    if(fclose(lFile) != 0)
+    {
+        remove(lTemporary.c_str());
+        return false;
+    }
+
+    return rename(lTemporary.c_str(), pFile) == 0;
+}
+
+/*******************************************/
+scopedTimer::scopedTimer(metricStage pStage, unsigned long long pBytes)
+{
+    mStage = pStage;
+    mBytes = pBytes;
+    mStart = metrics::now();
+}
+
+/*******************************************/
+scopedTimer::~scopedTimer()
+{
+    double lEnd = metrics::now();
+    metrics::record(mStage, lEnd - mStart, mBytes);
+    trace::addEvent(gStageNames[mStage], mStart, lEnd);
+}
+
+/*******************************************/
+void scopedTimer::setBytes(unsigned long long pBytes)
+{
+    mBytes = pBytes;
+}
@@ -0,0 +1,80 @@
+// Timing of the processing stages, cheap enough to stay enabled in the field.
+// Each stage has a histogram of its durations, on logarithmic buckets (four
+// per octave, from 1 us), updated with atomic operations only: timing a call
+// costs two reads of the monotonic clock and a few atomic additions.
+// Percentiles are read from the buckets, so they are rounded up by at most 19%.
+//
+// Statistics can be written periodically from a background thread:
+//   .csv files get one row per stage at each dump, as a time series
+//   .json files are replaced by the latest statistics, with the counters of
+//   the pooled allocator
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <boost/thread.hpp>
+
+namespace paper
+{
+enum metricStage
+{
+    eMetricGrab, // grabbing the frame from the camera
+    eMetricICC, // color correction
+    eMetricUndistort,
+    eMetricDetection, // sphere detection
+    eMetricMapBuild, // sphere transformation maps
+    eMetricRemap, // probe unwrapping
+    eMetricMerge, // HDRI computation
+    eMetricEncode, // LDR images written with imwrite
+    eMetricWrite, // HDRI written in Radiance format
+    eMetricStageNbr
+};
+
+struct stageStatistics
+{
+    const char* name;
+    unsigned long long count;
+    double p50, p95, p99, max; // in seconds
+    double framesPerSecond, bytesPerSecond; // since the last reset
+};
+
+class metrics
+{
+public:
+    // Seconds from a monotonic clock
+    static double now();
+
+    static void record(metricStage pStage, double pDuration, unsigned long long pBytes = 0);
+    static stageStatistics getStatistics(metricStage pStage);
+    static void reset();
+
+    // Writes the statistics of all the stages, in CSV or JSON depending on the extension
+    static bool write(const char* pFile);
+    // Same, every pInterval seconds until stopDump, which writes them a last time
+    static void startDump(const char* pFile, double pInterval = 1.0);
+    static void stopDump();
+
+private:
+    static void dumpLoop(std::string pFile, double pInterval);
+    static bool writeCSV(const char* pFile);
+    static bool writeJSON(const char* pFile);
+};
+
+// Records the time spent in its scope, also as a trace event if tracing
+class scopedTimer
+{
+public:
+    scopedTimer(metricStage pStage, unsigned long long pBytes = 0);
+    ~scopedTimer();
+
+    void setBytes(unsigned long long pBytes);
+
+private:
+    metricStage mStage;
+    unsigned long long mBytes;
+    double mStart;
+};
+}
+
+#endif // METRICS_H
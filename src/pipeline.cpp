@@ -0,0 +1,526 @@
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "chromedsphere.h"
+#include "hdribuilder.h"
+#include "importancetables.h"
+#include "metrics.h"
+#include "pooledallocator.h"
+#include "rgbe.h"
+#include "scheduler.h"
+#include "shmsink.h"
+#include "sphericalharmonics.h"
+#include "trace.h"
+
+using namespace paper;
+
+// Chromed sphere used for the probes
+#define PIPELINE_SPHERE_SIZE 50.8f
+#define PIPELINE_SPHERE_REFLECTANCE 0.48f
+
+/*******************************************/
+// Writes an LDR image of a bracket, run on the scheduler. Failures, an
+// exception of imwrite included, are counted in pFailures
+static void encodeImage(string pFile, Mat pImage, volatile int* pFailures)
+{
+    scopedTimer lTimer(eMetricEncode, pImage.total()*pImage.elemSize());
+    try
+    {
+        if(imwrite(pFile, pImage))
+            return;
+        cout << "Error while writing " << pFile << endl;
+    }
+    catch(cv::Exception& e)
+    {
+        cout << "Error while writing " << pFile << ": " << e.err << endl;
+    }
+
+    __sync_fetch_and_add(pFailures, 1);
+}
+
+/*******************************************/
+pipelineSettings::pipelineSettings()
+{
+    probe = false;
+    FOV = 52.8f;
+    proj = eEquirectangular;
+    panoWidth = 0;
+    panoHeight = 0;
+    sphereMerge = false;
+    shOrder = 0;
+    liveSH = false;
+    importance = false;
+    detectionRate = 2.f;
+    shmSlots = 4;
+
+    ldrNbr = 5;
+    stopSteps = 1.f;
+    shutterStart = 1.f;
+}
+
+/*******************************************/
+pipeline::pipeline(camera* pCamera):
+    mUnwrapQueue(4, spscQueue<pipelineFrame>::eDropOldest),
+    mMergeQueue(16, spscQueue<pipelineFrame>::eBlock),
+    mWriteQueue(16, spscQueue<pipelineOutput>::eBlock),
+    mFrameQueue(2, spscQueue<Mat>::eDropOldest),
+    mProbeQueue(2, spscQueue<Mat>::eDropOldest)
+{
+    mCamera = pCamera;
+    mRunning = false;
+    mHDRRequest = false;
+    mFixSphere = false;
+    mHDRRequested = 0;
+    mHDRWritten = 0;
+    mHDRSuccess = false;
+}
+
+/*******************************************/
+pipeline::~pipeline()
+{
+    stop();
+}
+
+/*******************************************/
+void pipeline::setSettings(const pipelineSettings& pSettings)
+{
+    mSettings = pSettings;
+}
+
+/*******************************************/
+bool pipeline::start()
+{
+    if(mRunning)
+        return true;
+
+    if(!mCamera->startCapture())
+        return false;
+
+    mRunning = true;
+    mDevelopThread = boost::thread(&pipeline::developLoop, this);
+    if(mSettings.probe)
+    {
+        mUnwrapThread = boost::thread(&pipeline::unwrapLoop, this);
+        mMergeThread = boost::thread(&pipeline::mergeLoop, this);
+        mWriteThread = boost::thread(&pipeline::writeLoop, this);
+    }
+
+    return true;
+}
+
+/*******************************************/
+void pipeline::stop()
+{
+    if(!mRunning)
+        return;
+
+    // Each stage ends when its input is closed and empty
+    mRunning = false;
+    mDevelopThread.join();
+    if(mSettings.probe)
+    {
+        mUnwrapQueue.close();
+        mUnwrapThread.join();
+        mMergeQueue.close();
+        mMergeThread.join();
+        mWriteQueue.close();
+        mWriteThread.join();
+    }
+
+    mFrameQueue.close();
+    mProbeQueue.close();
+
+    mCamera->stopCapture();
+
+    boost::mutex::scoped_lock lLock(mHDRMutex);
+    mHDRCondition.notify_all();
+}
+
+/*******************************************/
+unsigned long long pipeline::startHDR(const string& pFile)
+{
+    if(!mSettings.probe)
+        return 0;
+
+    boost::mutex::scoped_lock lLock(mHDRMutex);
+    mHDRRequested++;
+    mHDRFile = pFile;
+
+    mFixSphere = true;
+    mHDRRequest = true;
+
+    return mHDRRequested;
+}
+
+/*******************************************/
+bool pipeline::waitHDR(unsigned long long pBracket, double pTimeout)
+{
+    boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::microseconds((long)(pTimeout*1e6));
+
+    // Brackets are written in order, a later one means this one was interrupted
+    // and dropped
+    boost::mutex::scoped_lock lLock(mHDRMutex);
+    while(mRunning && mHDRWritten < pBracket)
+    {
+        if(!mHDRCondition.timed_wait(lLock, lDeadline))
+            break;
+    }
+
+    return mHDRWritten == pBracket && mHDRSuccess;
+}
+
+/*******************************************/
+void pipeline::setFixSphere(bool pFix)
+{
+    mFixSphere = pFix;
+}
+
+/*******************************************/
+bool pipeline::getFixSphere()
+{
+    return mFixSphere;
+}
+
+/*******************************************/
+bool pipeline::getFrame(Mat& pFrame)
+{
+    return mFrameQueue.tryPop(pFrame);
+}
+
+/*******************************************/
+bool pipeline::getProbe(Mat& pProbe)
+{
+    return mProbeQueue.tryPop(pProbe);
+}
+
+/*******************************************/
+bool pipeline::waitFrame(Mat& pFrame, double pTimeout)
+{
+    return mFrameQueue.pop(pFrame, pTimeout);
+}
+
+/*******************************************/
+void pipeline::developLoop()
+{
+    double lShutterSpeed = 0.0;
+    unsigned int lHDRShots = 0;
+    bool lBracket = false;
+    unsigned long long lBracketId = 0;
+    string lHDRiFile;
+    // Set while bracket frames may still be queued for the unwrapping
+    bool lBlocking = false;
+
+    unsigned long long lNextFrame = 0;
+    // Last frame of the bracket, to detect the next exposure
+    capturedFrame lReference;
+
+    trace::setThreadName("develop");
+
+    while(mRunning)
+    {
+        if(mHDRRequest)
+        {
+            {
+                boost::mutex::scoped_lock lLock(mHDRMutex);
+                mHDRRequest = false;
+                lBracketId = mHDRRequested;
+                lHDRiFile = mHDRFile;
+            }
+
+            mCamera->setShutter(mSettings.shutterStart);
+            lShutterSpeed = mCamera->getShutter();
+            mCamera->setGamma(1.f);
+
+            lHDRShots = 0;
+            lBracket = true;
+            lBlocking = true;
+            mUnwrapQueue.setPolicy(spscQueue<pipelineFrame>::eBlock);
+        }
+
+        // If in HDR mode, the frame has to be captured with the current shutter
+        unsigned int lSettings = 0;
+        if(lBracket)
+            lSettings = mCamera->getSettingsId();
+
+        capturedFrame lCaptured;
+        bool lNewFrame;
+        if(lBracket && lHDRShots != 0)
+            lNewFrame = mCamera->waitSettledFrame(lCaptured, lReference);
+        else if(lBracket)
+            lNewFrame = mCamera->waitFrame(lCaptured, lSettings, lNextFrame);
+        else
+            // The preview shows the last frame, not the oldest one of the ring
+            lNewFrame = mCamera->waitLatestFrame(lCaptured, lNextFrame);
+
+        if(!lNewFrame)
+            continue;
+
+        lNextFrame = lCaptured.info.sequence+1;
+        pooledAllocator::get()->markFrame();
+        traceScope lTrace(lBracket ? "develop bracket" : "develop");
+
+        // Raw frames are demosaiced at preview quality, except for the HDR bracket
+        pipelineFrame lFrame;
+        mCamera->developFrame(lCaptured.image, lFrame.image, lBracket);
+        lFrame.info = lCaptured.info;
+        lFrame.bracket = lBracket;
+        lFrame.bracketEnd = false;
+        lFrame.bracketId = lBracket ? lBracketId : 0;
+        if(lBracket)
+            lFrame.hdriFile = lHDRiFile;
+
+        if(lBracket)
+        {
+            lReference = lCaptured;
+
+            double lOldSpeed = lShutterSpeed;
+            lShutterSpeed *= pow(2.f, mSettings.stopSteps);
+            mCamera->setShutter(lShutterSpeed);
+            lShutterSpeed = mCamera->getShutter();
+            lHDRShots++;
+
+            if(lOldSpeed == lShutterSpeed || lHDRShots >= mSettings.ldrNbr)
+            {
+                lFrame.bracketEnd = true;
+                lBracket = false;
+            }
+        }
+        else if(lBlocking && mUnwrapQueue.size() == 0)
+        {
+            // The whole bracket went through, preview frames can be dropped again
+            lBlocking = false;
+            mUnwrapQueue.setPolicy(spscQueue<pipelineFrame>::eDropOldest);
+        }
+
+        mFrameQueue.push(lFrame.image);
+        if(mSettings.probe)
+            mUnwrapQueue.push(lFrame);
+    }
+}
+
+/*******************************************/
+void pipeline::unwrapLoop()
+{
+    chromedSphere lSphere;
+    sphericalHarmonics lSH;
+    lSH.setOrder(mSettings.shOrder);
+
+    lSphere.setProjection(mSettings.proj);
+    lSphere.setSphereSize(PIPELINE_SPHERE_SIZE);
+    lSphere.setSphereReflectance(PIPELINE_SPHERE_REFLECTANCE);
+    lSphere.setTrackingLength(30, 3);
+
+    // The sphere is detected in the background, frames are only unwrapped
+    if(mSettings.detectionRate > 0.f)
+        lSphere.setAsyncDetection(true, 1.0/mSettings.detectionRate);
+
+    // Live probes shared with other processes
+    sharedMemorySink lSink;
+
+    trace::setThreadName("unwrap");
+
+    pipelineFrame lFrame;
+    while(mUnwrapQueue.pop(lFrame))
+    {
+        traceScope lTrace(lFrame.bracket ? "unwrap bracket" : "unwrap");
+        if(mFixSphere)
+            lSphere.setProbe(lFrame.image, true);
+        else
+            lSphere.trackProbe(lFrame.image, mSettings.FOV);
+
+        lFrame.pano = lSphere.getConvertedProbe(mSettings.panoWidth, mSettings.panoHeight);
+
+        if(mSettings.liveSH && mSettings.shOrder != 0)
+        {
+            Mat lPano_RGB = pooledMat();
+            cvtColor(lFrame.pano, lPano_RGB, CV_BGR2RGB);
+            lPano_RGB.convertTo(lPano_RGB, CV_32FC3, 1.f/127.f*pow(2.0f, lFrame.info.EV));
+            if(lSH.compute(lPano_RGB, mSettings.proj))
+            {
+                vector<Vec3f> lCoeffs = lSH.getCoefficients();
+                cout << "SH:";
+                for(unsigned int i=0; i<lCoeffs.size(); i++)
+                    cout << " " << lCoeffs[i][0] << " " << lCoeffs[i][1] << " " << lCoeffs[i][2];
+                cout << endl;
+            }
+        }
+
+        mProbeQueue.push(lFrame.pano);
+
+        if(mSettings.shmName.size() != 0)
+        {
+            // The segment is sized from the probe, and created again for a larger one
+            size_t lSize = lFrame.pano.total()*lFrame.pano.elemSize();
+            if((!lSink.isOpen() || lSink.getSlotSize() < lSize) && !lSink.open(mSettings.shmName.c_str(), mSettings.shmSlots, lSize))
+                cout << "Unable to create the shared memory segment " << mSettings.shmName << endl;
+            else if(!lSink.publish(lFrame.pano, lFrame.info, HDRC_SHM_PROBE, lSphere.getSphere()))
+                cout << "Unable to publish the probe to " << mSettings.shmName << endl;
+        }
+
+        if(lFrame.bracket)
+        {
+            lFrame.sphereGeometry = lSphere.getSphere();
+            if(mSettings.sphereMerge)
+                lFrame.sphere = lSphere.getSphereImage();
+            mMergeQueue.push(lFrame);
+        }
+    }
+}
+
+/*******************************************/
+void pipeline::mergeLoop()
+{
+    hdriBuilder lHDRiBuilder;
+    unsigned long long lBracketId = 0;
+
+    trace::setThreadName("merge");
+
+    pipelineFrame lFrame;
+    while(mMergeQueue.pop(lFrame))
+    {
+        traceScope lTrace("add LDR");
+        // A bracket restarted by startHDR before its end never gets merged,
+        // its images must not end up in the next one
+        if(lFrame.bracketId != lBracketId)
+        {
+            lHDRiBuilder.clearLDRi();
+            lBracketId = lFrame.bracketId;
+        }
+
+        // Brackets are merged either as seen on the sphere, or unwrapped
+        Mat lPano_RGB = pooledMat();
+        if(mSettings.sphereMerge)
+            cvtColor(lFrame.sphere, lPano_RGB, CV_BGR2RGB);
+        else
+            cvtColor(lFrame.pano, lPano_RGB, CV_BGR2RGB);
+        if(lHDRiBuilder.addLDR(&lPano_RGB, lFrame.info.EV))
+            cout << "LDRi successfully added, EV=" << lFrame.info.EV << endl;
+
+        pipelineOutput lOutput;
+        lOutput.file = "img_" + boost::lexical_cast<std::string>(lFrame.info.EV) + ".png";
+        lOutput.image = lFrame.image;
+        lOutput.hdri = false;
+        lOutput.bracketId = 0;
+        mWriteQueue.push(lOutput);
+
+        if(!lFrame.bracketEnd)
+            continue;
+
+        // Also sent if the merge failed, for the end of the bracket to be known
+        lOutput.file = lFrame.hdriFile;
+        lOutput.image = Mat();
+        lOutput.hdri = true;
+        lOutput.info = lFrame.info;
+        lOutput.sphereGeometry = lFrame.sphereGeometry;
+        lOutput.bracketId = lFrame.bracketId;
+        // The builder reuses its buffer for the next bracket, the write stage
+        // gets its own copy
+        if(lHDRiBuilder.computeHDRI())
+        {
+            lOutput.image = pooledMat();
+            lHDRiBuilder.getHDRI().copyTo(lOutput.image);
+        }
+
+        // The sphere of the last frame is used to unwrap the merged one
+        if(mSettings.sphereMerge && lOutput.image.rows != 0)
+        {
+            chromedSphere lSphere;
+            lSphere.setProjection(mSettings.proj);
+            lSphere.setSphereSize(PIPELINE_SPHERE_SIZE);
+            lSphere.setSphereReflectance(PIPELINE_SPHERE_REFLECTANCE);
+            lSphere.setProbe(lFrame.image, mSettings.FOV, lFrame.sphereGeometry);
+            lOutput.image = lSphere.convertProbe(lOutput.image, mSettings.panoWidth, mSettings.panoHeight);
+        }
+
+        mWriteQueue.push(lOutput);
+    }
+}
+
+/*******************************************/
+void pipeline::writeLoop()
+{
+    // HDRIs shared with other processes
+    sharedMemorySink lSink;
+    string lSinkName = mSettings.shmName + "_hdri";
+
+    // LDR images are encoded in parallel, and waited for at the end of their bracket
+    taskGroup lEncodes;
+    volatile int lFailedEncodes = 0;
+
+    trace::setThreadName("write");
+
+    pipelineOutput lOutput;
+    while(mWriteQueue.pop(lOutput))
+    {
+        if(!lOutput.hdri)
+        {
+            lEncodes.run(boost::bind(&encodeImage, lOutput.file, lOutput.image, &lFailedEncodes));
+            continue;
+        }
+
+        // The bracket is only written if its LDR images are
+        lEncodes.wait();
+        bool lEncoded = lFailedEncodes == 0;
+        lFailedEncodes = 0;
+
+        Mat lHDRi = lOutput.image;
+        if(lHDRi.rows == 0)
+        {
+            endBracket(lOutput.bracketId, false);
+            continue;
+        }
+
+        bool lWritten = false;
+        FILE *lFile = fopen(lOutput.file.c_str(), "wb");
+        if(lFile != NULL && lHDRi.isContinuous())
+        {
+            scopedTimer lTimer(eMetricWrite, lHDRi.total()*4);
+            lWritten = RGBE_WriteHeader(lFile, lHDRi.cols, lHDRi.rows, NULL) == RGBE_RETURN_SUCCESS
+                && RGBE_WritePixels(lFile, (float*)lHDRi.data, lHDRi.rows*lHDRi.cols) == RGBE_RETURN_SUCCESS;
+        }
+        if(lFile != NULL)
+            fclose(lFile);
+
+        // Tables are named after the HDRI, as hdri_sh.txt for hdri.hdr
+        size_t lExtension = lOutput.file.rfind('.');
+        if(lExtension != string::npos && lOutput.file.find('/', lExtension) != string::npos)
+            lExtension = string::npos;
+        string lBase = lOutput.file.substr(0, lExtension);
+
+        sphericalHarmonics lSH;
+        lSH.setOrder(mSettings.shOrder);
+        if(mSettings.shOrder != 0 && lSH.compute(lHDRi, mSettings.proj))
+            lSH.write((lBase + "_sh.txt").c_str());
+
+        if(mSettings.importance && mSettings.proj == eEquirectangular)
+        {
+            importanceTables lTables;
+            if(lTables.compute(lHDRi))
+                lTables.write((lBase + "_importance.bin").c_str());
+        }
+
+        if(mSettings.shmName.size() != 0)
+        {
+            size_t lSize = lHDRi.total()*lHDRi.elemSize();
+            if((!lSink.isOpen() || lSink.getSlotSize() < lSize) && !lSink.open(lSinkName.c_str(), 2, lSize))
+                cout << "Unable to create the shared memory segment " << lSinkName << endl;
+            else if(!lSink.publish(lHDRi, lOutput.info, HDRC_SHM_HDRI, lOutput.sphereGeometry))
+                cout << "Unable to publish the HDRI to " << lSinkName << endl;
+        }
+
+        endBracket(lOutput.bracketId, lWritten && lEncoded);
+        cout << "HDRi computed and saved." << endl;
+    }
+}
+
+/*******************************************/
+void pipeline::endBracket(unsigned long long pBracket, bool pSuccess)
+{
+    boost::mutex::scoped_lock lLock(mHDRMutex);
+    mHDRWritten = pBracket;
+    mHDRSuccess = pSuccess;
+    mHDRCondition.notify_all();
+}
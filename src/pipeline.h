@@ -0,0 +1,147 @@
+// Processing of the live frames in view mode, as stages running in their
+// own thread:
+//   develop: waits for the captured frames, drives the HDR bracket and develops raw frames
+//   unwrap: tracks the sphere and unwraps the probe
+//   merge: merges the bracket into an HDRI
+//   write: writes the bracket frames and the HDRI, along with its SH and importance tables
+// Stages are connected by bounded single producer, single consumer queues
+// (see spscQueue). Frames for the preview are dropped when the display or
+// the unwrapping falls behind, while bracket frames make the upstream
+// stages wait instead.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <opencv2/opencv.hpp>
+#include <boost/thread.hpp>
+
+#include "camera.h"
+#include "projection.h"
+#include "spscqueue.h"
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+struct pipelineSettings
+{
+    pipelineSettings();
+
+    bool probe; // unwraps the probe, otherwise frames are only developed
+    float FOV; // of the camera, in degrees
+    projection proj;
+    unsigned int panoWidth, panoHeight; // 0 for the default size
+    bool sphereMerge; // merges the brackets as seen on the sphere
+    unsigned int shOrder; // 0 if no SH are computed
+    bool liveSH; // SH of each unwrapped frame
+    bool importance; // importance tables of the HDRI
+    float detectionRate; // sphere detections per second, 0 to detect on each frame
+    // Shared memory segment receiving the live probes, and the HDRIs in
+    // shmName + "_hdri" (see shmsink.h). Empty if none
+    string shmName;
+    unsigned int shmSlots;
+
+    // HDR bracket
+    unsigned int ldrNbr;
+    float stopSteps;
+    float shutterStart;
+};
+
+// Frame passed between the stages
+struct pipelineFrame
+{
+    Mat image; // developed camera frame
+    Mat pano; // unwrapped probe
+    Mat sphere; // image cropped around the sphere, merged if sphereMerge
+    Vec3f sphereGeometry; // position and radius of the sphere in the image, for bracket frames
+    frameInfo info;
+    bool bracket; // part of an HDR bracket
+    bool bracketEnd; // last frame of the bracket
+    unsigned long long bracketId; // for bracket frames, see pipeline::startHDR
+    string hdriFile; // for bracket frames
+};
+
+// Image to write
+struct pipelineOutput
+{
+    string file;
+    Mat image;
+    bool hdri; // RGB float HDRI, written in Radiance format with its SH and importance tables
+    frameInfo info; // of the last frame of the bracket, for the HDRI
+    Vec3f sphereGeometry;
+    unsigned long long bracketId; // for the HDRI, which is empty if the merge failed
+};
+
+class pipeline
+{
+public:
+    pipeline(camera* pCamera);
+    ~pipeline();
+
+    // Must be called before start
+    void setSettings(const pipelineSettings& pSettings);
+
+    // Starts the capture and the stages
+    bool start();
+    // Stops the stages once the frames they hold are processed, then the capture
+    void stop();
+
+    // Starts an HDR bracket from settings.shutterStart, and fixes the sphere.
+    // A bracket still running is interrupted, and never written
+    // The HDRI is written to pFile, its SH and importance tables next to it
+    // Returns the id of the bracket, 0 if not in probe mode
+    unsigned long long startHDR(const string& pFile = "hdri.hdr");
+    // Waits up to pTimeout seconds for the bracket to be written. Returns
+    // false on timeout, or if it could not be merged or was interrupted by the next one
+    bool waitHDR(unsigned long long pBracket, double pTimeout);
+    void setFixSphere(bool pFix);
+    bool getFixSphere();
+
+    // Latest developed frame, and unwrapped probe. Return false if there is no new one
+    bool getFrame(Mat& pFrame);
+    bool getProbe(Mat& pProbe);
+    // Waits up to pTimeout seconds for the next developed frame
+    bool waitFrame(Mat& pFrame, double pTimeout);
+
+private:
+    /*****************/
+    // Attributes
+    camera* mCamera;
+    pipelineSettings mSettings;
+
+    volatile bool mRunning;
+    volatile bool mHDRRequest;
+    volatile bool mFixSphere;
+
+    // Brackets requested, and last one written
+    boost::mutex mHDRMutex;
+    boost::condition_variable mHDRCondition;
+    unsigned long long mHDRRequested;
+    string mHDRFile;
+    unsigned long long mHDRWritten;
+    bool mHDRSuccess; // of the last bracket written
+
+    spscQueue<pipelineFrame> mUnwrapQueue; // develop -> unwrap
+    spscQueue<pipelineFrame> mMergeQueue; // unwrap -> merge
+    spscQueue<pipelineOutput> mWriteQueue; // merge -> write
+    spscQueue<Mat> mFrameQueue; // develop -> display
+    spscQueue<Mat> mProbeQueue; // unwrap -> display
+
+    boost::thread mDevelopThread, mUnwrapThread, mMergeThread, mWriteThread;
+
+    /****************/
+    // Methods
+    // Stage loops
+    void developLoop();
+    void unwrapLoop();
+    void mergeLoop();
+    void writeLoop();
+
+    // Called by the write stage once the HDRI of the bracket is written, or failed
+    void endBracket(unsigned long long pBracket, bool pSuccess);
+};
+}
+
+#endif // PIPELINE_H
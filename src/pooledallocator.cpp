@@ -0,0 +1,227 @@
+#include "pooledallocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace paper;
+
+// Size classes: four per octave from 4 KB, the last one for larger blocks
+#define POOL_CLASS_NBR 80
+// Blocks carved from the arenas, and size of the arenas
+#define POOL_ARENA_BLOCK (1 << 20)
+#define POOL_ARENA_SIZE (16 << 20)
+// Header before the data of each block, keeping the data aligned
+#define POOL_HEADER_SIZE 64
+
+namespace
+{
+struct blockHeader
+{
+    unsigned int blockClass;
+    int refcount;
+    size_t size; // of the data
+};
+
+/*******************************************/
+unsigned char* systemAllocate(size_t pSize)
+{
+    void* lBlock = NULL;
+    if(posix_memalign(&lBlock, POOL_HEADER_SIZE, pSize) != 0)
+        return NULL;
+    return (unsigned char*)lBlock;
+}
+}
+
+/*******************************************/
+pooledAllocator* pooledAllocator::get()
+{
+    // Never destroyed, as Mats may be released during the exit
+    static pooledAllocator* lAllocator = new pooledAllocator;
+    return lAllocator;
+}
+
+/*******************************************/
+pooledAllocator::pooledAllocator()
+{
+    mFreeBlocks.resize(POOL_CLASS_NBR);
+    mArena = NULL;
+    mArenaLeft = 0;
+    memset(&mStatistics, 0, sizeof(mStatistics));
+    mFrameStart = 0;
+    mFrameSystemStart = 0;
+}
+
+/*******************************************/
+void pooledAllocator::allocate(int pDims, const int* pSizes, int pType, int*& pRefcount, uchar*& pDataStart, uchar*& pData, size_t* pStep)
+{
+    size_t lSize = CV_ELEM_SIZE(pType);
+    for(int i=pDims-1; i>=0; i--)
+    {
+        if(pStep != NULL)
+            pStep[i] = lSize;
+        lSize *= pSizes[i];
+    }
+
+    unsigned int lClass = getClass(lSize + POOL_HEADER_SIZE);
+    unsigned char* lBlock = NULL;
+    {
+        boost::mutex::scoped_lock lLock(mMutex);
+
+        mStatistics.allocations++;
+        if(lClass < POOL_CLASS_NBR && mFreeBlocks[lClass].size() != 0)
+        {
+            lBlock = mFreeBlocks[lClass].back();
+            mFreeBlocks[lClass].pop_back();
+        }
+        else
+        {
+            lBlock = newBlock(lClass, lSize + POOL_HEADER_SIZE);
+            if(lBlock == NULL)
+                CV_Error(CV_StsNoMem, "Unable to allocate a pooled buffer");
+            mStatistics.systemAllocations++;
+        }
+
+        mStatistics.bytesInUse += lSize;
+        mStatistics.highWater = max(mStatistics.highWater, mStatistics.bytesInUse);
+    }
+
+    blockHeader* lHeader = (blockHeader*)lBlock;
+    lHeader->blockClass = lClass;
+    lHeader->refcount = 1;
+    lHeader->size = lSize;
+
+    pRefcount = &lHeader->refcount;
+    pDataStart = pData = lBlock + POOL_HEADER_SIZE;
+}
+
+/*******************************************/
+void pooledAllocator::deallocate(int* pRefcount, uchar* pDataStart, uchar* pData)
+{
+    if(pDataStart == NULL)
+        return;
+
+    unsigned char* lBlock = pDataStart - POOL_HEADER_SIZE;
+    blockHeader* lHeader = (blockHeader*)lBlock;
+
+    boost::mutex::scoped_lock lLock(mMutex);
+    mStatistics.bytesInUse -= lHeader->size;
+
+    if(lHeader->blockClass < POOL_CLASS_NBR)
+    {
+        mFreeBlocks[lHeader->blockClass].push_back(lBlock);
+    }
+    else
+    {
+        mStatistics.bytesReserved -= lHeader->size + POOL_HEADER_SIZE;
+        free(lBlock);
+    }
+}
+
+/*******************************************/
+allocatorStatistics pooledAllocator::getStatistics()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    return mStatistics;
+}
+
+/*******************************************/
+void pooledAllocator::markFrame()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    mStatistics.frames++;
+    mStatistics.frameAllocations = mStatistics.allocations - mFrameStart;
+    mStatistics.frameSystemAllocations = mStatistics.systemAllocations - mFrameSystemStart;
+    mFrameStart = mStatistics.allocations;
+    mFrameSystemStart = mStatistics.systemAllocations;
+}
+
+/*******************************************/
+void pooledAllocator::resetHighWater()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+    mStatistics.highWater = mStatistics.bytesInUse;
+}
+
+/*******************************************/
+void pooledAllocator::trim()
+{
+    boost::mutex::scoped_lock lLock(mMutex);
+
+    // Blocks of the arenas can not be freed one by one
+    for(unsigned int c=0; c<POOL_CLASS_NBR; c++)
+    {
+        if(getClassSize(c) <= POOL_ARENA_BLOCK)
+            continue;
+
+        for(unsigned int i=0; i<mFreeBlocks[c].size(); i++)
+            free(mFreeBlocks[c][i]);
+        mStatistics.bytesReserved -= mFreeBlocks[c].size()*getClassSize(c);
+        mFreeBlocks[c].clear();
+    }
+}
+
+/*******************************************/
+unsigned int pooledAllocator::getClass(size_t pSize)
+{
+    for(unsigned int c=0; c<POOL_CLASS_NBR; c++)
+    {
+        if(getClassSize(c) >= pSize)
+            return c;
+    }
+
+    return POOL_CLASS_NBR;
+}
+
+/*******************************************/
+size_t pooledAllocator::getClassSize(unsigned int pClass)
+{
+    return (size_t)(4 + pClass%4) << (10 + pClass/4);
+}
+
+/*******************************************/
+unsigned char* pooledAllocator::newBlock(unsigned int pClass, size_t pSize)
+{
+    // Blocks larger than the classes are not pooled
+    size_t lSize = pClass < POOL_CLASS_NBR ? getClassSize(pClass) : pSize;
+    if(lSize > POOL_ARENA_BLOCK)
+    {
+        unsigned char* lBlock = systemAllocate(lSize);
+        if(lBlock != NULL)
+            mStatistics.bytesReserved += lSize;
+        return lBlock;
+    }
+
+    // The end of the previous arena is left unused
+    if(mArenaLeft < lSize)
+    {
+        mArena = systemAllocate(POOL_ARENA_SIZE);
+        if(mArena == NULL)
+        {
+            mArenaLeft = 0;
+            return NULL;
+        }
+        mArenaLeft = POOL_ARENA_SIZE;
+        mStatistics.bytesReserved += POOL_ARENA_SIZE;
+    }
+
+    unsigned char* lBlock = mArena;
+    mArena += lSize;
+    mArenaLeft -= lSize;
+    return lBlock;
+}
+
+/*******************************************/
+Mat paper::pooledMat()
+{
+    Mat lMat;
+    lMat.allocator = pooledAllocator::get();
+    return lMat;
+}
+
+/*******************************************/
+Mat paper::pooledMat(Size pSize, int pType)
+{
+    Mat lMat = pooledMat();
+    lMat.create(pSize, pType);
+    return lMat;
+}
@@ -0,0 +1,79 @@
+// Allocator of the Mats of the live processing, so that once the buffers
+// of the first frames exist, processing a frame does not call the system
+// allocator anymore.
+// Released buffers are kept in free lists by size class (four classes per
+// octave, so at most 25% of a block is unused). Blocks up to 1 MB are carved
+// from 16 MB arenas, larger ones are allocated separately. Memory is only
+// given back to the system by trim, for the large free blocks.
+// OpenCV 2.4 has no default allocator to replace: a Mat uses the pool if it
+// is created from pooledMat, the functions writing into it then allocating
+// from the pool as well.
+
+#ifndef POOLEDALLOCATOR_H
+#define POOLEDALLOCATOR_H
+
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+struct allocatorStatistics
+{
+    unsigned long long allocations;
+    unsigned long long systemAllocations; // not served from a free block
+    unsigned long long frames; // marked with markFrame
+    // During the last frame, the steady state being reached when no system allocation happens
+    unsigned long long frameAllocations, frameSystemAllocations;
+    size_t bytesInUse; // by the Mats
+    size_t highWater; // most bytes in use at once, since the last reset
+    size_t bytesReserved; // from the system, including the free blocks and arenas
+};
+
+class pooledAllocator : public MatAllocator
+{
+public:
+    // Allocator shared by the whole process
+    static pooledAllocator* get();
+
+    void allocate(int pDims, const int* pSizes, int pType, int*& pRefcount, uchar*& pDataStart, uchar*& pData, size_t* pStep);
+    void deallocate(int* pRefcount, uchar* pDataStart, uchar* pData);
+
+    allocatorStatistics getStatistics();
+    // Starts the next frame, for the per frame counters
+    void markFrame();
+    void resetHighWater();
+    // Frees the large free blocks
+    void trim();
+
+private:
+    pooledAllocator();
+
+    /*****************/
+    // Attributes
+    boost::mutex mMutex;
+    vector<vector<unsigned char*> > mFreeBlocks; // by class
+    unsigned char* mArena; // current arena, and its unused bytes
+    size_t mArenaLeft;
+    allocatorStatistics mStatistics;
+    unsigned long long mFrameStart, mFrameSystemStart; // counters at the last mark
+
+    /****************/
+    // Methods
+    // Size class of a block of pSize bytes, and size of a class
+    static unsigned int getClass(size_t pSize);
+    static size_t getClassSize(unsigned int pClass);
+    // New block of the class from the system, or an arena. pSize is used
+    // for the blocks larger than the classes
+    unsigned char* newBlock(unsigned int pClass, size_t pSize);
+};
+
+// Mat allocated from the pool when it is created
+Mat pooledMat();
+Mat pooledMat(Size pSize, int pType);
+}
+
+#endif // POOLEDALLOCATOR_H
@@ -0,0 +1,159 @@
+// Projection policies used to build the sphere maps.
+// Each policy converts a normalized position on the output image
+// (u and v in [0, 1], from the top left corner) into a direction,
+// expressed in the chromed sphere frame: the sphere is centered on the
+// origin, the camera is on the -x axis, and z goes up.
+//
+// The direction facing the camera is at the center of the equirectangular
+// and angular maps, and on the -Z face of the cubemap. The cubemap and the
+// octahedral map use the usual OpenGL frame, with Y up and the camera
+// looking toward -Z.
+
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+
+namespace paper
+{
+enum projection
+{
+    eEquirectangular = 0,
+    eCubemap,
+    eOctahedral,
+    eAngular
+};
+
+/*******************************************/
+// Converts a direction from the OpenGL frame to the sphere frame
+inline Vec3f directionFromGL(float pX, float pY, float pZ)
+{
+    return Vec3f(pZ, -pX, pY);
+}
+
+/*******************************************/
+// Converts a direction from the sphere frame to the OpenGL frame
+inline Vec3f directionToGL(Vec3f pDirection)
+{
+    return Vec3f(-pDirection[1], pDirection[2], pDirection[0]);
+}
+
+/*******************************************/
+// Equirectangular projection, 2:1
+struct equirectangularProjection
+{
+    static Size defaultSize() {return Size(512, 256);}
+    // Output pixels per radian along the vertical axis
+    static float resolution(Size pSize) {return (float)pSize.height/M_PI;}
+
+    static inline bool direction(float pU, float pV, Vec3f& pDirection)
+    {
+        float lYaw = pU*2*M_PI;
+        float lPitch = M_PI_2 - pV*M_PI;
+        float lCosPitch = cosf(lPitch);
+        pDirection = Vec3f(lCosPitch*cosf(lYaw), lCosPitch*sinf(lYaw), sinf(lPitch));
+        return true;
+    }
+};
+
+/*******************************************/
+// Cubemap, as an horizontal strip of six square faces
+// in the OpenGL order: +X, -X, +Y, -Y, +Z, -Z
+struct cubemapProjection
+{
+    static Size defaultSize() {return Size(768, 128);}
+    static float resolution(Size pSize) {return (float)pSize.height/M_PI_2;}
+
+    static inline bool direction(float pU, float pV, Vec3f& pDirection)
+    {
+        int lFace = min((int)(pU*6.f), 5);
+        float lSc = 2.f*(pU*6.f-(float)lFace)-1.f;
+        float lTc = 2.f*pV-1.f;
+
+        switch(lFace)
+        {
+        case 0:
+            pDirection = directionFromGL(1.f, -lTc, -lSc);
+            break;
+        case 1:
+            pDirection = directionFromGL(-1.f, -lTc, lSc);
+            break;
+        case 2:
+            pDirection = directionFromGL(lSc, 1.f, lTc);
+            break;
+        case 3:
+            pDirection = directionFromGL(lSc, -1.f, -lTc);
+            break;
+        case 4:
+            pDirection = directionFromGL(lSc, -lTc, 1.f);
+            break;
+        default:
+            pDirection = directionFromGL(-lSc, -lTc, -1.f);
+        }
+
+        pDirection *= 1.f/sqrtf(pDirection.dot(pDirection));
+        return true;
+    }
+};
+
+/*******************************************/
+// Octahedral map, square. The upper hemisphere (+Y) is
+// in the inner diamond, the lower one is folded in the corners
+struct octahedralProjection
+{
+    static Size defaultSize() {return Size(256, 256);}
+    static float resolution(Size pSize) {return (float)pSize.width/(2*M_PI);}
+
+    static inline bool direction(float pU, float pV, Vec3f& pDirection)
+    {
+        float lX = 2.f*pU-1.f;
+        float lZ = 2.f*pV-1.f;
+        float lY = 1.f-fabsf(lX)-fabsf(lZ);
+
+        if(lY < 0.f)
+        {
+            float lTemp = lX;
+            lX = (1.f-fabsf(lZ))*(lX >= 0.f ? 1.f : -1.f);
+            lZ = (1.f-fabsf(lTemp))*(lZ >= 0.f ? 1.f : -1.f);
+        }
+
+        pDirection = directionFromGL(lX, lY, lZ);
+        pDirection *= 1.f/sqrtf(pDirection.dot(pDirection));
+        return true;
+    }
+};
+
+/*******************************************/
+// Angular map (as in Debevec's light probes), square.
+// The distance to the center is proportional to the angle
+// from the direction facing the camera
+struct angularProjection
+{
+    static Size defaultSize() {return Size(256, 256);}
+    static float resolution(Size pSize) {return (float)pSize.width/(2*M_PI);}
+
+    static inline bool direction(float pU, float pV, Vec3f& pDirection)
+    {
+        float lA = 2.f*pU-1.f;
+        float lB = 1.f-2.f*pV;
+        float lR = sqrtf(lA*lA+lB*lB);
+
+        if(lR > 1.f)
+            return false;
+        if(lR == 0.f)
+        {
+            pDirection = directionFromGL(0.f, 0.f, -1.f);
+            return true;
+        }
+
+        float lTheta = lR*M_PI;
+        float lSin = sinf(lTheta)/lR;
+        pDirection = directionFromGL(lA*lSin, lB*lSin, -cosf(lTheta));
+        return true;
+    }
+};
+}
+
+#endif // PROJECTION_H
@@ -0,0 +1,448 @@
+#include "scenegenerator.h"
+
+#include <stdio.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "rgbe.h"
+#include "scheduler.h"
+
+using namespace paper;
+
+// Fixed point iterations inverting the radial distortion, as cv::undistortPoints
+#define SCENE_UNDISTORT_ITERATIONS 8
+
+/*******************************************/
+// Value of the description, or pDefault if it is not given
+static float readValue(const FileStorage& pFile, const char* pName, float pDefault)
+{
+    FileNode lNode = pFile[pName];
+    return lNode.empty() ? pDefault : (float)lNode;
+}
+
+/*******************************************/
+sceneGenerator::sceneGenerator()
+{
+    mSize = Size(1280, 960);
+    mFOV = 52.8f*M_PI/180.f;
+    mAperture = 4.f;
+    mISO = 100.f;
+    mSphereDiameter = 50.8f;
+    mSphereDistance = 500.f;
+    mSphereCenter = Point2f(640.f, 480.f);
+    mSphereReflectance = 0.48f;
+    mK1 = 0.f;
+    mK2 = 0.f;
+    mNoise = 0.f;
+    mSeed = 0;
+    mSaturation = 255.f;
+    mSamples = 2;
+}
+
+/*******************************************/
+sceneGenerator::~sceneGenerator()
+{
+}
+
+/*******************************************/
+bool sceneGenerator::open(const char* pFile)
+{
+    FileStorage lFile;
+    lFile.open(pFile, FileStorage::READ);
+    if(!lFile.isOpened())
+    {
+        std::cerr << "Error while opening scene description file." << std::endl;
+        return false;
+    }
+
+    // The environment is relative to the description file
+    std::string lEnvironment;
+    lFile["environment"] >> lEnvironment;
+    boost::filesystem::path lPath(lEnvironment);
+    if(lPath.is_relative())
+        lPath = boost::filesystem::path(pFile).parent_path() / lPath;
+
+    Size lSize((int)readValue(lFile, "width", mSize.width), (int)readValue(lFile, "height", mSize.height));
+    setCamera(lSize, readValue(lFile, "FOV", mFOV*180.f/M_PI), readValue(lFile, "aperture", mAperture), readValue(lFile, "ISO", mISO));
+    setSphere(readValue(lFile, "sphereDiameter", mSphereDiameter), readValue(lFile, "sphereDistance", mSphereDistance),
+              Point2f(readValue(lFile, "sphereX", lSize.width/2.f), readValue(lFile, "sphereY", lSize.height/2.f)),
+              readValue(lFile, "reflectance", mSphereReflectance));
+
+    FileNode lDistortion = lFile["distortion"];
+    if(lDistortion.size() >= 2)
+        setDistortion((float)lDistortion[0], (float)lDistortion[1]);
+    setNoise(readValue(lFile, "noise", mNoise), (unsigned int)readValue(lFile, "seed", mSeed));
+    setSaturation(readValue(lFile, "saturation", mSaturation));
+    setSamples((unsigned int)readValue(lFile, "samples", mSamples));
+    if(!lFile["bayer"].empty())
+    {
+        std::string lPattern;
+        lFile["bayer"] >> lPattern;
+        setBayerPattern(lPattern);
+    }
+
+    mShutters.clear();
+    mGains.clear();
+    FileNode lFrames = lFile["frames"];
+    for(unsigned int i=0; i<lFrames.size(); i++)
+        addFrame((float)lFrames[i]["shutter"], (float)lFrames[i]["gain"]);
+    lFile.release();
+
+    return setEnvironment(lPath.string().c_str());
+}
+
+/*******************************************/
+bool sceneGenerator::setEnvironment(const char* pFile)
+{
+    FILE* lFile = fopen(pFile, "rb");
+    if(lFile == NULL)
+    {
+        std::cerr << "Error while opening environment " << pFile << std::endl;
+        return false;
+    }
+
+    int lWidth, lHeight;
+    Mat lEnvironment;
+    bool lResult = RGBE_ReadHeader(lFile, &lWidth, &lHeight, NULL) == RGBE_RETURN_SUCCESS;
+    if(lResult)
+    {
+        lEnvironment.create(lHeight, lWidth, CV_32FC3);
+        lResult = RGBE_ReadPixels_RLE(lFile, (float*)lEnvironment.data, lWidth, lHeight) == RGBE_RETURN_SUCCESS;
+    }
+    fclose(lFile);
+
+    if(!lResult)
+    {
+        std::cerr << "Error while reading environment " << pFile << std::endl;
+        return false;
+    }
+
+    setEnvironment(lEnvironment);
+    mEnvironmentFile = boost::filesystem::absolute(pFile).string();
+    return true;
+}
+
+/*******************************************/
+void sceneGenerator::setEnvironment(Mat pEnvironment)
+{
+    // Wrapped horizontally, so that the interpolation crosses the seam
+    copyMakeBorder(pEnvironment, mEnvironment, 0, 0, 1, 1, BORDER_WRAP);
+    mEnvironmentFile.clear();
+}
+
+/*******************************************/
+void sceneGenerator::setCamera(Size pSize, float pFOV, float pAperture, float pISO)
+{
+    mSize = pSize;
+    mFOV = pFOV*M_PI/180.f;
+    mAperture = pAperture;
+    mISO = pISO;
+}
+
+/*******************************************/
+void sceneGenerator::setSphere(float pDiameter, float pDistance, Point2f pCenter, float pReflectance)
+{
+    mSphereDiameter = pDiameter;
+    mSphereDistance = max(pDistance, pDiameter);
+    mSphereCenter = pCenter;
+    mSphereReflectance = pReflectance;
+}
+
+/*******************************************/
+void sceneGenerator::setDistortion(float pK1, float pK2)
+{
+    mK1 = pK1;
+    mK2 = pK2;
+}
+
+/*******************************************/
+void sceneGenerator::setNoise(float pDeviation, unsigned int pSeed)
+{
+    mNoise = pDeviation;
+    mSeed = pSeed;
+}
+
+/*******************************************/
+void sceneGenerator::setSaturation(float pLevel)
+{
+    mSaturation = pLevel;
+}
+
+/*******************************************/
+void sceneGenerator::setSamples(unsigned int pSamples)
+{
+    mSamples = max(pSamples, 1u);
+}
+
+/*******************************************/
+void sceneGenerator::setBayerPattern(const string& pPattern)
+{
+    mBayer = pPattern;
+}
+
+/*******************************************/
+void sceneGenerator::addFrame(float pShutter, float pGain)
+{
+    mShutters.push_back(pShutter);
+    mGains.push_back(pGain);
+}
+
+/*******************************************/
+Mat sceneGenerator::render()
+{
+    if(mEnvironment.rows == 0 || mSize.area() == 0)
+        return Mat();
+
+    // The map is computed in parallel, the environment is sampled by remap
+    Size lSize(mSize.width*mSamples, mSize.height*mSamples);
+    Mat lMap(lSize, CV_32FC2);
+    Mat lWeights(lSize, CV_32FC1);
+    scheduler::parallelFor(Range(0, lSize.height), boost::bind(&sceneGenerator::renderRows, this, lMap, lWeights, _1));
+
+    Mat lRadiance;
+    remap(mEnvironment, lRadiance, lMap, Mat(), INTER_LINEAR, BORDER_REPLICATE);
+
+    vector<Mat> lChannels(3, lWeights);
+    Mat lWeights3;
+    merge(lChannels, lWeights3);
+    multiply(lRadiance, lWeights3, lRadiance);
+
+    if(mSamples > 1)
+        resize(lRadiance, lRadiance, mSize, 0, 0, INTER_AREA);
+
+    return lRadiance;
+}
+
+/*******************************************/
+Mat sceneGenerator::expose(const Mat& pRadiance, float pEV, unsigned int pIndex)
+{
+    // Same response as assumed by hdriBuilder: 127 for a radiance of 2^EV
+    Mat lImage;
+    pRadiance.convertTo(lImage, CV_32FC3, 127.f/pow(2.f, pEV));
+
+    // Each frame has its own noise, the same from one run to the next
+    if(mNoise > 0.f)
+    {
+        Mat lNoise(lImage.size(), CV_32FC3);
+        RNG lRNG(((uint64)mSeed << 32) + pIndex + 1);
+        lRNG.fill(lNoise, RNG::NORMAL, Scalar::all(0.f), Scalar::all(mNoise));
+        lImage += lNoise;
+    }
+
+    if(mSaturation < 255.f)
+    {
+        Mat lSaturated;
+        Mat(lImage >= mSaturation).convertTo(lSaturated, CV_32FC3);
+        lImage = max(lImage, lSaturated);
+    }
+
+    Mat lFrame;
+    lImage.convertTo(lFrame, CV_8UC3);
+    cvtColor(lFrame, lFrame, CV_RGB2BGR);
+
+    return lFrame;
+}
+
+/*******************************************/
+float sceneGenerator::getEV(unsigned int pFrame)
+{
+    return log2(mAperture*mAperture*mShutters[pFrame]*100/mISO)-mGains[pFrame]/6.f;
+}
+
+/*******************************************/
+Vec3f sceneGenerator::getSphere()
+{
+    // Apparent radius of a centered sphere
+    float lRadius = getFocal()*tan(asin(mSphereDiameter/2.f/mSphereDistance));
+    return Vec3f(mSphereCenter.x, mSphereCenter.y, lRadius);
+}
+
+/*******************************************/
+bool sceneGenerator::generate(const char* pPrefix)
+{
+    Mat lRadiance = render();
+    if(lRadiance.rows == 0 || mShutters.size() == 0)
+        return false;
+
+    bayerPattern lPattern = eBayerRGGB;
+    if(mBayer.size() != 0 && !bayerPatternFromString(mBayer, lPattern))
+    {
+        std::cerr << "Unknown Bayer pattern " << mBayer << std::endl;
+        return false;
+    }
+
+    // The frames are exposed and encoded in parallel
+    std::string lName = boost::filesystem::path(pPrefix).filename().string();
+    vector<int> lWritten(mShutters.size(), 0);
+    {
+        taskGroup lWrites;
+        for(unsigned int i=0; i<mShutters.size(); i++)
+        {
+            char lFile[16];
+            snprintf(lFile, sizeof(lFile), "_%02u.png", i);
+            lWrites.run(boost::bind(&sceneGenerator::writeFrame, this, lRadiance, i, std::string(pPrefix) + lFile, &lWritten[i]));
+        }
+    }
+
+    for(unsigned int i=0; i<lWritten.size(); i++)
+    {
+        if(!lWritten[i])
+        {
+            std::cerr << "Error while writing frame " << i << std::endl;
+            return false;
+        }
+    }
+
+    // Replay description, followed by the ground truth. It can also be used
+    // as a description to generate the same frames again
+    FileStorage lFile(std::string(pPrefix) + ".yml", FileStorage::WRITE);
+    if(!lFile.isOpened())
+        return false;
+
+    lFile << "source" << lName + "_%02d.png";
+    lFile << "frameRate" << 7.5f;
+    lFile << "latency" << 0;
+    if(mBayer.size() != 0)
+        lFile << "bayer" << mBayer;
+    lFile << "frames" << "[";
+    for(unsigned int i=0; i<mShutters.size(); i++)
+        lFile << "{:" << "shutter" << mShutters[i] << "gain" << mGains[i] << "}";
+    lFile << "]";
+
+    Vec3f lSphere = getSphere();
+    lFile << "environment" << mEnvironmentFile;
+    lFile << "width" << mSize.width << "height" << mSize.height;
+    lFile << "FOV" << (float)(mFOV*180.f/M_PI) << "aperture" << mAperture << "ISO" << mISO;
+    lFile << "sphereDiameter" << mSphereDiameter << "sphereDistance" << mSphereDistance;
+    lFile << "sphereX" << mSphereCenter.x << "sphereY" << mSphereCenter.y << "reflectance" << mSphereReflectance;
+    lFile << "sphere" << "[:" << lSphere[0] << lSphere[1] << lSphere[2] << "]";
+    lFile << "distortion" << "[:" << mK1 << mK2 << "]";
+    lFile << "noise" << mNoise << "seed" << (int)mSeed << "saturation" << mSaturation << "samples" << (int)mSamples;
+    lFile << "ev" << "[:";
+    for(unsigned int i=0; i<mShutters.size(); i++)
+        lFile << getEV(i);
+    lFile << "]";
+
+    // Camera matrix and distortion, for camera::setCalibration
+    if(mK1 != 0.f || mK2 != 0.f)
+    {
+        lFile << "calibration" << lName + "_calibration.xml";
+
+        Mat lCameraMat = (Mat_<double>(3, 3) << getFocal(), 0.0, mSize.width/2.0, 0.0, getFocal(), mSize.height/2.0, 0.0, 0.0, 1.0);
+        Mat lDistortionMat = (Mat_<double>(5, 1) << mK1, mK2, 0.0, 0.0, 0.0);
+        FileStorage lCalibration(std::string(pPrefix) + "_calibration.xml", FileStorage::WRITE);
+        if(!lCalibration.isOpened())
+            return false;
+        lCalibration << "Camera_Matrix" << lCameraMat;
+        lCalibration << "Distortion_Coefficients" << lDistortionMat;
+    }
+
+    return true;
+}
+
+/*******************************************/
+float sceneGenerator::getFocal()
+{
+    return (float)mSize.width/2.f/tan(mFOV/2.f);
+}
+
+/*******************************************/
+void sceneGenerator::renderRows(Mat pMap, Mat pWeights, const Range& pRows)
+{
+    float lFocal = getFocal();
+    float lSamples = (float)mSamples;
+    float lEnvWidth = (float)(mEnvironment.cols-2);
+    float lEnvHeight = (float)mEnvironment.rows;
+    bool lDistorted = mK1 != 0.f || mK2 != 0.f;
+
+    // Camera frame: x toward the scene, y to the right of the image, z up.
+    // The sphere frame has its x axis from the camera to the center of the
+    // sphere, and z up, as the frame of chromedSphere
+    Vec3f lCenter(1.f, (mSphereCenter.x-mSize.width/2.f)/lFocal, -(mSphereCenter.y-mSize.height/2.f)/lFocal);
+    Vec3f lX = lCenter*(1.f/sqrtf(lCenter.dot(lCenter)));
+    lCenter = lX*mSphereDistance;
+    Vec3f lZ = Vec3f(0.f, 0.f, 1.f) - lX*lX[2];
+    lZ *= 1.f/sqrtf(lZ.dot(lZ));
+    Vec3f lY = lZ.cross(lX);
+
+    float lRadius = mSphereDiameter/2.f;
+    float lC = lCenter.dot(lCenter) - lRadius*lRadius;
+
+    for(int y=pRows.start; y<pRows.end; y++)
+    {
+        Vec2f* lMapRow = pMap.ptr<Vec2f>(y);
+        float* lWeightRow = pWeights.ptr<float>(y);
+        float lYd = (((float)y+0.5f)/lSamples - mSize.height/2.f)/lFocal;
+
+        for(int x=0; x<pMap.cols; x++)
+        {
+            // Pixels are distorted: the ray is the one of the undistorted position
+            float lXd = (((float)x+0.5f)/lSamples - mSize.width/2.f)/lFocal;
+            float lXu = lXd;
+            float lYu = lYd;
+            for(int i=0; lDistorted && i<SCENE_UNDISTORT_ITERATIONS; i++)
+            {
+                float lR2 = lXu*lXu + lYu*lYu;
+                float lFactor = 1.f/(1.f + mK1*lR2 + mK2*lR2*lR2);
+                lXu = lXd*lFactor;
+                lYu = lYd*lFactor;
+            }
+
+            Vec3f lRay(1.f, lXu, -lYu);
+            lRay *= 1.f/sqrtf(lRay.dot(lRay));
+
+            // Rays hitting the sphere are reflected, the others see the environment
+            Vec3f lDirection = lRay;
+            lWeightRow[x] = 1.f;
+            float lB = lRay.dot(lCenter);
+            float lDiscriminant = lB*lB - lC;
+            if(lDiscriminant >= 0.f && lB > 0.f)
+            {
+                Vec3f lNormal = (lRay*(lB - sqrtf(lDiscriminant)) - lCenter)*(1.f/lRadius);
+                lDirection = lRay - lNormal*(2.f*lRay.dot(lNormal));
+                lWeightRow[x] = mSphereReflectance;
+            }
+
+            // Inverse of equirectangularProjection::direction
+            float lYaw = atan2f(lDirection.dot(lY), lDirection.dot(lX));
+            if(lYaw < 0.f)
+                lYaw += 2*M_PI;
+            float lPitch = asinf(min(max(lDirection.dot(lZ), -1.f), 1.f));
+
+            lMapRow[x] = Vec2f(lYaw/(2*M_PI)*lEnvWidth + 0.5f, (M_PI_2 - lPitch)/M_PI*lEnvHeight - 0.5f);
+        }
+    }
+}
+
+/*******************************************/
+void sceneGenerator::writeFrame(Mat pRadiance, unsigned int pIndex, string pFile, int* pResult)
+{
+    // Run as a task: an exception (imwrite with an unknown extension for
+    // example) would end the process, it is reported through pResult instead
+    try
+    {
+        Mat lFrame = expose(pRadiance, getEV(pIndex), pIndex);
+
+        // Raw frames keep one channel per pixel, as the camera delivers them
+        if(mBayer.size() != 0)
+        {
+            bayerPattern lPattern;
+            bayerPatternFromString(mBayer, lPattern);
+            Mat lRaw;
+            mosaic(lFrame, lRaw, lPattern);
+            lFrame = lRaw;
+        }
+
+        *pResult = imwrite(pFile, lFrame) ? 1 : 0;
+    }
+    catch(cv::Exception& e)
+    {
+        std::cerr << "Error while writing " << pFile << ": " << e.err << std::endl;
+        *pResult = 0;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Error while writing " << pFile << ": " << e.what() << std::endl;
+        *pResult = 0;
+    }
+}
@@ -0,0 +1,102 @@
+// Synthetic brackets of a chromed sphere, rendered from a known
+// equirectangular HDR environment, as ground truth for the unwrapping and
+// the merge. The camera is a pinhole with optional radial distortion, the
+// sphere a perfect mirror of the given reflectance. The environment is
+// oriented as the probes unwrapped by chromedSphere: its center faces the
+// camera, and its top is up in the camera image.
+//
+// Frames are exposed as the camera would with the same shutter, gain,
+// aperture and ISO (see camera::getEV), with gamma 1, and written as 8 bits
+// images along with a replay description (see camera::setReplaySource),
+// which also holds the ground truth.
+//
+// Generation description, in a FileStorage file:
+//   environment: Radiance HDRI, relative to the description
+//   width, height, FOV (horizontal, in degrees): camera
+//   sphereDiameter, sphereDistance (from the camera to the center, in mm),
+//   sphereX, sphereY (center in the undistorted image, in pixels), reflectance
+//   aperture, ISO, frames: [{shutter, gain}]
+//   distortion: [k1, k2], noise (standard deviation, in 8 bits levels),
+//   saturation (level from which pixels are white), samples (per pixel
+//   along each axis), seed, bayer (writes raw frames with this pattern)
+
+#ifndef SCENEGENERATOR_H
+#define SCENEGENERATOR_H
+
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "demosaic.h"
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+class sceneGenerator
+{
+public:
+    sceneGenerator();
+    ~sceneGenerator();
+
+    // Reads a generation description
+    bool open(const char* pFile);
+
+    // Radiance environment, RGB float
+    bool setEnvironment(const char* pFile);
+    void setEnvironment(Mat pEnvironment);
+    void setCamera(Size pSize, float pFOV, float pAperture = 4.f, float pISO = 100.f);
+    void setSphere(float pDiameter, float pDistance, Point2f pCenter, float pReflectance = 0.48f);
+    void setDistortion(float pK1, float pK2);
+    void setNoise(float pDeviation, unsigned int pSeed = 0);
+    void setSaturation(float pLevel);
+    void setSamples(unsigned int pSamples);
+    void setBayerPattern(const string& pPattern); // empty for BGR frames
+    void addFrame(float pShutter, float pGain = 0.f);
+
+    // Radiance seen by the camera, RGB float
+    Mat render();
+    // 8 bits BGR frame exposed at pEV, with noise and saturation
+    Mat expose(const Mat& pRadiance, float pEV, unsigned int pIndex);
+    float getEV(unsigned int pFrame);
+
+    // Position and radius of the sphere in the undistorted image, in pixels
+    Vec3f getSphere();
+
+    // Writes the frames as pPrefix_00.png... and the description as pPrefix.yml,
+    // and pPrefix_calibration.xml for a distorted camera
+    bool generate(const char* pPrefix);
+
+private:
+    /*****************/
+    // Attributes
+    Mat mEnvironment; // with one column wrapped on each side
+    string mEnvironmentFile;
+    Size mSize;
+    float mFOV; // in radians
+    float mAperture, mISO;
+    float mSphereDiameter, mSphereDistance, mSphereReflectance;
+    Point2f mSphereCenter;
+    float mK1, mK2;
+    float mNoise;
+    unsigned int mSeed;
+    float mSaturation;
+    unsigned int mSamples;
+    string mBayer;
+    vector<float> mShutters, mGains;
+
+    /****************/
+    // Methods
+    // Focal length in pixels
+    float getFocal();
+    // Fills the rows of the map from the supersampled camera image to the environment,
+    // and the weight of each pixel (the reflectance on the sphere)
+    void renderRows(Mat pMap, Mat pWeights, const Range& pRows);
+    // Exposes and writes a frame, pResult being set to 1 on success and 0 on
+    // any error, exceptions included
+    void writeFrame(Mat pRadiance, unsigned int pIndex, string pFile, int* pResult);
+};
+}
+
+#endif // SCENEGENERATOR_H
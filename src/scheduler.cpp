@@ -0,0 +1,538 @@
+#include "scheduler.h"
+
+#include <deque>
+#include <stdio.h>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "trace.h"
+
+using namespace paper;
+
+// Tasks per thread of a parallel loop, for the load to balance
+#define SCHEDULER_STRIPES_PER_THREAD 4
+// Most NUMA nodes looked for
+#define SCHEDULER_MAX_NODES 64
+
+namespace
+{
+struct task
+{
+    boost::function<void()> function;
+    taskCounter* counter;
+};
+
+struct worker
+{
+    boost::mutex mutex; // protects tasks
+    std::deque<task> tasks;
+    unsigned int node;
+    std::vector<int> cpus; // the worker is kept on those, any if empty
+    boost::thread thread;
+};
+
+boost::mutex gConfigMutex;
+volatile bool gStarted = false;
+schedulerSettings gSettings;
+unsigned int gThreadNbr = 1;
+std::vector<worker*> gWorkers;
+int gOpenCVThreads = -1; // OpenCV's thread count before the workers were started
+
+volatile bool gStopping = false;
+volatile int gQueued = 0; // tasks in all the deques
+volatile unsigned int gNextWorker = 0; // deque receiving the tasks of the other threads
+
+// Workers sleep until a task is queued, waiting threads until their tasks end
+boost::mutex gSleepMutex;
+boost::condition_variable gWorkCondition;
+boost::condition_variable gDoneCondition;
+
+// Index of the worker running the calling thread, -1 for the other threads
+__thread int gWorkerIndex = -1;
+
+/*******************************************/
+// CPUs of a node, from a list as "0-3,8-11"
+std::vector<int> readCPUList(const char* pFile)
+{
+    std::vector<int> lCPUs;
+    FILE* lFile = fopen(pFile, "r");
+    if(lFile == NULL)
+        return lCPUs;
+
+    int lFirst, lLast;
+    char lSeparator;
+    while(fscanf(lFile, "%d", &lFirst) == 1)
+    {
+        lLast = lFirst;
+        if(fscanf(lFile, "%c", &lSeparator) == 1 && lSeparator == '-')
+        {
+            if(fscanf(lFile, "%d", &lLast) != 1)
+                break;
+            fscanf(lFile, "%c", &lSeparator);
+        }
+
+        for(int i=lFirst; i<=lLast; i++)
+            lCPUs.push_back(i);
+        if(lSeparator != ',')
+            break;
+    }
+
+    fclose(lFile);
+    return lCPUs;
+}
+
+/*******************************************/
+// CPUs of each NUMA node, empty if the system has none
+std::vector<std::vector<int> > readNodes()
+{
+    std::vector<std::vector<int> > lNodes;
+    for(unsigned int i=0; i<SCHEDULER_MAX_NODES; i++)
+    {
+        char lFile[128];
+        snprintf(lFile, sizeof(lFile), "/sys/devices/system/node/node%u/cpulist", i);
+        std::vector<int> lCPUs = readCPUList(lFile);
+        if(lCPUs.size() != 0)
+            lNodes.push_back(lCPUs);
+    }
+
+    return lNodes;
+}
+
+/*******************************************/
+// Takes the newest task of pWorker, or steals the oldest of another worker,
+// one of the same node first
+bool popTask(int pWorker, task& pTask)
+{
+    if(gQueued == 0 || gWorkers.size() == 0)
+        return false;
+
+    if(pWorker >= 0)
+    {
+        worker* lWorker = gWorkers[pWorker];
+        boost::mutex::scoped_lock lLock(lWorker->mutex);
+        if(lWorker->tasks.size() != 0)
+        {
+            pTask = lWorker->tasks.back();
+            lWorker->tasks.pop_back();
+            __sync_fetch_and_sub(&gQueued, 1);
+            return true;
+        }
+    }
+
+    unsigned int lFirst = pWorker >= 0 ? pWorker+1 : 0;
+    for(int lSameNode=1; lSameNode>=0; lSameNode--)
+    {
+        for(unsigned int i=0; i<gWorkers.size(); i++)
+        {
+            unsigned int lIndex = (lFirst+i) % gWorkers.size();
+            if((int)lIndex == pWorker)
+                continue;
+            worker* lVictim = gWorkers[lIndex];
+            if(pWorker >= 0 && (lVictim->node == gWorkers[pWorker]->node) != (lSameNode == 1))
+                continue;
+
+            boost::mutex::scoped_lock lLock(lVictim->mutex);
+            if(lVictim->tasks.size() != 0)
+            {
+                pTask = lVictim->tasks.front();
+                lVictim->tasks.pop_front();
+                __sync_fetch_and_sub(&gQueued, 1);
+                return true;
+            }
+        }
+
+        // Threads which are not workers have no node
+        if(pWorker < 0)
+            break;
+    }
+
+    return false;
+}
+
+/*******************************************/
+// Takes the oldest queued task counted in pTasks, for the threads which
+// are not workers: they only help with their own tasks, as another task
+// could take locks they hold
+bool popGroupTask(taskCounter* pTasks, task& pTask)
+{
+    if(gQueued == 0)
+        return false;
+
+    for(unsigned int i=0; i<gWorkers.size(); i++)
+    {
+        worker* lWorker = gWorkers[i];
+        boost::mutex::scoped_lock lLock(lWorker->mutex);
+        for(std::deque<task>::iterator lTask = lWorker->tasks.begin(); lTask != lWorker->tasks.end(); lTask++)
+        {
+            if(lTask->counter != pTasks)
+                continue;
+
+            pTask = *lTask;
+            lWorker->tasks.erase(lTask);
+            __sync_fetch_and_sub(&gQueued, 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*******************************************/
+// Keeps the exception being handled, if it is the first one of pTasks.
+// To call from a catch block
+void keepException(taskCounter* pTasks)
+{
+    Exception lError;
+    try
+    {
+        throw;
+    }
+    catch(Exception& e)
+    {
+        lError = e;
+    }
+    catch(std::exception& e)
+    {
+        lError = Exception(CV_StsError, e.what(), "task", __FILE__, __LINE__);
+    }
+    catch(...)
+    {
+        lError = Exception(CV_StsError, "unknown exception", "task", __FILE__, __LINE__);
+    }
+
+    if(__sync_bool_compare_and_swap(&pTasks->failed, 0, 1))
+        pTasks->error = lError;
+}
+
+/*******************************************/
+void runTask(task& pTask)
+{
+    // An exception must not leave a worker, it is thrown by the waiting thread
+    try
+    {
+        pTask.function();
+    }
+    catch(...)
+    {
+        keepException(pTask.counter);
+    }
+
+    if(__sync_sub_and_fetch(&pTask.counter->pending, 1) == 0)
+    {
+        boost::mutex::scoped_lock lLock(gSleepMutex);
+        gDoneCondition.notify_all();
+    }
+}
+
+/*******************************************/
+void workerLoop(unsigned int pIndex)
+{
+    gWorkerIndex = pIndex;
+    trace::setThreadName("worker");
+
+    worker* lWorker = gWorkers[pIndex];
+    if(lWorker->cpus.size() != 0)
+    {
+        cpu_set_t lSet;
+        CPU_ZERO(&lSet);
+        for(unsigned int i=0; i<lWorker->cpus.size(); i++)
+            CPU_SET(lWorker->cpus[i], &lSet);
+        pthread_setaffinity_np(pthread_self(), sizeof(lSet), &lSet);
+    }
+
+    while(!gStopping)
+    {
+        task lTask;
+        if(popTask(pIndex, lTask))
+        {
+            runTask(lTask);
+            continue;
+        }
+
+        boost::mutex::scoped_lock lLock(gSleepMutex);
+        while(gQueued == 0 && !gStopping)
+            gWorkCondition.wait(lLock);
+    }
+}
+
+/*******************************************/
+void startWorkers()
+{
+    gThreadNbr = gSettings.threads;
+    if(gThreadNbr == 0)
+        gThreadNbr = std::max(boost::thread::hardware_concurrency(), 1u);
+
+    // The thread waiting for a parallel loop runs its part of it, so one
+    // worker less than the budget is needed
+    std::vector<std::vector<int> > lNodes;
+    if(gSettings.numa)
+        lNodes = readNodes();
+    unsigned int lCPUNbr = std::max(boost::thread::hardware_concurrency(), 1u);
+
+    for(unsigned int i=0; i+1<gThreadNbr; i++)
+    {
+        worker* lWorker = new worker;
+        lWorker->node = 0;
+
+        // Workers alternate between the nodes, so that each one gets its share
+        if(lNodes.size() > 1)
+        {
+            lWorker->node = i % lNodes.size();
+            const std::vector<int>& lCPUs = lNodes[lWorker->node];
+            if(gSettings.affinity)
+                lWorker->cpus.push_back(lCPUs[(i/lNodes.size()) % lCPUs.size()]);
+            else
+                lWorker->cpus = lCPUs;
+        }
+        else if(gSettings.affinity)
+        {
+            lWorker->cpus.push_back(i % lCPUNbr);
+        }
+
+        gWorkers.push_back(lWorker);
+    }
+
+    for(unsigned int i=0; i<gWorkers.size(); i++)
+        gWorkers[i]->thread = boost::thread(&workerLoop, i);
+
+    // OpenCV's own pool gets what the workers leave of the budget, that is
+    // its functions run in the calling thread. Otherwise both pools would
+    // run at once, up to twice the budget
+    gOpenCVThreads = getNumThreads();
+    setNumThreads((int)(gThreadNbr - gWorkers.size()));
+}
+
+/*******************************************/
+void stopWorkers()
+{
+    {
+        boost::mutex::scoped_lock lLock(gSleepMutex);
+        gStopping = true;
+        gWorkCondition.notify_all();
+    }
+
+    for(unsigned int i=0; i<gWorkers.size(); i++)
+        gWorkers[i]->thread.join();
+
+    // Tasks still queued are run here, so that nobody waits for them forever
+    task lTask;
+    while(popTask(-1, lTask))
+        runTask(lTask);
+
+    for(unsigned int i=0; i<gWorkers.size(); i++)
+        delete gWorkers[i];
+    gWorkers.clear();
+
+    gThreadNbr = 1;
+    setNumThreads(gOpenCVThreads);
+    gStopping = false;
+}
+
+/*******************************************/
+void runBody(const ParallelLoopBody* pBody, Range pRange)
+{
+    (*pBody)(pRange);
+}
+
+/*******************************************/
+// Adapter for the functions given to parallelFor
+class functionBody : public ParallelLoopBody
+{
+public:
+    functionBody(const boost::function<void(const Range&)>& pFunction)
+        : mFunction(pFunction) {}
+
+    void operator()(const Range& pRange) const
+    {
+        mFunction(pRange);
+    }
+
+private:
+    const boost::function<void(const Range&)>& mFunction;
+};
+}
+
+/*******************************************/
+schedulerSettings::schedulerSettings()
+{
+    threads = 0;
+    affinity = false;
+    numa = false;
+}
+
+/*******************************************/
+taskCounter::taskCounter()
+{
+    pending = 0;
+    failed = 0;
+}
+
+/*******************************************/
+taskGroup::taskGroup()
+{
+}
+
+/*******************************************/
+taskGroup::~taskGroup()
+{
+    try
+    {
+        wait();
+    }
+    catch(...)
+    {
+    }
+}
+
+/*******************************************/
+void taskGroup::run(const boost::function<void()>& pTask)
+{
+    scheduler::submit(pTask, &mTasks);
+}
+
+/*******************************************/
+void taskGroup::wait()
+{
+    scheduler::wait(&mTasks);
+}
+
+/*******************************************/
+void scheduler::configure(const schedulerSettings& pSettings)
+{
+    boost::mutex::scoped_lock lLock(gConfigMutex);
+    if(gStarted)
+        stopWorkers();
+
+    gSettings = pSettings;
+    startWorkers();
+    gStarted = true;
+}
+
+/*******************************************/
+void scheduler::stop()
+{
+    boost::mutex::scoped_lock lLock(gConfigMutex);
+    if(!gStarted)
+        return;
+
+    stopWorkers();
+    gStarted = false;
+}
+
+/*******************************************/
+unsigned int scheduler::getThreadNbr()
+{
+    return gThreadNbr;
+}
+
+/*******************************************/
+void scheduler::parallelFor(const Range& pRange, const ParallelLoopBody& pBody, double pStripes)
+{
+    int lLength = pRange.end - pRange.start;
+    if(lLength <= 0)
+        return;
+
+    unsigned int lStripes = pStripes > 0.0 ? (unsigned int)pStripes : getThreadNbr()*SCHEDULER_STRIPES_PER_THREAD;
+    lStripes = std::min(lStripes, (unsigned int)lLength);
+    if(lStripes <= 1 || getThreadNbr() <= 1)
+    {
+        pBody(pRange);
+        return;
+    }
+
+    // The first stripe is run by this thread, while the others are stolen.
+    // Until they are all done, they use pBody and lTasks: an exception is
+    // only thrown after
+    taskCounter lTasks;
+    try
+    {
+        for(unsigned int i=1; i<lStripes; i++)
+        {
+            Range lStripe(pRange.start + (int)((long long)lLength*i/lStripes), pRange.start + (int)((long long)lLength*(i+1)/lStripes));
+            submit(boost::bind(&runBody, &pBody, lStripe), &lTasks);
+        }
+
+        pBody(Range(pRange.start, pRange.start + lLength/lStripes));
+    }
+    catch(...)
+    {
+        keepException(&lTasks);
+    }
+
+    wait(&lTasks);
+}
+
+/*******************************************/
+void scheduler::parallelFor(const Range& pRange, const boost::function<void(const Range&)>& pBody, double pStripes)
+{
+    functionBody lBody(pBody);
+    parallelFor(pRange, lBody, pStripes);
+}
+
+/*******************************************/
+void scheduler::submit(const boost::function<void()>& pTask, taskCounter* pTasks)
+{
+    task lTask;
+    lTask.function = pTask;
+    lTask.counter = pTasks;
+    __sync_fetch_and_add(&pTasks->pending, 1);
+
+    // Without workers, not configured or stopped, the caller runs its tasks
+    if(gWorkers.size() == 0)
+    {
+        runTask(lTask);
+        return;
+    }
+
+    // Workers keep their tasks, other threads spread them
+    int lIndex = gWorkerIndex;
+    if(lIndex < 0)
+        lIndex = __sync_fetch_and_add(&gNextWorker, 1) % gWorkers.size();
+
+    try
+    {
+        boost::mutex::scoped_lock lLock(gWorkers[lIndex]->mutex);
+        gWorkers[lIndex]->tasks.push_back(lTask);
+    }
+    catch(...)
+    {
+        __sync_fetch_and_sub(&pTasks->pending, 1);
+        throw;
+    }
+    __sync_fetch_and_add(&gQueued, 1);
+
+    boost::mutex::scoped_lock lLock(gSleepMutex);
+    gWorkCondition.notify_one();
+}
+
+/*******************************************/
+void scheduler::wait(taskCounter* pTasks)
+{
+    traceScope lTrace("wait tasks");
+
+    while(pTasks->pending != 0)
+    {
+        task lTask;
+        bool lFound = gWorkerIndex >= 0 ? popTask(gWorkerIndex, lTask) : popGroupTask(pTasks, lTask);
+        if(lFound)
+        {
+            runTask(lTask);
+            continue;
+        }
+
+        boost::mutex::scoped_lock lLock(gSleepMutex);
+        if(pTasks->pending != 0)
+            gDoneCondition.wait(lLock);
+    }
+
+    // The counter can be used again once the exception is thrown
+    if(pTasks->failed)
+    {
+        Exception lError = pTasks->error;
+        pTasks->failed = 0;
+        throw lError;
+    }
+}
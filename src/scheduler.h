@@ -0,0 +1,86 @@
+// Work-stealing scheduler shared by the parallel parts of the processing
+// (demosaicing, color correction, map construction, merge, encoding), so
+// that together they stay within a budget of threads instead of each one
+// starting its own.
+// Each worker has a deque of tasks: it runs the newest of its own tasks,
+// and when it has none, steals the oldest ones of the other workers, those
+// of its NUMA node first. A worker waiting for its tasks runs queued tasks
+// meanwhile, so parallel loops can be nested or called from a task. Other
+// threads only run their own tasks while waiting, as they may hold locks.
+// The workers are only started by configure: until then, as in a program
+// embedding the library which does not configure it, tasks are run by the
+// threads submitting them. Once started, OpenCV's own parallel functions
+// run in the calling thread, for the two pools to stay within the budget.
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <opencv2/opencv.hpp>
+#include <boost/function.hpp>
+
+using namespace cv;
+
+namespace paper
+{
+struct schedulerSettings
+{
+    schedulerSettings();
+
+    unsigned int threads; // threads running tasks at once, including the waiting one. 0 for one per CPU
+    bool affinity; // pins each worker to a CPU
+    bool numa; // spreads the workers over the NUMA nodes, each one staying on its node
+};
+
+// Tasks waited for together: the number still pending, and the first
+// exception one of them threw
+struct taskCounter
+{
+    taskCounter();
+
+    volatile int pending;
+    volatile int failed;
+    Exception error; // if failed
+};
+
+class taskGroup
+{
+public:
+    taskGroup();
+    // Waits for the tasks, dropping their exception
+    ~taskGroup();
+
+    void run(const boost::function<void()>& pTask);
+    // Throws the first exception of the tasks, see scheduler::wait
+    void wait();
+
+private:
+    taskCounter mTasks;
+};
+
+class scheduler
+{
+public:
+    // Replaces the workers, once at startup from main, or from
+    // hdrc_scheduler_configure. Must be called while no task is running
+    static void configure(const schedulerSettings& pSettings);
+    // Stops the workers, once they have run the queued tasks, and restores
+    // OpenCV's thread count. Tasks are then run by the submitting threads
+    static void stop();
+
+    static unsigned int getThreadNbr();
+
+    // Same as cv::parallel_for_, on the workers. pStripes is the number of
+    // tasks the range is split into, by default a few per thread.
+    // An exception of the body is thrown once all the stripes are done
+    static void parallelFor(const Range& pRange, const ParallelLoopBody& pBody, double pStripes = -1.0);
+    static void parallelFor(const Range& pRange, const boost::function<void(const Range&)>& pBody, double pStripes = -1.0);
+
+    // Queues a task, counted in pTasks until its end, and waits for the
+    // tasks of pTasks. An exception of a task is kept, and thrown by wait
+    // as a cv::Exception, once none of them is running anymore
+    static void submit(const boost::function<void()>& pTask, taskCounter* pTasks);
+    static void wait(taskCounter* pTasks);
+};
+}
+
+#endif // SCHEDULER_H
@@ -0,0 +1,110 @@
+#include "settledetector.h"
+
+using namespace paper;
+
+// Range of the values considered as well exposed
+#define SETTLE_MIN_VALUE 8
+#define SETTLE_MAX_VALUE 247
+// Minimum number of valid samples to decide
+#define SETTLE_MIN_SAMPLES 64
+
+/*******************************************/
+settleDetector::settleDetector()
+{
+    mTolerance = 0.3f;
+    mStep = 8;
+    mReferenceEV = 0.f;
+    mReferenceType = CV_8UC3;
+}
+
+/*******************************************/
+settleDetector::~settleDetector()
+{
+}
+
+/*******************************************/
+void settleDetector::setTolerance(float pStops)
+{
+    mTolerance = max(pStops, 0.01f);
+}
+
+/*******************************************/
+void settleDetector::setSubsampling(unsigned int pStep)
+{
+    mStep = max(pStep, 1u);
+}
+
+/*******************************************/
+void settleDetector::setReference(const Mat& pFrame, float pEV)
+{
+    mReference.clear();
+    mReferenceSize = Size(0, 0);
+    mReferenceEV = pEV;
+
+    if(pFrame.rows == 0 || (pFrame.type() != CV_8UC3 && pFrame.type() != CV_8UC1))
+        return;
+
+    sample(pFrame, mReference);
+    mReferenceSize = pFrame.size();
+    mReferenceType = pFrame.type();
+}
+
+/*******************************************/
+settleDetector::result settleDetector::check(const Mat& pFrame, float pEV)
+{
+    if(pFrame.size() != mReferenceSize || pFrame.type() != mReferenceType || mReference.size() == 0)
+        return eUndecided;
+
+    // A change smaller than the tolerance can't be told from noise
+    float lExpected = mReferenceEV - pEV;
+    if(fabs(lExpected) < mTolerance)
+        return eUndecided;
+
+    vector<unsigned char> lSamples;
+    sample(pFrame, lSamples);
+
+    // Values expected in the new frame have to be well exposed too
+    float lRatio = pow(2.f, lExpected);
+    float lMin = max((float)SETTLE_MIN_VALUE, (float)SETTLE_MIN_VALUE/lRatio);
+    float lMax = min((float)SETTLE_MAX_VALUE, (float)SETTLE_MAX_VALUE/lRatio);
+
+    unsigned int lCount = 0;
+    double lReferenceSum = 0.0, lSum = 0.0;
+    for(unsigned int i=0; i<lSamples.size(); i++)
+    {
+        float lValue = (float)mReference[i];
+        if(lValue < lMin || lValue > lMax)
+            continue;
+
+        lReferenceSum += lValue;
+        lSum += lSamples[i];
+        lCount++;
+    }
+
+    if(lCount < SETTLE_MIN_SAMPLES || lSum <= 0.0)
+        return eUndecided;
+
+    float lMeasured = log2(lSum/lReferenceSum);
+    if(fabs(lMeasured - lExpected) < mTolerance)
+        return eSettled;
+    else
+        return eNotSettled;
+}
+
+/*******************************************/
+void settleDetector::sample(const Mat& pFrame, vector<unsigned char>& pSamples)
+{
+    pSamples.clear();
+    pSamples.reserve((pFrame.rows/mStep+1)*(pFrame.cols/mStep+1));
+
+    // Green channel of color frames. With an even step, samples of raw
+    // frames all fall on the same kind of Bayer site
+    int lChannels = pFrame.channels();
+    int lOffset = lChannels == 3 ? 1 : 0;
+    for(int y=mStep/2; y<pFrame.rows; y+=mStep)
+    {
+        const unsigned char* lPixels = pFrame.ptr<unsigned char>(y);
+        for(int x=mStep/2; x<pFrame.cols; x+=mStep)
+            pSamples.push_back(lPixels[lChannels*x+lOffset]);
+    }
+}
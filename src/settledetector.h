@@ -0,0 +1,58 @@
+// Detects the first frame captured with a new exposure, by comparing it
+// with a reference frame of known exposure: the ratio of their values,
+// measured on a strided subsample, has to match the EV change.
+// Only samples which are neither clipped nor black in the reference and
+// once scaled by the expected ratio are considered.
+
+#ifndef SETTLEDETECTOR_H
+#define SETTLEDETECTOR_H
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+class settleDetector
+{
+public:
+    enum result
+    {
+        eSettled,
+        eNotSettled,
+        eUndecided // too few valid samples, or EV change too small
+    };
+
+    settleDetector();
+    ~settleDetector();
+
+    // Sets the maximum difference between the measured and expected EV changes, in stops
+    void setTolerance(float pStops);
+    // Sets the sampling step, in pixels
+    void setSubsampling(unsigned int pStep);
+
+    // Sets the reference frame, of type RGB8u or raw Bayer (CV_8UC1), and its EV
+    void setReference(const Mat& pFrame, float pEV);
+    // Checks whether the frame has been captured with the given EV
+    result check(const Mat& pFrame, float pEV);
+
+private:
+    /*****************/
+    // Attributes
+    float mTolerance;
+    unsigned int mStep;
+
+    vector<unsigned char> mReference; // green channel of the samples
+    Size mReferenceSize;
+    int mReferenceType;
+    float mReferenceEV;
+
+    /****************/
+    // Methods
+    // Samples the frame, on the green channel for color frames
+    void sample(const Mat& pFrame, vector<unsigned char>& pSamples);
+};
+}
+
+#endif // SETTLEDETECTOR_H
@@ -0,0 +1,62 @@
+/* Layout of the shared memory segments written by sharedMemorySink, for
+ * the processes reading them. All values are native endian.
+ *
+ *   hdrc_shm_header
+ *   slot_count times: hdrc_shm_slot, then slot_size bytes of image data
+ *   (slots and data start on 64 bytes boundaries, see hdrc_shm_slot_offset)
+ *
+ * Each slot is protected by a sequence counter, odd while it is written.
+ * To read the newest image without copy nor syscall:
+ *   1. n = header->latest; if 0, nothing was published yet
+ *   2. slot = slot (n-1) % slot_count; s1 = slot->sequence
+ *   3. if s1 is odd, the slot is being written: retry
+ *   4. use the metadata and the data of the slot
+ *   5. after a read barrier, if slot->sequence != s1, the slot was
+ *      overwritten meanwhile and what was read must be discarded */
+
+#ifndef SHMLAYOUT_H
+#define SHMLAYOUT_H
+
+#include <stdint.h>
+
+#define HDRC_SHM_MAGIC "HDRISHM"
+#define HDRC_SHM_VERSION 1
+
+/* Content of the slots */
+#define HDRC_SHM_PROBE 0 /* live unwrapped probe, BGR 8 bits */
+#define HDRC_SHM_HDRI 1 /* merged HDRI, RGB 32 bits float */
+
+typedef struct
+{
+    char magic[8]; /* HDRC_SHM_MAGIC, null terminated */
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size; /* bytes of image data per slot */
+    volatile uint64_t latest; /* number of images published */
+} hdrc_shm_header;
+
+typedef struct
+{
+    volatile uint64_t sequence; /* odd while the slot is written */
+    uint64_t frame; /* index of the image since the segment was created */
+    double timestamp; /* capture time of the frame, in seconds from a monotonic clock */
+    float ev;
+    uint32_t kind; /* HDRC_SHM_PROBE or HDRC_SHM_HDRI */
+    int32_t width, height;
+    int32_t channels;
+    int32_t depth; /* bytes per channel */
+    uint64_t stride; /* bytes per row */
+    float sphere[3]; /* position and radius of the sphere in the camera image, in pixels */
+    uint32_t reserved;
+} hdrc_shm_slot;
+
+/* Offset of the slot i from the start of the segment, and of its data */
+#define HDRC_SHM_ALIGN(x) (((uint64_t)(x) + 63) & ~(uint64_t)63)
+#define hdrc_shm_slot_offset(header, i) \
+    (HDRC_SHM_ALIGN(sizeof(hdrc_shm_header)) + (uint64_t)(i)*(HDRC_SHM_ALIGN(sizeof(hdrc_shm_slot)) + HDRC_SHM_ALIGN((header)->slot_size)))
+#define hdrc_shm_data_offset(header, i) \
+    (hdrc_shm_slot_offset(header, i) + HDRC_SHM_ALIGN(sizeof(hdrc_shm_slot)))
+/* Size of the segment */
+#define hdrc_shm_size(header) hdrc_shm_slot_offset(header, (header)->slot_count)
+
+#endif /* SHMLAYOUT_H */
@@ -0,0 +1,149 @@
+#include "shmsink.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace paper;
+
+/*******************************************/
+sharedMemorySink::sharedMemorySink()
+{
+    mMapping = NULL;
+    mMappingSize = 0;
+    mHeader = NULL;
+}
+
+/*******************************************/
+sharedMemorySink::~sharedMemorySink()
+{
+    close();
+}
+
+/*******************************************/
+bool sharedMemorySink::open(const char* pName, unsigned int pSlots, size_t pSlotSize)
+{
+    close();
+    if(pSlots == 0 || pSlotSize == 0)
+        return false;
+
+    hdrc_shm_header lHeader;
+    memset(&lHeader, 0, sizeof(lHeader));
+    strncpy(lHeader.magic, HDRC_SHM_MAGIC, sizeof(lHeader.magic)-1);
+    lHeader.version = HDRC_SHM_VERSION;
+    lHeader.slot_count = pSlots;
+    lHeader.slot_size = pSlotSize;
+    size_t lSize = hdrc_shm_size(&lHeader);
+
+    // A new segment, so that readers of a previous one are not confused
+    shm_unlink(pName);
+    int lFile = shm_open(pName, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(lFile < 0)
+        return false;
+
+    if(ftruncate(lFile, lSize) != 0)
+    {
+        ::close(lFile);
+        shm_unlink(pName);
+        return false;
+    }
+
+    void* lMapping = mmap(NULL, lSize, PROT_READ | PROT_WRITE, MAP_SHARED, lFile, 0);
+    ::close(lFile);
+    if(lMapping == MAP_FAILED)
+    {
+        shm_unlink(pName);
+        return false;
+    }
+
+    // The segment is zeroed: all the slots are empty, and the header is
+    // published last with the magic
+    mMapping = lMapping;
+    mMappingSize = lSize;
+    mName = pName;
+    mHeader = (hdrc_shm_header*)mMapping;
+
+    lHeader.magic[0] = 0;
+    memcpy(mHeader, &lHeader, sizeof(lHeader));
+    __sync_synchronize();
+    mHeader->magic[0] = HDRC_SHM_MAGIC[0];
+
+    return true;
+}
+
+/*******************************************/
+size_t sharedMemorySink::getSlotSize()
+{
+    return mHeader != NULL ? mHeader->slot_size : 0;
+}
+
+/*******************************************/
+void sharedMemorySink::close()
+{
+    if(mMapping == NULL)
+        return;
+
+    munmap(mMapping, mMappingSize);
+    shm_unlink(mName.c_str());
+
+    mMapping = NULL;
+    mMappingSize = 0;
+    mHeader = NULL;
+    mName.clear();
+}
+
+/*******************************************/
+bool sharedMemorySink::isOpen()
+{
+    return mMapping != NULL;
+}
+
+/*******************************************/
+bool sharedMemorySink::publish(const Mat& pImage, const frameInfo& pInfo, unsigned int pKind, Vec3f pSphere)
+{
+    if(mHeader == NULL || pImage.rows == 0)
+        return false;
+
+    size_t lRowSize = pImage.cols*pImage.elemSize();
+    if(lRowSize*pImage.rows > mHeader->slot_size)
+        return false;
+
+    uint64_t lFrame = mHeader->latest;
+    unsigned int lIndex = lFrame % mHeader->slot_count;
+    hdrc_shm_slot* lSlot = (hdrc_shm_slot*)((char*)mMapping + hdrc_shm_slot_offset(mHeader, lIndex));
+    char* lData = (char*)mMapping + hdrc_shm_data_offset(mHeader, lIndex);
+
+    // Odd while written
+    lSlot->sequence = lSlot->sequence+1;
+    __sync_synchronize();
+
+    lSlot->frame = lFrame;
+    lSlot->timestamp = pInfo.timestamp;
+    lSlot->ev = pInfo.EV;
+    lSlot->kind = pKind;
+    lSlot->width = pImage.cols;
+    lSlot->height = pImage.rows;
+    lSlot->channels = pImage.channels();
+    lSlot->depth = pImage.elemSize1();
+    lSlot->stride = lRowSize;
+    for(int i=0; i<3; i++)
+        lSlot->sphere[i] = pSphere[i];
+
+    if(pImage.isContinuous())
+    {
+        memcpy(lData, pImage.data, lRowSize*pImage.rows);
+    }
+    else
+    {
+        for(int y=0; y<pImage.rows; y++)
+            memcpy(lData + y*lRowSize, pImage.ptr(y), lRowSize);
+    }
+
+    __sync_synchronize();
+    lSlot->sequence = lSlot->sequence+1;
+    __sync_synchronize();
+    mHeader->latest = lFrame+1;
+
+    return true;
+}
@@ -0,0 +1,51 @@
+// Output of images to a POSIX shared memory segment, for local processes
+// (a renderer for example) to read the newest one without copy. The
+// segment is a ring of fixed size slots, see shmlayout.h for its layout
+// and the reading protocol. A sink has a single writer.
+// When the images outgrow the slots, the writer creates a new segment of the
+// same name: readers seeing it replaced (another inode) have to map it again.
+
+#ifndef SHMSINK_H
+#define SHMSINK_H
+
+#include <string>
+#include <opencv2/opencv.hpp>
+
+#include "framering.h"
+#include "shmlayout.h"
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+class sharedMemorySink
+{
+public:
+    sharedMemorySink();
+    ~sharedMemorySink();
+
+    // Creates the segment pName (as "/hdricapture"), replacing any previous one,
+    // with pSlots slots of pSlotSize bytes of data
+    bool open(const char* pName, unsigned int pSlots, size_t pSlotSize);
+    // Unmaps and removes the segment
+    void close();
+    bool isOpen();
+    // Bytes of data per slot, 0 if not open
+    size_t getSlotSize();
+
+    // Copies the image (8 bits or float) in the next slot and publishes it
+    // Returns false if it is larger than a slot
+    bool publish(const Mat& pImage, const frameInfo& pInfo, unsigned int pKind, Vec3f pSphere = Vec3f(0.f, 0.f, 0.f));
+
+private:
+    /*****************/
+    // Attributes
+    string mName;
+    void* mMapping;
+    size_t mMappingSize;
+    hdrc_shm_header* mHeader;
+};
+}
+
+#endif // SHMSINK_H
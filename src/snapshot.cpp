@@ -0,0 +1,276 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace paper;
+
+// Alignment of the data sections
+#define SNAPSHOT_ALIGNMENT 64
+
+/*******************************************/
+// Whether an entry describes a matrix lying in a file of pFileSize bytes.
+// The file may be corrupt or foreign, nothing is trusted
+static bool isValid(const snapshotEntry& pEntry, size_t pFileSize)
+{
+    if(pEntry.offset > pFileSize || pEntry.size > pFileSize - pEntry.offset || pEntry.offset % SNAPSHOT_ALIGNMENT != 0)
+        return false;
+
+    // Known depth, the channels being encoded in the rest of the type
+    if(pEntry.rows <= 0 || pEntry.cols <= 0 || pEntry.type != CV_MAT_TYPE(pEntry.type) || CV_MAT_DEPTH(pEntry.type) > CV_64F)
+        return false;
+
+    // Checked in two steps, so that the product can't wrap
+    uint64_t lElements = (uint64_t)pEntry.rows*(uint64_t)pEntry.cols;
+    if(lElements > pFileSize)
+        return false;
+    return pEntry.size == lElements*CV_ELEM_SIZE(pEntry.type);
+}
+
+/*******************************************/
+snapshot::snapshot()
+{
+    mMapping = NULL;
+    mMappingSize = 0;
+}
+
+/*******************************************/
+snapshot::~snapshot()
+{
+    close();
+}
+
+/*******************************************/
+bool snapshot::open(const char* pFile)
+{
+    close();
+
+    int lFile = ::open(pFile, O_RDONLY);
+    if(lFile < 0)
+        return false;
+
+    struct stat lStat;
+    if(fstat(lFile, &lStat) != 0 || (size_t)lStat.st_size < sizeof(snapshotHeader))
+    {
+        ::close(lFile);
+        return false;
+    }
+
+    // Private mapping: pages are only read from the file when accessed
+    void* lMapping = mmap(NULL, lStat.st_size, PROT_READ, MAP_PRIVATE, lFile, 0);
+    ::close(lFile);
+    if(lMapping == MAP_FAILED)
+        return false;
+
+    const snapshotHeader* lHeader = (const snapshotHeader*)lMapping;
+    size_t lTableEnd = sizeof(snapshotHeader) + (size_t)lHeader->count*sizeof(snapshotEntry);
+    if(strncmp(lHeader->magic, SNAPSHOT_MAGIC, sizeof(lHeader->magic)) != 0
+            || lHeader->version != SNAPSHOT_VERSION
+            || lTableEnd > (size_t)lStat.st_size)
+    {
+        std::cerr << "Invalid snapshot file " << pFile << std::endl;
+        munmap(lMapping, lStat.st_size);
+        return false;
+    }
+
+    mMapping = lMapping;
+    mMappingSize = lStat.st_size;
+
+    // Only the entries lying in the file are kept
+    const snapshotEntry* lEntries = (const snapshotEntry*)((const char*)lMapping + sizeof(snapshotHeader));
+    for(unsigned int i=0; i<lHeader->count; i++)
+    {
+        snapshotEntry lEntry = lEntries[i];
+        lEntry.name[sizeof(lEntry.name)-1] = 0;
+
+        if(!isValid(lEntry, mMappingSize))
+            continue;
+
+        mEntries.push_back(lEntry);
+    }
+
+    return true;
+}
+
+/*******************************************/
+void snapshot::close()
+{
+    if(mMapping != NULL)
+        munmap(mMapping, mMappingSize);
+
+    mMapping = NULL;
+    mMappingSize = 0;
+    mEntries.clear();
+}
+
+/*******************************************/
+Mat snapshot::getMat(const char* pName, uint64_t pHash)
+{
+    int lIndex = findEntry(pName);
+    if(lIndex < 0 || mEntries[lIndex].hash != pHash)
+        return Mat();
+
+    const snapshotEntry& lEntry = mEntries[lIndex];
+    return Mat(lEntry.rows, lEntry.cols, lEntry.type, (char*)mMapping + lEntry.offset);
+}
+
+/*******************************************/
+vector<string> snapshot::getNames(const char* pPrefix)
+{
+    vector<string> lNames;
+    size_t lLength = strlen(pPrefix);
+
+    for(unsigned int i=0; i<mEntries.size(); i++)
+    {
+        if(strncmp(mEntries[i].name, pPrefix, lLength) == 0)
+            lNames.push_back(mEntries[i].name);
+    }
+
+    return lNames;
+}
+
+/*******************************************/
+void snapshot::addMat(const char* pName, const Mat& pMat, uint64_t pHash)
+{
+    if(pMat.rows == 0 || strlen(pName) >= sizeof(((snapshotEntry*)0)->name))
+        return;
+
+    pendingEntry lEntry;
+    lEntry.name = pName;
+    lEntry.data = pMat.isContinuous() ? pMat : pMat.clone();
+    lEntry.hash = pHash;
+
+    for(unsigned int i=0; i<mPending.size(); i++)
+    {
+        if(mPending[i].name == lEntry.name)
+        {
+            mPending[i] = lEntry;
+            return;
+        }
+    }
+
+    mPending.push_back(lEntry);
+}
+
+/*******************************************/
+bool snapshot::write(const char* pFile)
+{
+    // Mapped entries not replaced by new ones are kept
+    vector<pendingEntry> lEntries = mPending;
+    for(unsigned int i=0; i<mEntries.size(); i++)
+    {
+        bool lReplaced = false;
+        for(unsigned int j=0; j<mPending.size(); j++)
+            lReplaced |= mPending[j].name == mEntries[i].name;
+        if(lReplaced)
+            continue;
+
+        pendingEntry lEntry;
+        lEntry.name = mEntries[i].name;
+        lEntry.data = getMat(mEntries[i].name, mEntries[i].hash);
+        lEntry.hash = mEntries[i].hash;
+        lEntries.push_back(lEntry);
+    }
+
+    snapshotHeader lHeader;
+    memset(&lHeader, 0, sizeof(lHeader));
+    strncpy(lHeader.magic, SNAPSHOT_MAGIC, sizeof(lHeader.magic)-1);
+    lHeader.version = SNAPSHOT_VERSION;
+    lHeader.count = lEntries.size();
+
+    vector<snapshotEntry> lTable(lEntries.size());
+    uint64_t lOffset = sizeof(snapshotHeader) + lEntries.size()*sizeof(snapshotEntry);
+    for(unsigned int i=0; i<lEntries.size(); i++)
+    {
+        memset(&lTable[i], 0, sizeof(snapshotEntry));
+        strncpy(lTable[i].name, lEntries[i].name.c_str(), sizeof(lTable[i].name)-1);
+        lTable[i].hash = lEntries[i].hash;
+        lTable[i].rows = lEntries[i].data.rows;
+        lTable[i].cols = lEntries[i].data.cols;
+        lTable[i].type = lEntries[i].data.type();
+        lTable[i].size = lEntries[i].data.total()*lEntries[i].data.elemSize();
+
+        lOffset = (lOffset + SNAPSHOT_ALIGNMENT-1) & ~(uint64_t)(SNAPSHOT_ALIGNMENT-1);
+        lTable[i].offset = lOffset;
+        lOffset += lTable[i].size;
+    }
+
+    string lTemporary = string(pFile) + ".tmp";
+    FILE* lFile = fopen(lTemporary.c_str(), "wb");
+    if(lFile == NULL)
+        return false;
+
+    bool lResult = true;
+    char lPadding[SNAPSHOT_ALIGNMENT] = {0};
+    uint64_t lPosition = 0;
+
+    lResult &= fwrite(&lHeader, sizeof(lHeader), 1, lFile) == 1;
+    if(lTable.size() != 0)
+        lResult &= fwrite(&lTable[0], sizeof(snapshotEntry), lTable.size(), lFile) == lTable.size();
+    lPosition = sizeof(snapshotHeader) + lTable.size()*sizeof(snapshotEntry);
+
+    for(unsigned int i=0; i<lTable.size() && lResult; i++)
+    {
+        lResult &= fwrite(lPadding, 1, lTable[i].offset-lPosition, lFile) == lTable[i].offset-lPosition;
+        lResult &= fwrite(lEntries[i].data.data, 1, lTable[i].size, lFile) == lTable[i].size;
+        lPosition = lTable[i].offset + lTable[i].size;
+    }
+
+    lResult &= fclose(lFile) == 0;
+    if(lResult)
+        lResult = rename(lTemporary.c_str(), pFile) == 0;
+    else
+        remove(lTemporary.c_str());
+
+    if(lResult)
+        mPending.clear();
+
+    return lResult;
+}
+
+/*******************************************/
+uint64_t snapshot::hash(const void* pData, size_t pSize, uint64_t pSeed)
+{
+    const unsigned char* lData = (const unsigned char*)pData;
+    uint64_t lHash = pSeed;
+    for(size_t i=0; i<pSize; i++)
+    {
+        lHash ^= lData[i];
+        lHash *= 1099511628211ULL;
+    }
+
+    return lHash;
+}
+
+/*******************************************/
+uint64_t snapshot::hashFile(const char* pFile, uint64_t pSeed)
+{
+    FILE* lFile = fopen(pFile, "rb");
+    if(lFile == NULL)
+        return pSeed;
+
+    uint64_t lHash = pSeed;
+    char lBuffer[4096];
+    size_t lRead;
+    while((lRead = fread(lBuffer, 1, sizeof(lBuffer), lFile)) != 0)
+        lHash = hash(lBuffer, lRead, lHash);
+
+    fclose(lFile);
+    return lHash;
+}
+
+/*******************************************/
+int snapshot::findEntry(const char* pName)
+{
+    for(unsigned int i=0; i<mEntries.size(); i++)
+    {
+        if(strcmp(mEntries[i].name, pName) == 0)
+            return i;
+    }
+
+    return -1;
+}
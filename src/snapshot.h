@@ -0,0 +1,96 @@
+// Binary snapshot of the state of the pipeline (undistortion maps, ICC LUT,
+// sphere geometry and maps), to start at steady-state speed instead of
+// recomputing it. Each entry is a matrix tagged with a hash of the inputs it
+// has been computed from: an entry is only returned if the hash matches.
+//
+// The file is memory-mapped as is. All values are native endian, sections
+// are aligned on 64 bytes:
+//   snapshotHeader
+//   snapshotEntry, header.count times
+//   data of each entry, continuous rows
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+#define SNAPSHOT_MAGIC "HDRISNP"
+#define SNAPSHOT_VERSION 1
+// FNV-1a offset basis, initial value of the hashes
+#define SNAPSHOT_HASH_SEED 14695981039346656037ULL
+
+struct snapshotHeader
+{
+    char magic[8]; // SNAPSHOT_MAGIC, null terminated
+    uint32_t version;
+    uint32_t count; // number of entries
+};
+
+struct snapshotEntry
+{
+    char name[48]; // null terminated
+    uint64_t hash; // hash of the inputs
+    uint64_t offset; // offset of the data, in bytes from the start of the file
+    uint64_t size; // size of the data, in bytes
+    int32_t rows, cols, type; // of the matrix
+    int32_t reserved;
+};
+
+class snapshot
+{
+public:
+    snapshot();
+    ~snapshot();
+
+    // Maps the given file. Returns false if it is missing or invalid
+    bool open(const char* pFile);
+    void close();
+
+    // Returns the entry of the given name, if its hash matches, or an empty Mat
+    // The Mat points to the mapped file: it is valid until the snapshot is closed,
+    // and must not be modified
+    Mat getMat(const char* pName, uint64_t pHash);
+    // Names of the entries starting with pPrefix
+    vector<string> getNames(const char* pPrefix);
+
+    // Adds (or replaces) an entry to write
+    void addMat(const char* pName, const Mat& pMat, uint64_t pHash);
+    // Writes the added entries, along with the mapped ones which were not replaced
+    // The file is written aside then renamed, so that a mapped file stays valid
+    bool write(const char* pFile);
+
+    // 64 bits FNV-1a hash of the data, chained with pSeed
+    static uint64_t hash(const void* pData, size_t pSize, uint64_t pSeed = SNAPSHOT_HASH_SEED);
+    // Same, for the content of a file. Returns pSeed if the file can't be read
+    static uint64_t hashFile(const char* pFile, uint64_t pSeed = SNAPSHOT_HASH_SEED);
+
+private:
+    struct pendingEntry
+    {
+        string name;
+        Mat data;
+        uint64_t hash;
+    };
+
+    /*****************/
+    // Attributes
+    void* mMapping;
+    size_t mMappingSize;
+    vector<snapshotEntry> mEntries; // entries of the mapped file
+    vector<pendingEntry> mPending; // entries to write
+
+    /****************/
+    // Methods
+    // Returns the index of the mapped entry of the given name, -1 if none
+    int findEntry(const char* pName);
+};
+}
+
+#endif // SNAPSHOT_H
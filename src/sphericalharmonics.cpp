@@ -0,0 +1,244 @@
+#include "sphericalharmonics.h"
+
+#include <stdio.h>
+
+#include "scheduler.h"
+
+using namespace paper;
+
+// Maximum number of coefficients, for 3 bands
+#define SH_MAX_COEFFS 9
+// Pixels summed in separate partial sums, so that the compiler can vectorize
+// the float reduction without reassociating it
+#define SH_LANES 4
+
+/*******************************************/
+// Accumulates the product of the probe and the table over blocks of rows
+// Each block writes its partial sums in its own slot, they are summed afterward
+class shAccumulator : public ParallelLoopBody
+{
+public:
+    shAccumulator(const Mat& pProbe, const Mat& pTable, int pCoeffs, int pBlockSize, float* pSums)
+        : mProbe(pProbe), mTable(pTable), mCoeffs(pCoeffs), mBlockSize(pBlockSize), mSums(pSums) {}
+
+    void operator()(const Range& pRange) const
+    {
+        int lCoeffs = mCoeffs;
+        int lWidth = mProbe.cols;
+
+        for(int lBlock=pRange.start; lBlock<pRange.end; lBlock++)
+        {
+            float* lSums = mSums + lBlock*SH_MAX_COEFFS*3;
+            for(int i=0; i<SH_MAX_COEFFS*3; i++)
+                lSums[i] = 0.f;
+
+            int lEnd = min((lBlock+1)*mBlockSize, mProbe.rows);
+            for(int y=lBlock*mBlockSize; y<lEnd; y++)
+            {
+                const float* lPixels = mProbe.ptr<float>(y);
+                for(int k=0; k<lCoeffs; k++)
+                {
+                    const float* lWeights = mTable.ptr<float>(k) + y*lWidth;
+
+                    // The partial sums follow the RGB layout of SH_LANES pixels
+                    float lPartial[3*SH_LANES];
+                    for(int j=0; j<3*SH_LANES; j++)
+                        lPartial[j] = 0.f;
+                    int x = 0;
+                    for(; x+SH_LANES<=lWidth; x+=SH_LANES)
+                    {
+                        const float* lBlockPixels = lPixels + 3*x;
+                        for(int j=0; j<3*SH_LANES; j++)
+                            lPartial[j] += lWeights[x+j/3]*lBlockPixels[j];
+                    }
+
+                    float lR = 0.f, lG = 0.f, lB = 0.f;
+                    for(int l=0; l<SH_LANES; l++)
+                    {
+                        lR += lPartial[3*l];
+                        lG += lPartial[3*l+1];
+                        lB += lPartial[3*l+2];
+                    }
+                    for(; x<lWidth; x++)
+                    {
+                        lR += lWeights[x]*lPixels[3*x];
+                        lG += lWeights[x]*lPixels[3*x+1];
+                        lB += lWeights[x]*lPixels[3*x+2];
+                    }
+                    lSums[3*k] += lR;
+                    lSums[3*k+1] += lG;
+                    lSums[3*k+2] += lB;
+                }
+            }
+        }
+    }
+
+private:
+    const Mat& mProbe;
+    const Mat& mTable;
+    int mCoeffs;
+    int mBlockSize;
+    float* mSums;
+};
+
+/*******************************************/
+sphericalHarmonics::sphericalHarmonics()
+{
+    mOrder = 3;
+}
+
+/*******************************************/
+sphericalHarmonics::~sphericalHarmonics()
+{
+}
+
+/*******************************************/
+void sphericalHarmonics::setOrder(unsigned int pOrder)
+{
+    mOrder = max(min(pOrder, 3u), 2u);
+}
+
+/*******************************************/
+bool sphericalHarmonics::compute(Mat pProbe, projection pProjection)
+{
+    if(pProbe.rows == 0 || pProbe.type() != CV_32FC3)
+        return false;
+
+    Mat lTable = getTable(pProjection, pProbe.size());
+    int lCoeffs = mOrder*mOrder;
+
+    // Blocks of rows are summed in parallel
+    int lBlockSize = 16;
+    int lBlocks = (pProbe.rows+lBlockSize-1)/lBlockSize;
+    vector<float> lSums(lBlocks*SH_MAX_COEFFS*3);
+
+    shAccumulator lAccumulator(pProbe, lTable, lCoeffs, lBlockSize, &lSums[0]);
+    scheduler::parallelFor(Range(0, lBlocks), lAccumulator);
+
+    mCoefficients.assign(lCoeffs, Vec3f(0.f, 0.f, 0.f));
+    for(int lBlock=0; lBlock<lBlocks; lBlock++)
+    {
+        for(int k=0; k<lCoeffs; k++)
+        {
+            for(int c=0; c<3; c++)
+                mCoefficients[k][c] += lSums[(lBlock*SH_MAX_COEFFS+k)*3+c];
+        }
+    }
+
+    return true;
+}
+
+/*******************************************/
+vector<Vec3f> sphericalHarmonics::getCoefficients()
+{
+    return mCoefficients;
+}
+
+/*******************************************/
+bool sphericalHarmonics::write(const char* pFile)
+{
+    FILE* lFile = fopen(pFile, "w");
+    if(lFile == NULL)
+        return false;
+
+    for(unsigned int i=0; i<mCoefficients.size(); i++)
+        fprintf(lFile, "%g %g %g\n", mCoefficients[i][0], mCoefficients[i][1], mCoefficients[i][2]);
+
+    fclose(lFile);
+    return true;
+}
+
+/*******************************************/
+Mat sphericalHarmonics::getTable(projection pProjection, Size pSize)
+{
+    std::pair<int, std::pair<int, int> > lKey(pProjection, std::make_pair(pSize.width, pSize.height));
+    std::map<std::pair<int, std::pair<int, int> >, Mat>::iterator lTable = mTables.find(lKey);
+    if(lTable != mTables.end())
+        return lTable->second;
+
+    Mat lNewTable;
+    switch(pProjection)
+    {
+    case eCubemap:
+        lNewTable = createTable<cubemapProjection>(pSize);
+        break;
+    case eOctahedral:
+        lNewTable = createTable<octahedralProjection>(pSize);
+        break;
+    case eAngular:
+        lNewTable = createTable<angularProjection>(pSize);
+        break;
+    default:
+        lNewTable = createTable<equirectangularProjection>(pSize);
+    }
+
+    mTables[lKey] = lNewTable;
+    return lNewTable;
+}
+
+/*******************************************/
+template<class Projection>
+Mat sphericalHarmonics::createTable(Size pSize)
+{
+    Mat lTable = Mat::zeros(SH_MAX_COEFFS, pSize.width*pSize.height, CV_32F);
+
+    float lUCoeff = 1.f/(float)pSize.width;
+    float lVCoeff = 1.f/(float)pSize.height;
+    // Slightly less than half a pixel, to stay on the same cubemap face
+    float lDelta = 0.49f;
+
+    double lTotal = 0.0;
+    for(int y=0; y<pSize.height; y++)
+    {
+        for(int x=0; x<pSize.width; x++)
+        {
+            float lU = ((float)x+0.5f)*lUCoeff;
+            float lV = ((float)y+0.5f)*lVCoeff;
+
+            // The solid angle of the pixel is estimated from the directions
+            // on its borders
+            Vec3f lDirection, lLeft, lRight, lTop, lBottom;
+            if(!Projection::direction(lU, lV, lDirection)
+                    || !Projection::direction(lU-lDelta*lUCoeff, lV, lLeft)
+                    || !Projection::direction(lU+lDelta*lUCoeff, lV, lRight)
+                    || !Projection::direction(lU, lV-lDelta*lVCoeff, lTop)
+                    || !Projection::direction(lU, lV+lDelta*lVCoeff, lBottom))
+                continue;
+
+            Vec3f lCross = (lRight-lLeft).cross(lBottom-lTop);
+            float lSolidAngle = sqrtf(lCross.dot(lCross))/(4.f*lDelta*lDelta);
+            lTotal += lSolidAngle;
+
+            float lBasis[SH_MAX_COEFFS];
+            evaluateBasis(directionToGL(lDirection), lBasis);
+            for(int k=0; k<SH_MAX_COEFFS; k++)
+                lTable.at<float>(k, y*pSize.width+x) = lBasis[k]*lSolidAngle;
+        }
+    }
+
+    // The sum of the solid angles has to be the whole sphere
+    if(lTotal > 0.0)
+        lTable *= 4.0*M_PI/lTotal;
+
+    return lTable;
+}
+
+/*******************************************/
+void sphericalHarmonics::evaluateBasis(Vec3f pDirection, float* pBasis)
+{
+    float lX = pDirection[0];
+    float lY = pDirection[1];
+    float lZ = pDirection[2];
+
+    pBasis[0] = 0.282095f;
+
+    pBasis[1] = 0.488603f*lY;
+    pBasis[2] = 0.488603f*lZ;
+    pBasis[3] = 0.488603f*lX;
+
+    pBasis[4] = 1.092548f*lX*lY;
+    pBasis[5] = 1.092548f*lY*lZ;
+    pBasis[6] = 0.315392f*(3.f*lZ*lZ-1.f);
+    pBasis[7] = 1.092548f*lX*lZ;
+    pBasis[8] = 0.546274f*(lX*lX-lY*lY);
+}
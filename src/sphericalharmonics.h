@@ -0,0 +1,60 @@
+// Projects a probe (typically the HDRI) on the spherical harmonics basis,
+// to get the low-order lighting directly from the capture.
+// Coefficients are expressed in the OpenGL frame (see projection.h),
+// ordered as in Sloan's "Stupid SH tricks".
+
+#ifndef SPHERICALHARMONICS_H
+#define SPHERICALHARMONICS_H
+
+#include <map>
+#include <opencv2/opencv.hpp>
+
+#include "projection.h"
+
+using namespace std;
+using namespace cv;
+
+namespace paper
+{
+class sphericalHarmonics
+{
+public:
+    sphericalHarmonics();
+    ~sphericalHarmonics();
+
+    // Number of bands, 2 (4 coefficients) or 3 (9 coefficients)
+    void setOrder(unsigned int pOrder);
+
+    // Computes the coefficients from a probe in the given projection
+    // The probe must be of type RGB32f
+    bool compute(Mat pProbe, projection pProjection);
+
+    // Retrieves the coefficients, as RGB triplets
+    // To call after the computation
+    vector<Vec3f> getCoefficients();
+
+    // Writes the coefficients in a text file, one RGB triplet per line
+    bool write(const char* pFile);
+
+private:
+    /*****************/
+    // Attributes
+    unsigned int mOrder;
+    vector<Vec3f> mCoefficients;
+
+    // Basis times solid angle for each pixel, one row per coefficient,
+    // cached for each projection and output size
+    std::map<std::pair<int, std::pair<int, int> >, Mat> mTables;
+
+    /****************/
+    // Methods
+    // Returns the table for the given projection and size, creates it if needed
+    Mat getTable(projection pProjection, Size pSize);
+    template<class Projection> Mat createTable(Size pSize);
+
+    // Evaluates the basis for the given direction
+    static void evaluateBasis(Vec3f pDirection, float* pBasis);
+};
+}
+
+#endif // SPHERICALHARMONICS_H
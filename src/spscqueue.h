@@ -0,0 +1,223 @@
+// Bounded queue between a single producer and a single consumer thread.
+// Items are passed through a ring of slots without locking: the producer
+// owns the tail, the consumer claims items by moving the head forward.
+// When the queue is full, the producer either waits (eBlock) or drops the
+// oldest item (eDropOldest), by moving the head forward itself. The slot
+// being read by the consumer is announced, so that it is never overwritten.
+// Threads only sleep on a condition when they have to wait, and nobody is
+// notified unless someone is waiting.
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "trace.h"
+
+namespace paper
+{
+template<class T>
+class spscQueue
+{
+public:
+    enum policy
+    {
+        eBlock,
+        eDropOldest
+    };
+
+    spscQueue(unsigned int pCapacity = 4, policy pPolicy = eBlock)
+    {
+        mCapacity = pCapacity == 0 ? 1 : pCapacity;
+        mSlots.resize(mCapacity+1);
+        mHead = mTail = 0;
+        mReading = -1;
+        mPolicy = pPolicy;
+        mClosed = false;
+        mDropped = 0;
+        mWaiters = 0;
+    }
+
+    // Producer side
+    void setPolicy(policy pPolicy)
+    {
+        mPolicy = pPolicy;
+    }
+
+    // Producer side. Returns false if the queue is closed
+    bool push(const T& pItem)
+    {
+        unsigned long long lTail = mTail;
+        for(;;)
+        {
+            if(mClosed)
+                return false;
+
+            unsigned long long lHead = mHead;
+            if(lTail - lHead < mCapacity)
+                break;
+
+            if(mPolicy == eDropOldest)
+            {
+                // The consumer may have claimed it meanwhile, in which case we retry
+                if(__sync_bool_compare_and_swap(&mHead, lHead, lHead+1))
+                {
+                    __sync_fetch_and_add(&mDropped, 1);
+                    break;
+                }
+            }
+            else
+            {
+                wait(true, -1.0);
+            }
+        }
+
+        // The consumer may still be reading this slot, if the oldest items
+        // were dropped meanwhile. It is only a copy away from releasing it
+        unsigned int lSlot = lTail % mSlots.size();
+        __sync_synchronize();
+        while(mReading >= 0 && (unsigned long long)mReading % mSlots.size() == lSlot)
+        {
+            boost::this_thread::yield();
+            __sync_synchronize();
+        }
+
+        mSlots[lSlot] = pItem;
+        __sync_synchronize();
+        mTail = lTail+1;
+
+        notify();
+        return true;
+    }
+
+    // Consumer side. Waits up to pTimeout seconds (forever if negative) for an item
+    // Returns false on timeout, or if the queue is closed and empty
+    bool pop(T& pItem, double pTimeout = -1.0)
+    {
+        for(;;)
+        {
+            if(tryPop(pItem))
+                return true;
+            if(mClosed || !wait(false, pTimeout))
+                return tryPop(pItem);
+        }
+    }
+
+    // Consumer side. Returns false if the queue is empty
+    bool tryPop(T& pItem)
+    {
+        for(;;)
+        {
+            unsigned long long lHead = mHead;
+            mReading = lHead;
+            __sync_synchronize();
+
+            if(lHead == mTail)
+            {
+                mReading = -1;
+                return false;
+            }
+
+            // Fails if the producer dropped this item
+            if(!__sync_bool_compare_and_swap(&mHead, lHead, lHead+1))
+                continue;
+
+            T& lSlot = mSlots[lHead % mSlots.size()];
+            pItem = lSlot;
+            lSlot = T();
+            __sync_synchronize();
+            mReading = -1;
+
+            notify();
+            return true;
+        }
+    }
+
+    // Wakes up the waiting threads, following push and pop fail
+    void close()
+    {
+        mClosed = true;
+        __sync_synchronize();
+
+        boost::mutex::scoped_lock lLock(mWaitMutex);
+        mWaitCondition.notify_all();
+    }
+
+    bool isClosed()
+    {
+        return mClosed;
+    }
+
+    unsigned int size()
+    {
+        return (unsigned int)(mTail - mHead);
+    }
+
+    // Number of items dropped since the creation of the queue
+    unsigned long long getDropped()
+    {
+        return mDropped;
+    }
+
+private:
+    /*****************/
+    // Attributes
+    std::vector<T> mSlots; // one more than the capacity
+    unsigned int mCapacity;
+    volatile unsigned long long mHead, mTail;
+    volatile long long mReading; // index read by the consumer, -1 if none
+    volatile int mPolicy;
+    volatile bool mClosed;
+    volatile unsigned long long mDropped;
+
+    // Only used to sleep while waiting
+    boost::mutex mWaitMutex;
+    boost::condition_variable mWaitCondition;
+    volatile int mWaiters;
+
+    /****************/
+    // Methods
+    // Waits for some space (producer) or an item (consumer)
+    bool wait(bool pSpace, double pTimeout)
+    {
+        traceScope lTrace(pSpace ? "queue full" : "queue empty");
+        boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::microseconds((long)(pTimeout*1e6));
+
+        boost::mutex::scoped_lock lLock(mWaitMutex);
+        __sync_fetch_and_add(&mWaiters, 1);
+
+        bool lReady;
+        while(!(lReady = isReady(pSpace)) && !mClosed)
+        {
+            if(pTimeout < 0.0)
+                mWaitCondition.wait(lLock);
+            else if(!mWaitCondition.timed_wait(lLock, lDeadline))
+                break;
+        }
+
+        __sync_fetch_and_sub(&mWaiters, 1);
+        return lReady || isReady(pSpace);
+    }
+
+    bool isReady(bool pSpace)
+    {
+        if(pSpace)
+            return mTail - mHead < mCapacity;
+        else
+            return mHead != mTail;
+    }
+
+    void notify()
+    {
+        __sync_synchronize();
+        if(mWaiters == 0)
+            return;
+
+        boost::mutex::scoped_lock lLock(mWaitMutex);
+        mWaitCondition.notify_all();
+    }
+};
+}
+
+#endif // SPSCQUEUE_H
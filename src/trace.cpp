@@ -0,0 +1,158 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "metrics.h"
+
+using namespace paper;
+
+namespace
+{
+struct traceEvent
+{
+    const char* name;
+    double start, end;
+};
+
+struct threadBuffer
+{
+    std::vector<traceEvent> events;
+    volatile unsigned long long count; // number of events recorded, the last ones are kept
+    const char* name;
+    unsigned int id;
+};
+
+volatile bool gTracing = false;
+unsigned int gBufferSize = 65536;
+double gOrigin = 0.0;
+
+// Buffers are owned by this list, not by their thread: threads may end
+// before the trace is written. The mutex is only taken once per thread
+boost::mutex gBuffersMutex;
+std::vector<threadBuffer*> gBuffers;
+
+void keepBuffer(threadBuffer* pBuffer)
+{
+}
+boost::thread_specific_ptr<threadBuffer> gThreadBuffer(keepBuffer);
+
+threadBuffer* getThreadBuffer()
+{
+    threadBuffer* lBuffer = gThreadBuffer.get();
+    if(lBuffer != NULL)
+        return lBuffer;
+
+    lBuffer = new threadBuffer;
+    lBuffer->events.resize(gBufferSize);
+    lBuffer->count = 0;
+    lBuffer->name = NULL;
+    {
+        boost::mutex::scoped_lock lLock(gBuffersMutex);
+        lBuffer->id = gBuffers.size()+1;
+        gBuffers.push_back(lBuffer);
+    }
+
+    gThreadBuffer.reset(lBuffer);
+    return lBuffer;
+}
+}
+
+/*******************************************/
+void trace::start(unsigned int pEvents)
+{
+    gBufferSize = pEvents == 0 ? 1 : pEvents;
+    gOrigin = metrics::now();
+    __sync_synchronize();
+    gTracing = true;
+}
+
+/*******************************************/
+void trace::stop()
+{
+    gTracing = false;
+}
+
+/*******************************************/
+bool trace::isEnabled()
+{
+    return gTracing;
+}
+
+/*******************************************/
+bool trace::write(const char* pFile)
+{
+    FILE* lFile = fopen(pFile, "w");
+    if(lFile == NULL)
+        return false;
+
+    int lPid = getpid();
+    bool lFirst = true;
+    fprintf(lFile, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    boost::mutex::scoped_lock lLock(gBuffersMutex);
+    for(unsigned int b=0; b<gBuffers.size(); b++)
+    {
+        const threadBuffer* lBuffer = gBuffers[b];
+        if(lBuffer->name != NULL)
+        {
+            fprintf(lFile, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+                    lFirst ? "" : ",\n", lPid, lBuffer->id, lBuffer->name);
+            lFirst = false;
+        }
+
+        // Complete events, in microseconds
+        unsigned long long lCount = lBuffer->count;
+        unsigned long long lSize = lBuffer->events.size();
+        for(unsigned long long i = lCount > lSize ? lCount-lSize : 0; i<lCount; i++)
+        {
+            const traceEvent& lEvent = lBuffer->events[i % lSize];
+            fprintf(lFile, "%s{\"name\": \"%s\", \"cat\": \"hdricapture\", \"ph\": \"X\", \"ts\": %.1f, \"dur\": %.1f, \"pid\": %d, \"tid\": %u}",
+                    lFirst ? "" : ",\n", lEvent.name, (lEvent.start-gOrigin)*1e6, (lEvent.end-lEvent.start)*1e6, lPid, lBuffer->id);
+            lFirst = false;
+        }
+    }
+
+    fprintf(lFile, "\n]}\n");
+    return fclose(lFile) == 0;
+}
+
+/*******************************************/
+void trace::setThreadName(const char* pName)
+{
+    if(!gTracing)
+        return;
+
+    getThreadBuffer()->name = pName;
+}
+
+/*******************************************/
+void trace::addEvent(const char* pName, double pStart, double pEnd)
+{
+    if(!gTracing)
+        return;
+
+    threadBuffer* lBuffer = getThreadBuffer();
+    traceEvent& lEvent = lBuffer->events[lBuffer->count % lBuffer->events.size()];
+    lEvent.name = pName;
+    lEvent.start = pStart;
+    lEvent.end = pEnd;
+    __sync_synchronize();
+    lBuffer->count = lBuffer->count+1;
+}
+
+/*******************************************/
+traceScope::traceScope(const char* pName)
+{
+    mName = pName;
+    mStart = gTracing ? metrics::now() : -1.0;
+}
+
+/*******************************************/
+traceScope::~traceScope()
+{
+    if(mStart >= 0.0)
+        trace::addEvent(mName, mStart, metrics::now());
+}
@@ -0,0 +1,43 @@
+// Timeline of the processing, written in the Chrome trace event format
+// (chrome://tracing, Perfetto). Each thread records its events in its own
+// ring buffer without locking, the oldest events being overwritten when it
+// is full. When tracing is disabled, a scope only costs the test of a flag.
+// Event names are not copied: they must be string literals.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+namespace paper
+{
+class trace
+{
+public:
+    // Enables the recording, with pEvents events kept per thread
+    static void start(unsigned int pEvents = 65536);
+    static void stop();
+    static bool isEnabled();
+
+    // Writes the events recorded by all the threads. Should be called once
+    // the threads are stopped, or the latest events may be torn
+    static bool write(const char* pFile);
+
+    // Name of the calling thread in the trace
+    static void setThreadName(const char* pName);
+    // Adds an event to the buffer of the calling thread, times from metrics::now
+    static void addEvent(const char* pName, double pStart, double pEnd);
+};
+
+// Records an event covering its scope
+class traceScope
+{
+public:
+    traceScope(const char* pName);
+    ~traceScope();
+
+private:
+    const char* mName;
+    double mStart; // negative if not tracing
+};
+}
+
+#endif // TRACE_H